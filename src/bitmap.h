@@ -62,3 +62,95 @@ static inline void pc_init_bitmap(unsigned long* bitmap, char value, unsigned lo
 
 	memset(bitmap, value, byte_count);
 }
+
+/// set count bits from nr, the whole words in between at once
+static inline void pc_set_bits(unsigned long* bitmap, unsigned long long nr, unsigned long long count)
+{
+	unsigned long long end = nr + count;
+
+	while (nr < end && (nr & (PART_BITS_PER_LONG - 1)))
+		pc_set_bit(nr++, bitmap, end);
+	if (end - nr >= PART_BITS_PER_LONG) {
+		memset(bitmap + nr / PART_BITS_PER_LONG, 0xFF, (end - nr) / PART_BITS_PER_LONG * PART_BYTES_PER_LONG);
+		nr += (end - nr) & ~(unsigned long long)(PART_BITS_PER_LONG - 1);
+	}
+	while (nr < end)
+		pc_set_bit(nr++, bitmap, end);
+}
+
+/**
+ * Word at a time scans. Bits at or after total are never reported, even
+ * when they are set in the last word.
+ *
+ * pc_find_next_set	- first set bit at or after nr, total when there is none
+ * pc_find_next_zero	- first clear bit at or after nr, total when there is none
+ * pc_next_extent	- next run of set bits, see below
+ * pc_count_bits	- number of set bits below total
+ */
+static inline unsigned long long
+pc_find_next_bit(const unsigned long *bitmap, unsigned long long nr,
+		 unsigned long long total, unsigned long invert)
+{
+	unsigned long long i = nr / PART_BITS_PER_LONG;
+	unsigned long long words = BITS_TO_LONGS(total);
+	unsigned long word;
+
+	if (nr >= total)
+		return total;
+
+	word = (bitmap[i] ^ invert) & (~0UL << (nr & (PART_BITS_PER_LONG - 1)));
+	while (!word) {
+		if (++i >= words)
+			return total;
+		word = bitmap[i] ^ invert;
+	}
+
+	nr = i * PART_BITS_PER_LONG + __builtin_ctzl(word);
+	return nr < total ? nr : total;
+}
+
+static inline unsigned long long
+pc_find_next_set(const unsigned long *bitmap, unsigned long long nr,
+		 unsigned long long total)
+{
+	return pc_find_next_bit(bitmap, nr, total, 0UL);
+}
+
+static inline unsigned long long
+pc_find_next_zero(const unsigned long *bitmap, unsigned long long nr,
+		  unsigned long long total)
+{
+	return pc_find_next_bit(bitmap, nr, total, ~0UL);
+}
+
+/**
+ * Find the next run of set bits at or after *nr, cut to max bits. Set *nr
+ * to its first bit and return its length, or 0 at the end of the bitmap.
+ */
+static inline unsigned long long
+pc_next_extent(const unsigned long *bitmap, unsigned long long *nr,
+	       unsigned long long max, unsigned long long total)
+{
+	unsigned long long start = pc_find_next_set(bitmap, *nr, total);
+	unsigned long long limit = total - start > max ? start + max : total;
+
+	*nr = start;
+	if (start == total)
+		return 0;
+	return pc_find_next_zero(bitmap, start, limit) - start;
+}
+
+static inline unsigned long long
+pc_count_bits(const unsigned long *bitmap, unsigned long long total)
+{
+	unsigned long long i, count = 0;
+	unsigned long long full = total / PART_BITS_PER_LONG;
+	unsigned long rest = total & (PART_BITS_PER_LONG - 1);
+
+	for (i = 0; i < full; i++)
+		count += __builtin_popcountl(bitmap[i]);
+	if (rest)
+		count += __builtin_popcountl(bitmap[full] & ((1UL << rest) - 1));
+
+	return count;
+}
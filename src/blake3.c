@@ -0,0 +1,366 @@
+/**
+ * blake3.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * BLAKE3 keyed hash, 32 bytes output.
+ *
+ * The algorithm is BLAKE3 by O'Connor, Aumasson, Neves and Wilcox-O'Hearn
+ * (public domain / CC0 reference). Input is split in 1 KiB chunks, each
+ * chunk is compressed into a chaining value and the chaining values are
+ * merged in a binary tree. Full chunks are independent, so on x86-64 four
+ * of them are compressed at once with SSE2, one chunk per 32 bits lane.
+ * The partial last chunk and the tree nodes use the portable compressor.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <pthread.h>
+#include "partclone.h"
+#include "blake3.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <emmintrin.h>
+#define HAVE_BLAKE3_SSE2 1
+#endif
+
+#define BLOCK_LEN	64
+#define CHUNK_LEN	1024
+#define MAX_DEPTH	54
+
+enum {
+	CHUNK_START	= 1 << 0,
+	CHUNK_END	= 1 << 1,
+	PARENT		= 1 << 2,
+	ROOT		= 1 << 3,
+	KEYED_HASH	= 1 << 4,
+};
+
+static const uint32_t IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+	{  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+	{ 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+	{ 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+	{  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+	{ 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+/// chaining values of 4 full chunks starting at chunk counter, cvs[i] for input + i * CHUNK_LEN
+typedef void (*blake3_hash4_fn)(const uint32_t key[8], const unsigned char *input, uint64_t counter, uint32_t cvs[4][8]);
+
+static blake3_hash4_fn blake3_hash4;
+static pthread_once_t blake3_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t load_le32(const unsigned char *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t rotr32(uint32_t w, int c) {
+	return (w >> c) | (w << (32 - c));
+}
+
+#define G(a, b, c, d, x, y) do {			\
+	v[a] = v[a] + v[b] + (x);			\
+	v[d] = rotr32(v[d] ^ v[a], 16);			\
+	v[c] = v[c] + v[d];				\
+	v[b] = rotr32(v[b] ^ v[c], 12);			\
+	v[a] = v[a] + v[b] + (y);			\
+	v[d] = rotr32(v[d] ^ v[a], 8);			\
+	v[c] = v[c] + v[d];				\
+	v[b] = rotr32(v[b] ^ v[c], 7);			\
+} while (0)
+
+/// compress one block into cv, in place
+static void compress(uint32_t cv[8], const uint32_t m[16], uint32_t block_len, uint64_t counter, uint32_t flags) {
+
+	uint32_t v[16];
+	int r, i;
+
+	for (i = 0; i < 8; i++)
+		v[i] = cv[i];
+	v[8] = IV[0];
+	v[9] = IV[1];
+	v[10] = IV[2];
+	v[11] = IV[3];
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+
+	for (r = 0; r < 7; r++) {
+		const uint8_t *s = MSG_SCHEDULE[r];
+
+		G(0, 4,  8, 12, m[s[0]],  m[s[1]]);
+		G(1, 5,  9, 13, m[s[2]],  m[s[3]]);
+		G(2, 6, 10, 14, m[s[4]],  m[s[5]]);
+		G(3, 7, 11, 15, m[s[6]],  m[s[7]]);
+		G(0, 5, 10, 15, m[s[8]],  m[s[9]]);
+		G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+		G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		cv[i] = v[i] ^ v[i + 8];
+}
+
+/// chaining value of one chunk of up to CHUNK_LEN bytes, ROOT is or-ed in the last block flags
+static void chunk_cv(const uint32_t key[8], const unsigned char *input, size_t len, uint64_t counter, uint32_t flags, uint32_t root, uint32_t cv[8]) {
+
+	uint32_t m[16];
+	uint32_t block_flags = flags | CHUNK_START;
+	int i;
+
+	memcpy(cv, key, 8 * sizeof(uint32_t));
+	for (;;) {
+		size_t n = len < BLOCK_LEN ? len : BLOCK_LEN;
+		unsigned char block[BLOCK_LEN];
+
+		memset(block, 0, sizeof(block));
+		memcpy(block, input, n);
+		for (i = 0; i < 16; i++)
+			m[i] = load_le32(block + 4 * i);
+		input += n;
+		len -= n;
+		if (!len)
+			block_flags |= CHUNK_END | root;
+		compress(cv, m, (uint32_t)n, counter, block_flags);
+		if (!len)
+			break;
+		block_flags = flags;
+	}
+}
+
+static void parent_cv(const uint32_t key[8], const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t cv[8]) {
+
+	uint32_t m[16];
+
+	memcpy(m, left, 8 * sizeof(uint32_t));
+	memcpy(m + 8, right, 8 * sizeof(uint32_t));
+	memcpy(cv, key, 8 * sizeof(uint32_t));
+	compress(cv, m, BLOCK_LEN, 0, flags | PARENT);
+}
+
+static void blake3_hash4_portable(const uint32_t key[8], const unsigned char *input, uint64_t counter, uint32_t cvs[4][8]) {
+
+	int i;
+
+	for (i = 0; i < 4; i++)
+		chunk_cv(key, input + i * CHUNK_LEN, CHUNK_LEN, counter + i, KEYED_HASH, 0, cvs[i]);
+}
+
+#ifdef HAVE_BLAKE3_SSE2
+
+static inline __m128i rot16(__m128i x) {
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+}
+
+static inline __m128i rotr(__m128i x, int c) {
+	return _mm_or_si128(_mm_srli_epi32(x, c), _mm_slli_epi32(x, 32 - c));
+}
+
+#define G4(a, b, c, d, x, y) do {					\
+	v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), (x));		\
+	v[d] = rot16(_mm_xor_si128(v[d], v[a]));			\
+	v[c] = _mm_add_epi32(v[c], v[d]);				\
+	v[b] = rotr(_mm_xor_si128(v[b], v[c]), 12);			\
+	v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), (y));		\
+	v[d] = rotr(_mm_xor_si128(v[d], v[a]), 8);			\
+	v[c] = _mm_add_epi32(v[c], v[d]);				\
+	v[b] = rotr(_mm_xor_si128(v[b], v[c]), 7);			\
+} while (0)
+
+/// rows r[0..3] become columns
+static inline void transpose4(__m128i r[4]) {
+
+	__m128i ab_01 = _mm_unpacklo_epi32(r[0], r[1]);
+	__m128i ab_23 = _mm_unpackhi_epi32(r[0], r[1]);
+	__m128i cd_01 = _mm_unpacklo_epi32(r[2], r[3]);
+	__m128i cd_23 = _mm_unpackhi_epi32(r[2], r[3]);
+
+	r[0] = _mm_unpacklo_epi64(ab_01, cd_01);
+	r[1] = _mm_unpackhi_epi64(ab_01, cd_01);
+	r[2] = _mm_unpacklo_epi64(ab_23, cd_23);
+	r[3] = _mm_unpackhi_epi64(ab_23, cd_23);
+}
+
+/// 4 chunks side by side, lane i of every vector belongs to chunk i
+static void blake3_hash4_sse2(const uint32_t key[8], const unsigned char *input, uint64_t counter, uint32_t cvs[4][8]) {
+
+	__m128i h[8], v[16], m[16];
+	__m128i counter_lo = _mm_setr_epi32((int)counter, (int)(counter + 1), (int)(counter + 2), (int)(counter + 3));
+	__m128i counter_hi = _mm_setr_epi32((int)((counter) >> 32), (int)((counter + 1) >> 32),
+					    (int)((counter + 2) >> 32), (int)((counter + 3) >> 32));
+	int b, r, i, j;
+
+	for (i = 0; i < 8; i++)
+		h[i] = _mm_set1_epi32((int)key[i]);
+
+	for (b = 0; b < CHUNK_LEN / BLOCK_LEN; b++) {
+		uint32_t flags = KEYED_HASH;
+
+		if (b == 0)
+			flags |= CHUNK_START;
+		if (b == CHUNK_LEN / BLOCK_LEN - 1)
+			flags |= CHUNK_END;
+
+		/// m[w] holds message word w of the 4 chunks
+		for (j = 0; j < 4; j++) {
+			for (i = 0; i < 4; i++)
+				m[4 * j + i] = _mm_loadu_si128((const __m128i *)(input + i * CHUNK_LEN + b * BLOCK_LEN + 16 * j));
+			transpose4(m + 4 * j);
+		}
+
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		v[8] = _mm_set1_epi32((int)IV[0]);
+		v[9] = _mm_set1_epi32((int)IV[1]);
+		v[10] = _mm_set1_epi32((int)IV[2]);
+		v[11] = _mm_set1_epi32((int)IV[3]);
+		v[12] = counter_lo;
+		v[13] = counter_hi;
+		v[14] = _mm_set1_epi32(BLOCK_LEN);
+		v[15] = _mm_set1_epi32((int)flags);
+
+		for (r = 0; r < 7; r++) {
+			const uint8_t *s = MSG_SCHEDULE[r];
+
+			G4(0, 4,  8, 12, m[s[0]],  m[s[1]]);
+			G4(1, 5,  9, 13, m[s[2]],  m[s[3]]);
+			G4(2, 6, 10, 14, m[s[4]],  m[s[5]]);
+			G4(3, 7, 11, 15, m[s[6]],  m[s[7]]);
+			G4(0, 5, 10, 15, m[s[8]],  m[s[9]]);
+			G4(1, 6, 11, 12, m[s[10]], m[s[11]]);
+			G4(2, 7,  8, 13, m[s[12]], m[s[13]]);
+			G4(3, 4,  9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (i = 0; i < 8; i++)
+			h[i] = _mm_xor_si128(v[i], v[i + 8]);
+	}
+
+	transpose4(h);
+	transpose4(h + 4);
+	for (i = 0; i < 4; i++) {
+		_mm_storeu_si128((__m128i *)cvs[i], h[i]);
+		_mm_storeu_si128((__m128i *)(cvs[i] + 4), h[i + 4]);
+	}
+}
+#endif
+
+void blake3_keyed(const unsigned char key_bytes[BLAKE3_KEY_LEN], const void *buf, size_t size, unsigned char out[BLAKE3_OUT_LEN]) {
+
+	const unsigned char *input = (const unsigned char *)buf;
+	uint32_t key[8], cv[8], stack[MAX_DEPTH][8], cvs[4][8];
+	uint64_t chunks, done = 0;
+	int depth = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		key[i] = load_le32(key_bytes + 4 * i);
+
+	if (size <= CHUNK_LEN) {
+		chunk_cv(key, input, size, 0, KEYED_HASH, ROOT, cv);
+	} else {
+		/// every chunk but the last is full and goes to the tree
+		chunks = (size + CHUNK_LEN - 1) / CHUNK_LEN;
+		while (done < chunks - 1) {
+			int n = 1;
+
+			if (chunks - 1 - done >= 4) {
+				blake3_hash4(key, input + done * CHUNK_LEN, done, cvs);
+				n = 4;
+			} else
+				chunk_cv(key, input + done * CHUNK_LEN, CHUNK_LEN, done, KEYED_HASH, 0, cvs[0]);
+
+			for (i = 0; i < n; i++) {
+				uint64_t total = ++done;
+
+				memcpy(cv, cvs[i], sizeof(cv));
+				/// merge the completed subtrees, like the reference incremental hasher
+				while (!(total & 1)) {
+					parent_cv(key, stack[--depth], cv, KEYED_HASH, cv);
+					total >>= 1;
+				}
+				memcpy(stack[depth++], cv, sizeof(cv));
+			}
+		}
+
+		chunk_cv(key, input + done * CHUNK_LEN, size - done * CHUNK_LEN, done, KEYED_HASH, 0, cv);
+		while (depth > 1)
+			parent_cv(key, stack[--depth], cv, KEYED_HASH, cv);
+		parent_cv(key, stack[0], cv, KEYED_HASH | ROOT, cv);
+	}
+
+	for (i = 0; i < 8; i++) {
+		out[4 * i] = (unsigned char)cv[i];
+		out[4 * i + 1] = (unsigned char)(cv[i] >> 8);
+		out[4 * i + 2] = (unsigned char)(cv[i] >> 16);
+		out[4 * i + 3] = (unsigned char)(cv[i] >> 24);
+	}
+}
+
+/// compare a 4 chunks compressor with the portable one
+static int blake3_self_test(blake3_hash4_fn hash4) {
+
+	static unsigned char data[4 * CHUNK_LEN + 3];
+	static const uint64_t counters[] = { 0, 5, 0xFFFFFFFEULL };
+	uint32_t key[8], a[4][8], b[4][8];
+	uint32_t x = 0x6b43a9b5;
+	size_t i, k;
+
+	for (i = 0; i < sizeof(data); i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = (unsigned char)x;
+	}
+	for (i = 0; i < 8; i++)
+		key[i] = IV[i] ^ (uint32_t)i;
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		for (k = 0; k < 4; k++) {
+			blake3_hash4_portable(key, data + k, counters[i], a);
+			hash4(key, data + k, counters[i], b);
+			if (memcmp(a, b, sizeof(a)))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void blake3_setup(void) {
+
+	extern cmd_opt opt;
+	const char *name = "portable";
+
+	blake3_hash4 = blake3_hash4_portable;
+
+#ifdef HAVE_BLAKE3_SSE2
+	if (blake3_self_test(blake3_hash4_sse2)) {
+		blake3_hash4 = blake3_hash4_sse2;
+		name = "sse2";
+	} else
+		log_mesg(1, 0, 0, opt.debug, "blake3: sse2 fails the self test, not used\n");
+#else
+	(void)blake3_self_test;
+#endif
+
+	log_mesg(1, 0, 0, opt.debug, "blake3: using the %s implementation\n", name);
+}
+
+void blake3_init(void) {
+	pthread_once(&blake3_once, blake3_setup);
+}
@@ -0,0 +1,28 @@
+/**
+ * blake3.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * BLAKE3 keyed hash, 32 bytes output.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef BLAKE3_H_
+#define BLAKE3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_KEY_LEN 32
+#define BLAKE3_OUT_LEN 32
+
+/// pick the fastest chunk compressor, run the self test. Called by init_checksum().
+extern void blake3_init(void);
+/// out = BLAKE3 keyed hash of buf, same as blake3_hasher_init_keyed() + update + finalize
+extern void blake3_keyed(const unsigned char key[BLAKE3_KEY_LEN], const void *buf, size_t size, unsigned char out[BLAKE3_OUT_LEN]);
+
+#endif /* BLAKE3_H_ */
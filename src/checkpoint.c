@@ -0,0 +1,197 @@
+/**
+ * checkpoint.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * checkpoint journal of a clone or a restore. It is written once the
+ * targets hold everything before it, so that a run which died can go on
+ * from there with --resume instead of from the first block.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "partclone.h"
+#include "checksum.h"
+#include "checkpoint.h"
+
+/// bytes of cp in the file
+static size_t checkpoint_size(checkpoint_state *cp) {
+
+	return offsetof(checkpoint_state, digest_buf) + cp->digest_size;
+}
+
+static uint32_t checkpoint_crc(checkpoint_state *cp) {
+
+	uint32_t crc;
+
+	init_crc32(&crc);
+	crc = crc32(crc, cp, offsetof(checkpoint_state, crc));
+	return crc32(crc, cp->digest_buf, cp->digest_size);
+}
+
+/// sync the directory of path, for the rename() to be on the disk too
+static void checkpoint_sync_dir(const char *path) {
+
+	char dir[PATH_MAX + 1];
+	int fd;
+
+	strncpy(dir, path, PATH_MAX);
+	dir[PATH_MAX] = '\0';
+	fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+int checkpoint_write(const char *path, checkpoint_state *cp, cmd_opt *opt) {
+
+	char tmp[PATH_MAX + 1];
+	int fd;
+
+	memset(cp->magic, 0, CHECKPOINT_MAGIC_SIZE);
+	memcpy(cp->magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC));
+	cp->version = CHECKPOINT_VERSION;
+	cp->crc = checkpoint_crc(cp);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		log_mesg(0, 0, 1, opt->debug, "checkpoint %s: open ERROR: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	if (write_all(&fd, (char *)cp, checkpoint_size(cp), opt) != (long long)checkpoint_size(cp) || fsync(fd) == -1) {
+		log_mesg(0, 0, 1, opt->debug, "checkpoint %s: write ERROR: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, path) == -1) {
+		log_mesg(0, 0, 1, opt->debug, "checkpoint %s: rename ERROR: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	checkpoint_sync_dir(path);
+
+	log_mesg(1, 0, 0, opt->debug, "checkpoint at block %llu, %llu blocks copied, image offset %llu\n",
+		(unsigned long long)cp->block_id, (unsigned long long)cp->copied, (unsigned long long)cp->image_offset);
+	return 0;
+}
+
+int checkpoint_read(const char *path, checkpoint_state *cp, cmd_opt *opt) {
+
+	int fd = open(path, O_RDONLY);
+	long long r;
+
+	if (fd == -1) {
+		log_mesg(0, 0, 1, opt->debug, "checkpoint %s: open ERROR: %s\n", path, strerror(errno));
+		return -1;
+	}
+	r = read_all(&fd, (char *)cp, offsetof(checkpoint_state, digest_buf), opt);
+	if (r == offsetof(checkpoint_state, digest_buf) && cp->digest_size <= CHECKPOINT_DIGEST_CHUNK)
+		r += read_all(&fd, (char *)cp->digest_buf, cp->digest_size, opt);
+	close(fd);
+
+	if (r != (long long)checkpoint_size(cp) || memcmp(cp->magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) ||
+	    cp->version != CHECKPOINT_VERSION || cp->crc != checkpoint_crc(cp)) {
+		log_mesg(0, 0, 1, opt->debug, "checkpoint %s: not a valid checkpoint\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int checkpoint_same(const checkpoint_state *a, const checkpoint_state *b) {
+
+	return a->block_size == b->block_size && a->totalblock == b->totalblock &&
+		a->usedblocks == b->usedblocks && a->image_size == b->image_size &&
+		a->checksum_mode == b->checksum_mode && a->checksum_size == b->checksum_size &&
+		a->clone == b->clone && a->bitmap_crc == b->bitmap_crc;
+}
+
+uint32_t checkpoint_bitmap_crc(unsigned long *bitmap, unsigned long long totalblock) {
+
+	uint32_t crc;
+
+	init_crc32(&crc);
+	return crc32(crc, bitmap, BITS_TO_LONGS(totalblock) * PART_BYTES_PER_LONG);
+}
+
+void checkpoint_start(checkpoint_journal *cp, int image_fd) {
+
+	memset(&cp->state, 0, sizeof(checkpoint_state));
+	cp->image_fd = image_fd;
+	cp->sync = NULL;
+	cp->sync_arg = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &cp->time);
+}
+
+void checkpoint_tick(checkpoint_journal *cp, unsigned long long block_id, unsigned long long copied,
+	unsigned int blocks_in_cs, const unsigned char *checksum, const image_digest *digest, cmd_opt *opt) {
+
+	struct timespec now;
+
+	/// a checkpoint only records what the image or the targets hold
+	if (copied <= cp->state.copied)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - cp->time.tv_sec < (time_t)opt->checkpoint_interval)
+		return;
+
+	if (cp->sync)
+		cp->sync(cp->sync_arg);
+	else if (fdatasync(cp->image_fd) == -1)
+		log_mesg(0, 1, 1, opt->debug, "image fdatasync ERROR:%s\n", strerror(errno));
+
+	cp->state.block_id = block_id;
+	cp->state.copied = copied;
+	cp->state.image_offset = lseek(cp->image_fd, 0, SEEK_CUR);
+	cp->state.blocks_in_cs = blocks_in_cs;
+	memcpy(cp->state.checksum, checksum, cp->state.checksum_size);
+	if (digest) {
+		memcpy(cp->state.digest, digest->value, IMAGE_DIGEST_SIZE);
+		cp->state.digest_size = digest->size;
+		memcpy(cp->state.digest_buf, digest->buf, digest->size);
+	}
+	checkpoint_write(opt->checkpoint, &cp->state, opt);
+	cp->time = now;
+}
+
+void checkpoint_resume(checkpoint_journal *cp, checkpoint_state *saved, unsigned long long image_end,
+	const unsigned char *checksum, image_digest *digest, cmd_opt *opt) {
+
+	if (checkpoint_read(opt->checkpoint, saved, opt) || !checkpoint_same(saved, &cp->state) ||
+	    saved->copied > cp->state.usedblocks || saved->block_id > cp->state.totalblock ||
+	    saved->checksum_size > CHECKPOINT_CHECKSUM_SIZE || saved->digest_size >= CHECKPOINT_DIGEST_CHUNK ||
+	    saved->image_offset > image_end) {
+		log_mesg(0, 1, 1, opt->debug, "cannot resume from %s, it is not a checkpoint of this image\n", opt->checkpoint);
+		/// forced, the data start over from the first block
+		memset(saved, 0, sizeof(checkpoint_state));
+		saved->image_offset = lseek(cp->image_fd, 0, SEEK_CUR);
+		memcpy(saved->checksum, checksum, cp->state.checksum_size);
+	}
+
+	if (digest) {
+		memcpy(digest->value, saved->digest, IMAGE_DIGEST_SIZE);
+		digest->size = saved->digest_size;
+		memcpy(digest->buf, saved->digest_buf, digest->size);
+	}
+	cp->state.copied = saved->copied;
+}
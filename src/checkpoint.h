@@ -0,0 +1,107 @@
+/**
+ * checkpoint.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * checkpoint journal of a clone or a restore, to resume it after a failure.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+#include <time.h>
+
+struct cmd_opt;
+
+#define CHECKPOINT_MAGIC "partclone-ckpt"
+#define CHECKPOINT_MAGIC_SIZE 16
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_CHECKSUM_SIZE 32
+#define CHECKPOINT_DIGEST_SIZE 32		/// IMAGE_DIGEST_SIZE
+#define CHECKPOINT_DIGEST_CHUNK 65536		/// IMAGE_DIGEST_CHUNK
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+
+#pragma pack(push, 1)
+/**
+ * The clone or restore loop state between two reads. The first fields tell
+ * the image apart, the others are where to go on from. A clone goes on
+ * writing the image at image_offset and needs the digest of the blocks
+ * cloned before it too. All of it but the unused end of digest_buf is
+ * stored and covered by crc.
+ */
+typedef struct
+{
+	char magic[CHECKPOINT_MAGIC_SIZE];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t totalblock;
+	uint64_t usedblocks;
+	uint64_t image_size;
+	uint32_t checksum_mode;
+	uint32_t checksum_size;
+	uint32_t clone;			/// 1 for a clone, 0 for a restore
+	uint32_t bitmap_crc;
+
+	uint64_t block_id;		/// next block of the bitmap to copy
+	uint64_t copied;		/// used blocks copied
+	uint64_t image_offset;		/// where the next blocks are read from or written to
+	uint32_t blocks_in_cs;		/// blocks already in the running checksum
+	unsigned char checksum[CHECKPOINT_CHECKSUM_SIZE];
+	uint32_t digest_size;		/// clone only, see image_digest
+	unsigned char digest[CHECKPOINT_DIGEST_SIZE];
+
+	uint32_t crc;
+	unsigned char digest_buf[CHECKPOINT_DIGEST_CHUNK];	/// only digest_size bytes are stored
+} checkpoint_state;
+#pragma pack(pop)
+
+/**
+ * The checkpoints of a running clone or restore, image_digest comes from
+ * partclone.h. The caller sets the fields of state which tell the image
+ * apart, checkpoint_tick fills in the others.
+ */
+typedef struct
+{
+	checkpoint_state state;		/// the last checkpoint written
+	int image_fd;			/// image_offset is read from it
+	struct timespec time;		/// when the last checkpoint was written
+	void (*sync)(void *arg);	/// flush the targets, NULL to fdatasync image_fd
+	void *sync_arg;
+} checkpoint_journal;
+
+/**
+ * checkpoint_write	- replace the checkpoint at path by cp, through a
+ *			  synced temporary file renamed over it, 0 or -1
+ * checkpoint_read	- read and check the checkpoint at path, 0 or -1
+ * checkpoint_same	- 1 when a and b were taken from the same image
+ * checkpoint_bitmap_crc - crc of the bitmap, for bitmap_crc
+ */
+extern int checkpoint_write(const char *path, checkpoint_state *cp, struct cmd_opt *opt);
+extern int checkpoint_read(const char *path, checkpoint_state *cp, struct cmd_opt *opt);
+extern int checkpoint_same(const checkpoint_state *a, const checkpoint_state *b);
+extern uint32_t checkpoint_bitmap_crc(unsigned long *bitmap, unsigned long long totalblock);
+
+/**
+ * checkpoint_start	- clear cp and start the interval, image_fd is the
+ *			  image written by a clone or read by a restore
+ * checkpoint_tick	- write a checkpoint of the loop state when the interval
+ *			  is over and blocks were copied since the last one, digest
+ *			  is NULL for a restore
+ * checkpoint_resume	- read the checkpoint of opt->checkpoint into saved and
+ *			  restore digest from it. A checkpoint of another image or
+ *			  past image_end is fatal, or when forced starts over from
+ *			  the current offset of image_fd with the checksum seed.
+ */
+extern void checkpoint_start(checkpoint_journal *cp, int image_fd);
+extern void checkpoint_tick(checkpoint_journal *cp, unsigned long long block_id, unsigned long long copied,
+	unsigned int blocks_in_cs, const unsigned char *checksum, const image_digest *digest, struct cmd_opt *opt);
+extern void checkpoint_resume(checkpoint_journal *cp, checkpoint_state *saved, unsigned long long image_end,
+	const unsigned char *checksum, image_digest *digest, struct cmd_opt *opt);
+
+#endif /* CHECKPOINT_H_ */
@@ -1,12 +1,43 @@
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
 #include "checksum.h"
+#include "xxh3.h"
+#include "blake3.h"
 
 #include "partclone.h" // for log_mesg() & cmd_opt
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CRC32_PCLMUL 1
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC32_ARMV8 1
+#endif
+
 #define CRC32_SEED 0xFFFFFFFF
 
-static uint32_t crc_tab32[256] = { 0 };
+/// crc_tab32_slice[0] is the classic table, [k] advances k more zero bytes
+static uint32_t crc_tab32_slice[16][256];
+#define crc_tab32 crc_tab32_slice[0]
 static int cs_mode = CSM_NONE;
 
+typedef uint32_t (*crc32_fn)(uint32_t crc, const unsigned char *buf, size_t size);
+static uint32_t crc32_table(uint32_t crc, const unsigned char *buf, size_t size);
+/// the fastest variant which passed the self test
+static crc32_fn crc32_best = crc32_table;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/// CRC32C (Castagnoli), the polynomial of the SSE4.2 and ARMv8 crc32c instructions
+static uint32_t crc32c_tab[8][256];
+static crc32_fn crc32c_best;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
 unsigned get_checksum_size(int checksum_mode, int debug) {
 
 	switch(checksum_mode) {
@@ -16,8 +47,15 @@ unsigned get_checksum_size(int checksum_mode, int debug) {
 
 	case CSM_CRC32:
 	case CSM_CRC32_0001:
+	case CSM_CRC32C:
 		return 4;
 
+	case CSM_XXH3_64:
+		return 8;
+
+	case CSM_BLAKE3:
+		return BLAKE3_OUT_LEN;
+
 	default:
 		log_mesg(0, 1, 1, debug, "Unknown checksum mode [%d]\n", checksum_mode);
 		return UINT_LEAST32_MAX;
@@ -38,36 +76,440 @@ const char *get_checksum_str(int checksum_mode) {
 	case CSM_CRC32_0001:
 		return "CRC32_0001";
 
+	case CSM_CRC32C:
+		return "CRC32C";
+
+	case CSM_XXH3_64:
+		return "XXH3_64";
+
+	case CSM_BLAKE3:
+		return "BLAKE3";
+
 	default:
 		return "UNKNOWN";
 	}
 }
 
+/// the crc32 function, reference from libcrc.
+/// Author is Lammert Bies  1999-2007
+/// Mail: info@lammertbies.nl
+/// http://www.lammertbies.nl/comm/info/nl_crc-calculation.html
+/// generate crc32 code, one byte at a time. This is the reference for the other variants.
+static uint32_t crc32_table(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	const unsigned char * end = buf + size;
+	uint32_t tmp, long_c;
+
+	while (buf != end) {
+		/// update crc
+		long_c = *(buf++);
+		tmp = crc ^ long_c;
+		crc = (crc >> 8) ^ crc_tab32[tmp & 0xff];
+	};
+
+	return crc;
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/// slicing-by-8, 8 table lookups for 8 bytes
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	const uint32_t (*t)[256] = crc_tab32_slice;
+
+	while (size >= 8) {
+		uint32_t one = load_le32(buf) ^ crc;
+		uint32_t two = load_le32(buf + 4);
+
+		crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+		      t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+		      t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+		      t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		buf += 8;
+		size -= 8;
+	}
+
+	return crc32_table(crc, buf, size);
+}
+
+/// slicing-by-16, the portable default
+static uint32_t crc32_slice16(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	const uint32_t (*t)[256] = crc_tab32_slice;
+
+	while (size >= 16) {
+		uint32_t one = load_le32(buf) ^ crc;
+		uint32_t two = load_le32(buf + 4);
+		uint32_t three = load_le32(buf + 8);
+		uint32_t four = load_le32(buf + 12);
+
+		crc = t[15][one & 0xff] ^ t[14][(one >> 8) & 0xff] ^
+		      t[13][(one >> 16) & 0xff] ^ t[12][one >> 24] ^
+		      t[11][two & 0xff] ^ t[10][(two >> 8) & 0xff] ^
+		      t[9][(two >> 16) & 0xff] ^ t[8][two >> 24] ^
+		      t[7][three & 0xff] ^ t[6][(three >> 8) & 0xff] ^
+		      t[5][(three >> 16) & 0xff] ^ t[4][three >> 24] ^
+		      t[3][four & 0xff] ^ t[2][(four >> 8) & 0xff] ^
+		      t[1][(four >> 16) & 0xff] ^ t[0][four >> 24];
+		buf += 16;
+		size -= 16;
+	}
+
+	return crc32_table(crc, buf, size);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
 /**
- * Initialise crc32 lookup table if it is not already done and initialise seed
- * the the default implementation seed value
+ * Carry-less multiplication folding, from the Intel white paper "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction". The
+ * constants are x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32) and
+ * x^64 mod P(x), bit reflected, then P(x) and the Barrett constant.
  */
-void init_crc32(uint32_t* seed) {
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, mask;
+	size_t len;
+
+	if (size < 64)
+		return crc32_slice16(crc, buf, size);
+
+	len = size & ~(size_t)15;
+	size -= len;
+
+	/// fold by 4, 64 bytes at a time
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	x0 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/// fold the 4 lanes into one
+	x0 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/// fold by 1, 16 bytes at a time
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/// 128 bits to 64 bits
+	mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/// Barrett reduction to 32 bits
+	x0 = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+	return crc32_slice16(crc, buf, size);
+}
+
+static int crc32_pclmul_usable(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#ifdef HAVE_CRC32_ARMV8
+/// the ARMv8 CRC32 instructions compute this very polynomial, 8 bytes at a time
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	while (size && ((uintptr_t)buf & 7)) {
+		crc = __crc32b(crc, *buf++);
+		size--;
+	}
+	while (size >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, 8);
+		crc = __crc32d(crc, v);
+		buf += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = __crc32b(crc, *buf++);
+
+	return crc;
+}
+
+static int crc32_armv8_usable(void) {
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static int crc32_always_usable(void) {
+	return 1;
+}
+
+/// slowest first, the last usable one that passes the self test is used
+static const struct {
+	const char *name;
+	crc32_fn fn;
+	int (*usable)(void);
+} crc32_variants[] = {
+	{ "table",	crc32_table,	crc32_always_usable },
+	{ "slice8",	crc32_slice8,	crc32_always_usable },
+	{ "slice16",	crc32_slice16,	crc32_always_usable },
+#ifdef HAVE_CRC32_PCLMUL
+	{ "pclmul",	crc32_pclmul,	crc32_pclmul_usable },
+#endif
+#ifdef HAVE_CRC32_ARMV8
+	{ "armv8",	crc32_armv8,	crc32_armv8_usable },
+#endif
+};
+
+/**
+ * Compare fn with the byte at a time version ref on every length up to 1 KiB
+ * plus a few large ones, at every alignment up to 16 and for several seeds.
+ */
+static int crc32_self_test(crc32_fn fn, crc32_fn ref) {
+
+	static unsigned char data[8192 + 16];
+	static const size_t big[] = { 2048, 4095, 4096, 4097, 8192 };
+	static const uint32_t seeds[] = { CRC32_SEED, 0, 0x12345678 };
+	uint32_t x = 0x9e3779b9;
+	size_t i, len, align, seed;
+
+	for (i = 0; i < sizeof(data); i++) {
+		/// xorshift, any pattern will do as long as it is not trivial
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = (unsigned char)x;
+	}
 
-	if (crc_tab32[0] == 0) {
-		/// initial crc table
-		uint32_t init_crc, init_p;
-		uint32_t i, j;
-		init_p = 0xEDB88320L;
-
-		for (i = 0; i < 256; i++) {
-			init_crc = i;
-			for (j = 0; j < 8; j++) {
-				if (init_crc & 0x00000001L)
-					init_crc = ( init_crc >> 1 ) ^ init_p;
-				else
-					init_crc = init_crc >> 1;
+	for (seed = 0; seed < sizeof(seeds) / sizeof(seeds[0]); seed++) {
+		for (align = 0; align < 16; align++) {
+			for (len = 0; len <= 1024; len++) {
+				if (fn(seeds[seed], data + align, len) != ref(seeds[seed], data + align, len))
+					return 0;
 			}
+			for (i = 0; i < sizeof(big) / sizeof(big[0]); i++) {
+				if (fn(seeds[seed], data + align, big[i]) != ref(seeds[seed], data + align, big[i]))
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
 
-			crc_tab32[i] = init_crc;
+/// build the tables and pick the crc32 variant
+static void crc32_setup(void) {
+
+	extern cmd_opt opt;
+	uint32_t init_crc, init_p;
+	uint32_t i, j;
+	const char *name = crc32_variants[0].name;
+
+	/// initial crc table
+	init_p = 0xEDB88320L;
+	for (i = 0; i < 256; i++) {
+		init_crc = i;
+		for (j = 0; j < 8; j++) {
+			if (init_crc & 0x00000001L)
+				init_crc = ( init_crc >> 1 ) ^ init_p;
+			else
+				init_crc = init_crc >> 1;
 		}
+
+		crc_tab32[i] = init_crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 16; j++)
+			crc_tab32_slice[j][i] = (crc_tab32_slice[j - 1][i] >> 8) ^ crc_tab32[crc_tab32_slice[j - 1][i] & 0xff];
 	}
 
+	for (i = 1; i < sizeof(crc32_variants) / sizeof(crc32_variants[0]); i++) {
+		if (!crc32_variants[i].usable())
+			continue;
+		if (!crc32_self_test(crc32_variants[i].fn, crc32_table)) {
+			log_mesg(1, 0, 0, opt.debug, "crc32: %s fails the self test, not used\n", crc32_variants[i].name);
+			continue;
+		}
+		crc32_best = crc32_variants[i].fn;
+		name = crc32_variants[i].name;
+	}
+
+	log_mesg(1, 0, 0, opt.debug, "crc32: using the %s implementation\n", name);
+}
+
+/// CRC32C, one byte at a time. This is the reference for the other variants.
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	while (size--)
+		crc = (crc >> 8) ^ crc32c_tab[0][(crc ^ *buf++) & 0xff];
+
+	return crc;
+}
+
+/// CRC32C slicing-by-8, the portable default
+static uint32_t crc32c_slice8(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	const uint32_t (*t)[256] = crc32c_tab;
+
+	while (size >= 8) {
+		uint32_t one = load_le32(buf) ^ crc;
+		uint32_t two = load_le32(buf + 4);
+
+		crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+		      t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+		      t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+		      t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		buf += 8;
+		size -= 8;
+	}
+
+	return crc32c_table(crc, buf, size);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+/// the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	uint64_t crc64 = crc;
+
+	while (size >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		buf += 8;
+		size -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (size--)
+		crc = _mm_crc32_u8(crc, *buf++);
+
+	return crc;
+}
+
+static int crc32c_sse42_usable(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef HAVE_CRC32_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *buf, size_t size) {
+
+	while (size >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, 8);
+		crc = __crc32cd(crc, v);
+		buf += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = __crc32cb(crc, *buf++);
+
+	return crc;
+}
+#endif
+
+static const struct {
+	const char *name;
+	crc32_fn fn;
+	int (*usable)(void);
+} crc32c_variants[] = {
+	{ "slice8",	crc32c_slice8,	crc32_always_usable },
+#ifdef HAVE_CRC32_PCLMUL
+	{ "sse4.2",	crc32c_sse42,	crc32c_sse42_usable },
+#endif
+#ifdef HAVE_CRC32_ARMV8
+	{ "armv8",	crc32c_armv8,	crc32_armv8_usable },
+#endif
+};
+
+static void crc32c_setup(void) {
+
+	extern cmd_opt opt;
+	uint32_t crc, i, j;
+	const char *name = "table";
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		crc32c_tab[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			crc32c_tab[j][i] = (crc32c_tab[j - 1][i] >> 8) ^ crc32c_tab[0][crc32c_tab[j - 1][i] & 0xff];
+	}
+
+	crc32c_best = crc32c_table;
+	for (i = 0; i < sizeof(crc32c_variants) / sizeof(crc32c_variants[0]); i++) {
+		if (!crc32c_variants[i].usable())
+			continue;
+		if (!crc32_self_test(crc32c_variants[i].fn, crc32c_table)) {
+			log_mesg(1, 0, 0, opt.debug, "crc32c: %s fails the self test, not used\n", crc32c_variants[i].name);
+			continue;
+		}
+		crc32c_best = crc32c_variants[i].fn;
+		name = crc32c_variants[i].name;
+	}
+
+	log_mesg(1, 0, 0, opt.debug, "crc32c: using the %s implementation\n", name);
+}
+
+/**
+ * Initialise crc32 lookup table if it is not already done and initialise seed
+ * the the default implementation seed value
+ */
+void init_crc32(uint32_t* seed) {
+
+	pthread_once(&crc32_once, crc32_setup);
+
 	*seed = CRC32_SEED;
 }
 
@@ -90,6 +532,21 @@ void init_checksum(int checksum_mode, unsigned char* seed, int debug) {
 		init_crc32((uint32_t*)seed);
 		break;
 
+	case CSM_CRC32C:
+		pthread_once(&crc32c_once, crc32c_setup);
+		*(uint32_t*)seed = CRC32_SEED;
+		break;
+
+	case CSM_XXH3_64:
+		xxh3_init();
+		memset(seed, 0, 8);
+		break;
+
+	case CSM_BLAKE3:
+		blake3_init();
+		memset(seed, 0, BLAKE3_KEY_LEN);
+		break;
+
 	case CSM_NONE:
 		// Nothing to do
 		// Leave seed alone as it may be NULL or point to a zero-sized array
@@ -103,25 +560,10 @@ void init_checksum(int checksum_mode, unsigned char* seed, int debug) {
 	cs_mode = checksum_mode;
 }
 
-/// the crc32 function, reference from libcrc.
-/// Author is Lammert Bies  1999-2007
-/// Mail: info@lammertbies.nl
-/// http://www.lammertbies.nl/comm/info/nl_crc-calculation.html
-/// generate crc32 code
+/// generate crc32 code with the variant picked by init_crc32()
 uint32_t crc32(uint32_t seed, void* buffer, int size) {
 
-	unsigned char * buf = (unsigned char *)buffer;
-	const unsigned char * end = buf + size;
-	uint32_t tmp, long_c, crc = seed;
-
-	while (buf != end) {
-		/// update crc
-		long_c = *(buf++);
-		tmp = crc ^ long_c;
-		crc = (crc >> 8) ^ crc_tab32[tmp & 0xff];
-	};
-
-	return crc;
+	return crc32_best(seed, (const unsigned char *)buffer, size);
 }
 
 /**
@@ -157,6 +599,9 @@ static uint32_t crc32_0001(uint32_t seed, void* buffer, int size) {
 void update_checksum(unsigned char* checksum, char* buf, int size) {
 
 	uint32_t* crc;
+	uint64_t h;
+	unsigned char digest[BLAKE3_OUT_LEN];
+	int i;
 
 	switch(cs_mode)
 	{
@@ -170,6 +615,26 @@ void update_checksum(unsigned char* checksum, char* buf, int size) {
 		*crc = crc32_0001(*crc, (unsigned char*)buf, size);
 		break;
 
+	case CSM_CRC32C:
+		crc = (uint32_t*)checksum;
+		*crc = crc32c_best(*crc, (unsigned char*)buf, size);
+		break;
+
+	case CSM_XXH3_64:
+		/// the previous hash, little endian, seeds the next one
+		for (h = 0, i = 7; i >= 0; i--)
+			h = (h << 8) | checksum[i];
+		h = xxh3_64(buf, size, h);
+		for (i = 0; i < 8; i++)
+			checksum[i] = (unsigned char)(h >> (8 * i));
+		break;
+
+	case CSM_BLAKE3:
+		/// the previous hash is the key of the next one
+		blake3_keyed(checksum, buf, size, digest);
+		memcpy(checksum, digest, BLAKE3_OUT_LEN);
+		break;
+
 	case CSM_NONE:
 		// Nothing to do
 		// Leave checksum alone as it may be NULL or point to a zero-sized array.
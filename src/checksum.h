@@ -7,6 +7,9 @@ typedef enum
 {
 	CSM_NONE  = 0x00,
 	CSM_CRC32 = 0x20,
+	CSM_CRC32C = 0x21,     // Castagnoli polynomial, SSE4.2 / ARMv8 crc32c instructions
+	CSM_XXH3_64 = 0x40,    // XXH3 64 bits, seeded with the previous hash
+	CSM_BLAKE3 = 0x100,    // BLAKE3 256 bits, keyed with the previous hash
 	CSM_CRC32_0001 = 0xFF, // use crc32_0001() and watch for x64 bug
 } checksum_mode_enum;
 
@@ -16,6 +19,11 @@ extern uint32_t crc32(uint32_t seed, void* buf, int size);
 extern unsigned get_checksum_size(int checksum_mode, int debug);
 extern const char *get_checksum_str(int checksum_mode);
 extern void init_checksum(int checksum_mode, unsigned char* seed, int debug);
+/**
+ * XXH3 and BLAKE3 cannot keep a streaming state in the checksum bytes, so each
+ * call hashes buf on its own chained to the previous value. The result depends
+ * on how the data is split between calls: always update one block at a time.
+ */
 extern void update_checksum(unsigned char* checksum, char* buf, int size);
 
 #endif /* CHECKSUM_H_ */
@@ -0,0 +1,159 @@
+/**
+ * chunkstore.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * content addressed store of image chunks. A chunk is named after the
+ * BLAKE3 hash of its content, so the images sharing a store only add the
+ * chunks the store does not have yet, and a chunk read back is checked
+ * against its name.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "partclone.h" // for log_mesg() & cmd_opt
+#include "blake3.h"
+#include "chunkstore.h"
+
+/// chunk ids are keyed hashes, so that they never match a plain BLAKE3 of the same data
+static const unsigned char chunk_key[BLAKE3_KEY_LEN] = "partclone chunk store 0001     ";
+
+void chunk_store_open(chunk_store *store, const char *dir, int create, cmd_opt *opt) {
+
+	struct stat st;
+
+	memset(store, 0, sizeof(chunk_store));
+	store->opt = opt;
+	store->dir = strdup(dir);
+	if (store->dir == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	if (create && mkdir(dir, 0755) == -1 && errno != EEXIST)
+		log_mesg(0, 1, 1, opt->debug, "chunk store: unable to create %s: %s\n", dir, strerror(errno));
+	if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode))
+		log_mesg(0, 1, 1, opt->debug, "chunk store: %s is not a directory\n", dir);
+
+	blake3_init();
+}
+
+void chunk_store_close(chunk_store *store) {
+
+	free(store->dir);
+	store->dir = NULL;
+}
+
+int chunk_store_sync(chunk_store *store) {
+
+	int fd = open(store->dir, O_RDONLY | O_DIRECTORY), ret = 0;
+
+	if (fd == -1)
+		return -1;
+#ifdef HAVE_SYNCFS
+	ret = syncfs(fd);
+#else
+	sync();
+#endif
+	close(fd);
+	return ret;
+}
+
+void chunk_id(const char *buf, unsigned long long size, unsigned char id[CHUNK_ID_SIZE]) {
+
+	blake3_keyed(chunk_key, buf, size, id);
+}
+
+void chunk_id_str(const unsigned char id[CHUNK_ID_SIZE], char *str) {
+
+	int i;
+
+	for (i = 0; i < CHUNK_ID_SIZE; i++)
+		sprintf(str + 2 * i, "%02x", id[i]);
+}
+
+/// path of the chunk, and of its directory when dir is not NULL
+static void chunk_path(chunk_store *store, const unsigned char id[CHUNK_ID_SIZE], char *path, char *dir) {
+
+	char str[2 * CHUNK_ID_SIZE + 1];
+
+	chunk_id_str(id, str);
+	snprintf(path, PATH_MAX, "%s/%.2s/%s", store->dir, str, str + 2);
+	if (dir)
+		snprintf(dir, PATH_MAX, "%s/%.2s", store->dir, str);
+}
+
+int chunk_store_put(chunk_store *store, const unsigned char id[CHUNK_ID_SIZE], const char *buf, unsigned long long size) {
+
+	/// room for the suffix of the temporary file after a path of PATH_MAX
+	char path[PATH_MAX], dir[PATH_MAX], tmp[PATH_MAX + 64];
+	struct stat st;
+	int fd, n;
+
+	chunk_path(store, id, path, dir);
+	/// a chunk of another size was cut short, it is written again
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && (unsigned long long)st.st_size == size)
+		return 0;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		return -1;
+
+	/// unique per thread, the rename makes the chunk visible in one go
+	n = snprintf(tmp, sizeof(tmp), "%s.%d.%lx.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+	if (n < 0 || (size_t)n >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+
+	/// synced with the others by chunk_store_sync(), not one by one
+	if (write_all(&fd, (char *)buf, size, store->opt) != (int)size) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (close(fd) == -1 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 1;
+}
+
+int chunk_store_get(chunk_store *store, const unsigned char id[CHUNK_ID_SIZE], char *buf, unsigned long long size) {
+
+	char path[PATH_MAX];
+	unsigned char check[CHUNK_ID_SIZE];
+	struct stat st;
+	int fd, ret = -1;
+
+	chunk_path(store, id, path, NULL);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) == 0 && (unsigned long long)st.st_size == size &&
+	    read_all(&fd, buf, size, store->opt) == (int)size) {
+		chunk_id(buf, size, check);
+		ret = memcmp(check, id, CHUNK_ID_SIZE) ? -1 : 0;
+	}
+
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,54 @@
+/**
+ * chunkstore.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * content addressed store of image chunks, shared by many images.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CHUNKSTORE_H_
+#define CHUNKSTORE_H_
+
+struct cmd_opt;
+
+/// a chunk id is the BLAKE3 hash of the chunk
+#define CHUNK_ID_SIZE 32
+
+/// blocks of a chunk when cloning: the used ones of CHUNK_STORE_SIZE bytes of the device
+#define CHUNK_STORE_SIZE (64 * 1024)
+
+/**
+ * The store is a directory, a chunk is the file <dir>/<2 hex digits>/<62 hex
+ * digits> of its id. Chunks are written to a temporary file and renamed, so
+ * several clones can add to the same store at once. They reach the disk
+ * together with chunk_store_sync() before the image using them is
+ * finished, a chunk cut short by a crash before is written again.
+ */
+typedef struct
+{
+	char *dir;
+	struct cmd_opt *opt;
+
+} chunk_store;
+
+/// check dir, create it when create is set. Exit on error.
+extern void chunk_store_open(chunk_store *store, const char *dir, int create, struct cmd_opt *opt);
+extern void chunk_store_close(chunk_store *store);
+
+extern void chunk_id(const char *buf, unsigned long long size, unsigned char id[CHUNK_ID_SIZE]);
+/// str must hold 2 * CHUNK_ID_SIZE + 1 bytes
+extern void chunk_id_str(const unsigned char id[CHUNK_ID_SIZE], char *str);
+
+/// add a chunk, return 1 when it was new, 0 when the store had it, -1 on error
+extern int chunk_store_put(chunk_store *store, const unsigned char id[CHUNK_ID_SIZE], const char *buf, unsigned long long size);
+/// flush the chunks put so far to the disk, return 0 or -1
+extern int chunk_store_sync(chunk_store *store);
+/// read a chunk of size bytes and check its id, return 0 or -1
+extern int chunk_store_get(chunk_store *store, const unsigned char id[CHUNK_ID_SIZE], char *buf, unsigned long long size);
+
+#endif /* CHUNKSTORE_H_ */
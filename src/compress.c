@@ -0,0 +1,229 @@
+/**
+ * compress.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * compression of the image data frames with zstd or lz4. Each frame is
+ * compressed on its own, so frames can be handled by any thread and in
+ * any order.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "compress.h"
+#include "partclone.h" // for log_mesg() & cmd_opt
+
+int compress_available(int mode) {
+
+	switch (mode) {
+
+	case CMP_NONE:
+		return 1;
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD:
+		return 1;
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		return 1;
+#endif
+
+	default:
+		return 0;
+	}
+}
+
+const char *get_compress_str(int mode) {
+
+	switch (mode) {
+
+	case CMP_NONE:
+		return "NONE";
+
+	case CMP_ZSTD:
+		return "ZSTD";
+
+	case CMP_LZ4:
+		return "LZ4";
+
+	default:
+		return "UNKNOWN";
+	}
+}
+
+int get_compress_default_level(int mode) {
+
+	switch (mode) {
+
+	case CMP_ZSTD:
+		return 3;
+
+	case CMP_LZ4:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+int compress_level_valid(int mode, int level) {
+
+	switch (mode) {
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD:
+		return level >= 1 && level <= ZSTD_maxCLevel();
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		return level >= 1 && level <= LZ4HC_CLEVEL_MAX;
+#endif
+
+	default:
+		return level == 0;
+	}
+}
+
+void init_compress(compress_ctx *ctx, int mode, int level) {
+
+	memset(ctx, 0, sizeof(compress_ctx));
+	ctx->mode = mode;
+	ctx->level = level;
+
+	switch (mode) {
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD:
+		ctx->cctx = ZSTD_createCCtx();
+		ctx->dctx = ZSTD_createDCtx();
+		break;
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		ctx->cctx = malloc(level > 1 ? LZ4_sizeofStateHC() : LZ4_sizeofState());
+		ctx->dctx = ctx;	/// lz4 decompresses without a state
+		break;
+#endif
+
+	default:
+		log_mesg(0, 1, 1, 0, "Compression %s is not available in this build\n", get_compress_str(mode));
+		return;
+	}
+
+	if (ctx->cctx == NULL || ctx->dctx == NULL)
+		log_mesg(0, 1, 1, 0, "%s, %i, not enough memory\n", __func__, __LINE__);
+}
+
+void free_compress(compress_ctx *ctx) {
+
+	switch (ctx->mode) {
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD:
+		ZSTD_freeCCtx((ZSTD_CCtx *)ctx->cctx);
+		ZSTD_freeDCtx((ZSTD_DCtx *)ctx->dctx);
+		break;
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		free(ctx->cctx);
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	memset(ctx, 0, sizeof(compress_ctx));
+}
+
+size_t compress_bound(int mode, size_t size) {
+
+	switch (mode) {
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		return LZ4_compressBound((int)size);
+#endif
+
+	default:
+		return size;
+	}
+}
+
+size_t compress_frame(compress_ctx *ctx, const void *src, size_t size, void *dst, size_t capacity) {
+
+	size_t out = 0;
+
+	switch (ctx->mode) {
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD:
+		out = ZSTD_compressCCtx((ZSTD_CCtx *)ctx->cctx, dst, capacity, src, size, ctx->level);
+		if (ZSTD_isError(out))
+			out = 0;
+		break;
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		if (ctx->level > 1)
+			out = LZ4_compress_HC_extStateHC(ctx->cctx, src, dst, (int)size, (int)capacity, ctx->level);
+		else
+			out = LZ4_compress_fast_extState(ctx->cctx, src, dst, (int)size, (int)capacity, 1);
+		break;
+#endif
+
+	default:
+		break;
+	}
+
+	return out < size ? out : 0;
+}
+
+int decompress_frame(compress_ctx *ctx, const void *src, size_t size, void *dst, size_t raw_size) {
+
+	switch (ctx->mode) {
+
+#ifdef HAVE_LIBZSTD
+	case CMP_ZSTD: {
+		size_t out = ZSTD_decompressDCtx((ZSTD_DCtx *)ctx->dctx, dst, raw_size, src, size);
+
+		return !ZSTD_isError(out) && out == raw_size ? 0 : -1;
+	}
+#endif
+
+#ifdef HAVE_LIBLZ4
+	case CMP_LZ4:
+		return LZ4_decompress_safe(src, dst, (int)size, (int)raw_size) == (int)raw_size ? 0 : -1;
+#endif
+
+	default:
+		return -1;
+	}
+}
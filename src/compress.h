@@ -0,0 +1,53 @@
+/**
+ * compress.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * compression of the image data frames with zstd or lz4.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <stddef.h>
+
+typedef enum
+{
+	CMP_NONE = 0x00,
+	CMP_ZSTD = 0x01,
+	CMP_LZ4  = 0x02,	// level 1 is the fast compressor, 2 and more use LZ4HC
+
+} compress_mode_enum;
+
+/// one context per thread, it keeps the library state between frames
+typedef struct
+{
+	int mode;
+	int level;
+	void *cctx;
+	void *dctx;
+
+} compress_ctx;
+
+/// 1 when partclone was built with this compressor
+extern int compress_available(int mode);
+extern const char *get_compress_str(int mode);
+extern int get_compress_default_level(int mode);
+/// 1 when level is valid for mode
+extern int compress_level_valid(int mode, int level);
+
+extern void init_compress(compress_ctx *ctx, int mode, int level);
+extern void free_compress(compress_ctx *ctx);
+/// largest compressed size of size bytes
+extern size_t compress_bound(int mode, size_t size);
+/// compress src into dst, return the compressed size or 0 when it does not shrink
+extern size_t compress_frame(compress_ctx *ctx, const void *src, size_t size, void *dst, size_t capacity);
+/// decompress exactly raw_size bytes to dst, return 0 or -1 when the frame is damaged
+extern int decompress_frame(compress_ctx *ctx, const void *src, size_t size, void *dst, size_t raw_size);
+
+#endif /* COMPRESS_H_ */
@@ -0,0 +1,201 @@
+/**
+ * delta.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * delta images. The stored checksums of the base images tell which of their
+ * checksum chunks the device still holds unchanged, those blocks are left
+ * out of the bitmap of the new image so that only the changed ones are
+ * copied. Restoring the base and then the delta over it gives the device.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "partclone.h"
+#include "checksum.h"
+#include "delta.h"
+
+typedef struct
+{
+	const char *path;
+	int fd;
+	file_system_info fs_info;
+	image_options img_opt;
+	unsigned long *bitmap;
+	unsigned long long data_offset;
+
+} base_image;
+
+/// load the description and the bitmap of a base, return -1 when it cannot be compared with the device
+static int base_open(base_image *base, const char *path, const file_system_info *fs_info, cmd_opt *opt) {
+
+	image_head_v2 img_head;
+	const int debug = opt->debug;
+
+	memset(base, 0, sizeof(base_image));
+	base->path = path;
+	base->fd = open(path, O_RDONLY);
+	if (base->fd == -1) {
+		log_mesg(0, 1, 1, debug, "base image %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	load_image_desc(&base->fd, opt, &img_head, &base->fs_info, &base->img_opt);
+
+	if (base->fs_info.totalblock != fs_info->totalblock || base->fs_info.block_size != fs_info->block_size
+	    || strncmp(base->fs_info.fs, fs_info->fs, FS_MAGIC_SIZE)) {
+		log_mesg(0, 1, 1, debug, "base image %s: made from another file system\n", path);
+		close(base->fd);
+		return -1;
+	}
+
+	/// the checksums of the chunks are found by their offset
+	if (base->img_opt.checksum_mode == CSM_NONE || !base->img_opt.reseed_checksum || !base->img_opt.blocks_per_checksum
+	    || (base->img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE))) {
+		log_mesg(0, 1, 1, debug, "base image %s: a base needs checksums with reseed and no compression, --skip-zero or --chunk-store\n", path);
+		close(base->fd);
+		return -1;
+	}
+
+	base->bitmap = pc_alloc_bitmap(fs_info->totalblock);
+	if (base->bitmap == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	load_image_bitmap(&base->fd, *opt, base->fs_info, base->img_opt, base->bitmap);
+
+	base->data_offset = get_image_data_offset(&base->fs_info, &base->img_opt, opt);
+	return 0;
+}
+
+static void base_close(base_image *base) {
+
+	close(base->fd);
+	free(base->bitmap);
+}
+
+/// read the stored checksum of the chunk ending with the used block end
+static void base_checksum(base_image *base, unsigned long long end, unsigned char *checksum, cmd_opt *opt) {
+
+	const image_options *img_opt = &base->img_opt;
+	unsigned long long offset = base->data_offset + cnv_blocks_to_bytes(0, end, base->fs_info.block_size, img_opt);
+
+	/// a whole chunk is followed by its checksum, the last partial one has it after the data
+	if (end % img_opt->blocks_per_checksum == 0)
+		offset -= img_opt->checksum_size;
+
+	if (lseek(base->fd, (off_t)offset, SEEK_SET) == (off_t)-1
+	    || read_all(&base->fd, (char *)checksum, img_opt->checksum_size, opt) != img_opt->checksum_size)
+		log_mesg(0, 1, 1, opt->debug, "base image %s: too short\n", base->path);
+}
+
+/**
+ * Compare the chunks of one base with the device. A chunk holding a block in
+ * claimed, written again by a later base, is skipped. Return the number of
+ * blocks cleared from bitmap.
+ */
+static unsigned long long base_compare(base_image *base, int dfr, unsigned long *bitmap, const unsigned long *claimed,
+	char *buffer, const file_system_info *fs_info, cmd_opt *opt) {
+
+	const unsigned long long total = fs_info->totalblock;
+	const unsigned int block_size = fs_info->block_size;
+	const unsigned int blocks_per_cs = base->img_opt.blocks_per_checksum;
+	const unsigned int cs_size = base->img_opt.checksum_size;
+	const unsigned long long used = pc_count_bits(base->bitmap, total);
+	unsigned char checksum[cs_size], checksum_orig[cs_size];
+	unsigned long long done, block = 0, cleared = 0;
+
+	for (done = 0; done < used; ) {
+		const unsigned int blocks = used - done > blocks_per_cs ? blocks_per_cs : used - done;
+		unsigned long long first = 0, run, i;
+		unsigned int count = 0;
+		int skip = 0;
+
+		/// the blocks of one chunk, read from the device unless the chunk is skipped
+		while (count < blocks) {
+			run = pc_next_extent(base->bitmap, &block, blocks - count, total);
+			if (!count)
+				first = block;
+			if (pc_find_next_set(claimed, block, block + run) < block + run)
+				skip = 1;
+			if (!skip) {
+				if (lseek(dfr, (off_t)(block * block_size), SEEK_SET) == (off_t)-1
+				    || read_all(&dfr, buffer + (unsigned long long)count * block_size, run * block_size, opt) != (int)(run * block_size))
+					log_mesg(0, 1, 1, opt->debug, "source read ERROR %s\n", strerror(errno));
+			}
+			count += run;
+			block += run;
+		}
+		done += blocks;
+		if (skip)
+			continue;
+
+		init_checksum(base->img_opt.checksum_mode, checksum, opt->debug);
+		for (i = 0; i < blocks; i++)
+			update_checksum(checksum, buffer + i * block_size, block_size);
+		base_checksum(base, done, checksum_orig, opt);
+		if (memcmp(checksum, checksum_orig, cs_size))
+			continue;
+
+		/// unchanged, the base restores these blocks
+		for (i = pc_find_next_set(base->bitmap, first, block); i < block; i = pc_find_next_set(base->bitmap, i + 1, block)) {
+			if (pc_test_bit(i, bitmap, total)) {
+				pc_clear_bit(i, bitmap, total);
+				cleared++;
+			}
+		}
+	}
+
+	return cleared;
+}
+
+unsigned long long delta_bitmap(int dfr, char **bases, int base_count, unsigned long *bitmap,
+	const file_system_info *fs_info, cmd_opt *opt) {
+
+	const unsigned long long total = fs_info->totalblock;
+	unsigned long long cleared = 0;
+	unsigned long *claimed;
+	char *buffer = NULL;
+	base_image base;
+	int i;
+
+	claimed = pc_alloc_bitmap(total);
+	if (claimed == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	/// the last base wins, a block it holds does not come from an older one
+	for (i = base_count - 1; i >= 0; i--) {
+		unsigned long long n, w;
+
+		log_mesg(0, 0, 1, opt->debug, "Comparing with the base image %s...\n", bases[i]);
+		/// with --force, the older bases cannot be used either: the blocks of this one are unknown
+		if (base_open(&base, bases[i], fs_info, opt))
+			break;
+
+		buffer = realloc(buffer, (size_t)base.img_opt.blocks_per_checksum * fs_info->block_size);
+		if (buffer == NULL)
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+		n = base_compare(&base, dfr, bitmap, claimed, buffer, fs_info, opt);
+		log_mesg(1, 0, 0, opt->debug, "base %s: %llu blocks unchanged\n", bases[i], n);
+		cleared += n;
+
+		for (w = 0; w < BITS_TO_LONGS(total); w++)
+			claimed[w] |= base.bitmap[w];
+		base_close(&base);
+	}
+
+	free(buffer);
+	free(claimed);
+	return cleared;
+}
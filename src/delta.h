@@ -0,0 +1,27 @@
+/**
+ * delta.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * delta images, holding only the blocks changed since a chain of base images.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+/**
+ * Compare the device dfr with the chain of base images, the full image first
+ * and then its deltas in order. Every checksum chunk of a base whose blocks
+ * still hold the same data on the device, and were not written again by a
+ * later base, is cleared from bitmap. Return the number of blocks cleared.
+ * Exit on error.
+ */
+extern unsigned long long delta_bitmap(int dfr, char **bases, int base_count, unsigned long *bitmap,
+	const file_system_info *fs_info, cmd_opt *opt);
+
+#endif /* DELTA_H_ */
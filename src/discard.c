@@ -0,0 +1,194 @@
+/**
+ * discard.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * discard of the unused blocks of the targets during a restore, so that an
+ * SSD or a thin provisioned target gets the blocks the image does not hold
+ * back. A background thread goes through the free extents of the bitmap
+ * while the restore loop writes the data.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "partclone.h"
+#include "discard.h"
+
+enum {
+	DC_NONE,		/// not supported or failed, left as is
+	DC_BLOCK,		/// BLKDISCARD or BLKZEROOUT
+	DC_PUNCH,		/// fallocate() punch hole, reads back as zeros
+};
+
+typedef struct
+{
+	int method;
+	unsigned int align;	/// the ranges of a block device are aligned on it
+
+} discard_target;
+
+static int discard_method(discard_t *dc, unsigned int t, discard_target *dt) {
+
+	struct stat st;
+
+	dt->align = 1;
+	if (fstat(dc->fds[t], &st) == -1)
+		return DC_NONE;
+
+	if (S_ISBLK(st.st_mode)) {
+		long page = sysconf(_SC_PAGESIZE);
+		int size = 0;
+
+		/// whole pages, the page cache of the device is shared with the data writes
+		dt->align = page > PART_SECTOR_SIZE ? page : PART_SECTOR_SIZE;
+#ifdef BLKSSZGET
+		if (ioctl(dc->fds[t], BLKSSZGET, &size) == 0 && (unsigned int)size > dt->align)
+			dt->align = size;
+#endif
+#if defined(BLKDISCARD) && defined(BLKZEROOUT)
+		return DC_BLOCK;
+#endif
+	}
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (S_ISREG(st.st_mode))
+		return DC_PUNCH;
+#endif
+
+	return DC_NONE;
+}
+
+/// discard size bytes at offset on target t, 0 or -1 with errno
+static int discard_range(discard_t *dc, unsigned int t, discard_target *dt, off_t offset, unsigned long long size) {
+
+	off_t end = offset + (off_t)size;
+
+	/// keep the aligned part of the extent, a block device only takes whole sectors
+	offset = (offset + dt->align - 1) / dt->align * dt->align;
+	end = end / dt->align * dt->align;
+	if (end <= offset)
+		return 0;
+
+#if defined(BLKDISCARD) && defined(BLKZEROOUT)
+	if (dt->method == DC_BLOCK) {
+		uint64_t range[2] = { (uint64_t)offset, (uint64_t)(end - offset) };
+
+		return ioctl(dc->fds[t], dc->opt->discard == DISCARD_ZERO ? BLKZEROOUT : BLKDISCARD, range);
+	}
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (dt->method == DC_PUNCH)
+		return fallocate(dc->fds[t], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, end - offset);
+#endif
+
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static void *discard_thread(void *arg) {
+
+	discard_t *dc = (discard_t *)arg;
+	const unsigned long long min_size = dc->opt->discard_min;
+	discard_target *dt = calloc(dc->targets, sizeof(discard_target));
+	unsigned long long next = 0;
+	unsigned int t, going = 0;
+
+	if (dt == NULL)
+		log_mesg(0, 1, 1, dc->opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (t = 0; t < dc->targets; t++) {
+		dt[t].method = discard_method(dc, t, &dt[t]);
+		if (dt[t].method != DC_NONE) {
+			going++;
+			continue;
+		}
+		log_mesg(0, 0, 1, dc->opt->debug, "target %s: discard not supported, the unused blocks are left as is\n", dc->names[t]);
+		if (dc->opt->discard == DISCARD_ZERO)
+			dc->failed++;
+	}
+
+	while (going && next < dc->totalblock) {
+		unsigned long long start = pc_find_next_zero(dc->bitmap, next, dc->totalblock);
+		unsigned long long end = pc_find_next_set(dc->bitmap, start, dc->totalblock);
+		unsigned long long size = (end - start) * dc->block_size;
+		off_t offset = dc->offset + (off_t)(start * dc->block_size);
+		int first = 1;
+
+		next = end;
+		/// tiny holes cost the device more than they give back
+		if (start == end || size < min_size)
+			continue;
+
+		for (t = 0; t < dc->targets; t++) {
+			if (dt[t].method == DC_NONE)
+				continue;
+
+			if (discard_range(dc, t, &dt[t], offset, size) == 0) {
+				if (first) {
+					dc->extents++;
+					dc->bytes += size;
+					first = 0;
+				}
+				continue;
+			}
+
+			if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL) {
+				log_mesg(0, 0, 1, dc->opt->debug, "target %s: discard not supported (%s), the unused blocks are left as is\n",
+					dc->names[t], strerror(errno));
+				if (dc->opt->discard == DISCARD_ZERO)
+					dc->failed++;
+			} else {
+				log_mesg(0, 0, 1, dc->opt->debug, "target %s: discard ERROR at %llu: %s\n",
+					dc->names[t], (unsigned long long)offset, strerror(errno));
+				dc->failed++;
+			}
+			dt[t].method = DC_NONE;
+			going--;
+		}
+	}
+
+	free(dt);
+	return NULL;
+}
+
+void discard_start(discard_t *dc, int *fds, char **names, unsigned int targets,
+	const unsigned long *bitmap, unsigned long long totalblock, unsigned int block_size,
+	off_t offset, cmd_opt *opt) {
+
+	memset(dc, 0, sizeof(discard_t));
+	dc->fds = fds;
+	dc->names = names;
+	dc->targets = targets;
+	dc->bitmap = bitmap;
+	dc->totalblock = totalblock;
+	dc->block_size = block_size;
+	dc->offset = offset;
+	dc->opt = opt;
+
+	log_mesg(1, 0, 0, opt->debug, "discard the free extents of %llu bytes or more\n", opt->discard_min);
+	if (pthread_create(&dc->thread, NULL, discard_thread, dc))
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+}
+
+unsigned int discard_finish(discard_t *dc) {
+
+	pthread_join(dc->thread, NULL);
+	log_mesg(0, 0, 1, dc->opt->debug, "%s: %llu extents, %llu MB of unused blocks\n",
+		dc->opt->discard == DISCARD_ZERO ? "zeroed" : "discarded", dc->extents, print_size(dc->bytes, MBYTE));
+
+	return dc->failed;
+}
@@ -0,0 +1,57 @@
+/**
+ * discard.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * discard of the unused blocks of the targets during a restore.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DISCARD_H_
+#define DISCARD_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+struct cmd_opt;
+
+/**
+ * A thread walks the free extents of the bitmap while the restore loop
+ * writes the used ones, they never overlap. The extents of at least
+ * min_size bytes are discarded on every target: BLKDISCARD, or BLKZEROOUT
+ * with DISCARD_ZERO, on a block device and a punched hole in a file. A
+ * target which does not support it is left as is.
+ *
+ * discard_start	- start the thread, offset is where the blocks begin on
+ *			  the targets, the bitmap must stay until discard_finish
+ * discard_finish	- wait for the thread, return the targets which failed
+ */
+typedef struct
+{
+	int *fds;
+	char **names;
+	unsigned int targets;
+	const unsigned long *bitmap;
+	unsigned long long totalblock;
+	unsigned int block_size;
+	off_t offset;
+	struct cmd_opt *opt;
+
+	/// private
+	pthread_t thread;
+	unsigned long long extents;	/// discarded on the first target still going
+	unsigned long long bytes;
+	unsigned int failed;
+
+} discard_t;
+
+extern void discard_start(discard_t *dc, int *fds, char **names, unsigned int targets,
+	const unsigned long *bitmap, unsigned long long totalblock, unsigned int block_size,
+	off_t offset, struct cmd_opt *opt);
+extern unsigned int discard_finish(discard_t *dc);
+
+#endif /* DISCARD_H_ */
@@ -0,0 +1,307 @@
+/**
+ * fanout.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * restore of one image to several targets at once. The image is read and
+ * its checksums are checked once, the blocks are written to every target by
+ * a writer thread of its own. With a single target it is the write-behind of
+ * the restore: the next part of the image is read while the last is written.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "partclone.h"
+#include "pipeline.h"
+#include "fanout.h"
+
+/// extents merged in one pwritev()
+#define FANOUT_MAX_IOV 256
+
+struct fanout_writer
+{
+	fanout_t *fo;
+	unsigned int target;
+	pthread_t thread;
+	int failed;
+	unsigned long long released;	/// first slot not given back yet
+
+	/// the run of extents following each other on the target, not written yet
+	struct iovec iov[FANOUT_MAX_IOV];
+	int iov_count;
+	off_t run_offset;
+	unsigned long long run_size;
+};
+
+/// give the slots before seq back to the reader
+static void fanout_release(struct fanout_writer *w, unsigned long long seq) {
+
+	fanout_t *fo = w->fo;
+	int freed = 0;
+
+	if (w->released >= seq)
+		return;
+
+	pthread_mutex_lock(&fo->lock);
+	for (; w->released < seq; w->released++) {
+		if (--fo->slots[w->released % fo->slot_count].refs == 0)
+			freed = 1;
+	}
+	if (freed)
+		pthread_cond_broadcast(&fo->cond);
+	pthread_mutex_unlock(&fo->lock);
+}
+
+/// drop the target, it counts once however many writes fail
+static void fanout_fail(struct fanout_writer *w) {
+
+	fanout_t *fo = w->fo;
+
+	if (w->failed)
+		return;
+	w->failed = 1;
+	pthread_mutex_lock(&fo->lock);
+	fo->failed++;
+	pthread_mutex_unlock(&fo->lock);
+}
+
+static void fanout_flush(struct fanout_writer *w) {
+
+	fanout_t *fo = w->fo;
+	const char *name = fo->names[w->target];
+	int iov_count = w->iov_count;
+
+	if (!iov_count)
+		return;
+	w->iov_count = 0;
+	if (!pwritev_all(fo->fds[w->target], -1, w->iov, iov_count, w->run_offset, fo->opt))
+		return;
+
+	if (fo->opt->skip_write_error) {
+		log_mesg(0, 0, 1, fo->opt->debug, "skip write error on %s at %llu: %s\n",
+			name, (unsigned long long)w->run_offset, strerror(errno));
+		return;
+	}
+
+	log_mesg(0, 0, 1, fo->opt->debug, "target %s: write ERROR at %llu: %s%s\n", name, (unsigned long long)w->run_offset,
+		strerror(errno), fo->targets > 1 ? ", the other targets go on" : "");
+	fanout_fail(w);
+}
+
+/**
+ * Add the extents of slot seq to the run, the run is written when the next
+ * extent does not follow it on the target. The slots of a run written are
+ * given back, a run may go on in the next slot.
+ */
+static void fanout_write_slot(struct fanout_writer *w, unsigned long long seq) {
+
+	fanout_slot *slot = &w->fo->slots[seq % w->fo->slot_count];
+	unsigned int i;
+
+	for (i = 0; i < slot->count && !w->failed; i++) {
+		const fanout_extent *e = &slot->extents[i];
+
+		if (w->iov_count && (w->run_offset + (off_t)w->run_size != e->offset || w->iov_count == FANOUT_MAX_IOV)) {
+			fanout_flush(w);
+			fanout_release(w, seq);
+			/// the rest of the slot is not queued, a failed target has nothing to write
+			if (w->failed)
+				return;
+		}
+		if (!w->iov_count) {
+			w->run_offset = e->offset;
+			w->run_size = 0;
+		}
+		w->iov[w->iov_count].iov_base = (void *)e->data;
+		w->iov[w->iov_count++].iov_len = e->size;
+		w->run_size += e->size;
+	}
+}
+
+static void *fanout_writer(void *arg) {
+
+	struct fanout_writer *w = (struct fanout_writer *)arg;
+	fanout_t *fo = w->fo;
+	const int fd = fo->fds[w->target];
+	unsigned long long seq;
+
+	for (seq = 0; ; seq++) {
+		int more;
+
+		pthread_mutex_lock(&fo->lock);
+		more = seq < fo->submitted;
+		pthread_mutex_unlock(&fo->lock);
+
+		/// nothing queued to merge with, write the run before waiting
+		if (!more) {
+			fanout_flush(w);
+			fanout_release(w, seq);
+		}
+
+		pthread_mutex_lock(&fo->lock);
+		while (seq >= fo->submitted && !fo->eof)
+			pthread_cond_wait(&fo->cond, &fo->lock);
+		if (seq >= fo->submitted) {
+			pthread_mutex_unlock(&fo->lock);
+			break;
+		}
+		pthread_mutex_unlock(&fo->lock);
+
+		/// a failed target only gives the slots back
+		if (w->failed) {
+			w->iov_count = 0;
+			fanout_release(w, seq + 1);
+		} else {
+			fanout_write_slot(w, seq);
+		}
+	}
+
+	if (w->failed)
+		return NULL;
+
+	if (fo->size && ftruncate(fd, fo->size) == -1)
+		log_mesg(0, 0, 1, fo->opt->debug, "target %s: ftruncate ERROR: %s\n", fo->names[w->target], strerror(errno));
+	if (fsync(fd) && errno != EINVAL) {
+		log_mesg(0, 0, 1, fo->opt->debug, "target %s: fsync ERROR: %s\n", fo->names[w->target], strerror(errno));
+		fanout_fail(w);
+	}
+
+	return NULL;
+}
+
+void fanout_init(fanout_t *fo, int *fds, char **names, unsigned int targets,
+	unsigned long long slot_size, unsigned int max_extents, cmd_opt *opt) {
+
+	unsigned int i;
+
+	memset(fo, 0, sizeof(fanout_t));
+	fo->fds = fds;
+	fo->names = names;
+	fo->targets = targets;
+	fo->opt = opt;
+	fo->slot_count = pipeline_slot_count(opt->mem_limit, slot_size, 0);
+
+	fo->slots = calloc(fo->slot_count, sizeof(fanout_slot));
+	fo->writers = calloc(targets, sizeof(struct fanout_writer));
+	if (fo->slots == NULL || fo->writers == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (i = 0; i < fo->slot_count; i++) {
+		fo->slots[i].buffer = alloc_io_buffer(slot_size);
+		fo->slots[i].extents = malloc(max_extents * sizeof(fanout_extent));
+		if (fo->slots[i].buffer == NULL || fo->slots[i].extents == NULL)
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+
+	pthread_mutex_init(&fo->lock, NULL);
+	pthread_cond_init(&fo->cond, NULL);
+
+	log_mesg(1, 0, 0, opt->debug, "fan-out to %u targets, %u slots of %llu bytes\n", targets, fo->slot_count, slot_size);
+	for (i = 0; i < targets; i++) {
+		fo->writers[i].fo = fo;
+		fo->writers[i].target = i;
+		if (pthread_create(&fo->writers[i].thread, NULL, fanout_writer, &fo->writers[i]))
+			log_mesg(0, 1, 1, opt->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	}
+}
+
+char *fanout_buffer(fanout_t *fo) {
+
+	fanout_slot *slot = &fo->slots[fo->submitted % fo->slot_count];
+
+	pthread_mutex_lock(&fo->lock);
+	while (slot->refs)
+		pthread_cond_wait(&fo->cond, &fo->lock);
+	pthread_mutex_unlock(&fo->lock);
+
+	slot->count = 0;
+	return slot->buffer;
+}
+
+void fanout_add(fanout_t *fo, off_t offset, const char *data, unsigned long long size) {
+
+	fanout_slot *slot = &fo->slots[fo->submitted % fo->slot_count];
+	fanout_extent *last = slot->count ? &slot->extents[slot->count - 1] : NULL;
+
+	/// one pwrite() for the blocks following each other on the targets too
+	if (last && last->offset + (off_t)last->size == offset && last->data + last->size == data) {
+		last->size += size;
+		return;
+	}
+
+	slot->extents[slot->count].offset = offset;
+	slot->extents[slot->count].data = data;
+	slot->extents[slot->count++].size = size;
+}
+
+void fanout_submit(fanout_t *fo) {
+
+	pthread_mutex_lock(&fo->lock);
+	fo->slots[fo->submitted % fo->slot_count].refs = fo->targets;
+	fo->submitted++;
+	pthread_cond_broadcast(&fo->cond);
+	pthread_mutex_unlock(&fo->lock);
+}
+
+unsigned int fanout_finish(fanout_t *fo, off_t size) {
+
+	unsigned int i;
+
+	pthread_mutex_lock(&fo->lock);
+	fo->size = size;
+	fo->eof = 1;
+	pthread_cond_broadcast(&fo->cond);
+	pthread_mutex_unlock(&fo->lock);
+
+	for (i = 0; i < fo->targets; i++)
+		pthread_join(fo->writers[i].thread, NULL);
+
+	return fo->failed;
+}
+
+void fanout_drain(fanout_t *fo) {
+
+	unsigned int i;
+
+	pthread_mutex_lock(&fo->lock);
+	for (i = 0; i < fo->slot_count; i++) {
+		while (fo->slots[i].refs)
+			pthread_cond_wait(&fo->cond, &fo->lock);
+	}
+	pthread_mutex_unlock(&fo->lock);
+}
+
+unsigned int fanout_failed(fanout_t *fo) {
+
+	unsigned int failed;
+
+	pthread_mutex_lock(&fo->lock);
+	failed = fo->failed;
+	pthread_mutex_unlock(&fo->lock);
+
+	return failed;
+}
+
+void fanout_free(fanout_t *fo) {
+
+	unsigned int i;
+
+	for (i = 0; i < fo->slot_count; i++) {
+		free(fo->slots[i].buffer);
+		free(fo->slots[i].extents);
+	}
+	free(fo->slots);
+	free(fo->writers);
+	pthread_mutex_destroy(&fo->lock);
+	pthread_cond_destroy(&fo->cond);
+}
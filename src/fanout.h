@@ -0,0 +1,93 @@
+/**
+ * fanout.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * restore of one image to several targets at once, or to one target with
+ * the writes behind the reads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+struct cmd_opt;
+
+/// blocks of a buffer going to the same place on every target
+typedef struct
+{
+	off_t offset;
+	const char *data;
+	unsigned long long size;
+
+} fanout_extent;
+
+typedef struct
+{
+	char *buffer;
+	fanout_extent *extents;
+	unsigned int count;
+	unsigned int refs;	/// writers still using the slot
+
+} fanout_slot;
+
+struct fanout_writer;
+
+/**
+ * The restore loop reads and checks the image once into a ring of slots,
+ * every target has its own writer thread which writes the extents of the
+ * slots in order. The extents following each other on the target are merged
+ * in one pwritev(), across the slots already submitted too. A slot is reused
+ * when all the writers are done with it, so a slow target holds the others
+ * back only once it is a whole ring behind. A target failing to write is
+ * dropped, the others go on.
+ *
+ * fanout_init		- open the ring and start one writer per fd, the slots
+ *			  hold slot_size bytes and max_extents extents
+ * fanout_buffer	- wait for the next free slot and return its buffer
+ * fanout_add		- queue size bytes of data, within the buffer, at offset
+ * fanout_submit	- hand the slot to the writers
+ * fanout_finish	- wait for the writers, which truncate their target to
+ *			  size when it is not 0 and sync it, return the failed targets
+ * fanout_drain		- wait for the writers to be done with every slot submitted
+ * fanout_failed	- targets failed so far
+ * fanout_free		- free the ring after fanout_finish
+ */
+typedef struct
+{
+	int *fds;
+	char **names;
+	unsigned int targets;
+	struct cmd_opt *opt;
+
+	/// private
+	fanout_slot *slots;
+	unsigned int slot_count;
+	struct fanout_writer *writers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long submitted;
+	unsigned int failed;
+	off_t size;
+	int eof;
+
+} fanout_t;
+
+extern void fanout_init(fanout_t *fo, int *fds, char **names, unsigned int targets,
+	unsigned long long slot_size, unsigned int max_extents, struct cmd_opt *opt);
+extern char *fanout_buffer(fanout_t *fo);
+extern void fanout_add(fanout_t *fo, off_t offset, const char *data, unsigned long long size);
+extern void fanout_submit(fanout_t *fo);
+extern unsigned int fanout_finish(fanout_t *fo, off_t size);
+extern void fanout_drain(fanout_t *fo);
+extern unsigned int fanout_failed(fanout_t *fo);
+extern void fanout_free(fanout_t *fo);
+
+#endif /* FANOUT_H_ */
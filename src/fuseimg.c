@@ -29,9 +29,9 @@
 #include <errno.h>
 
 #include "partclone.h"
-off_t baseseek=0;
 cmd_opt opt;
 image_options    img_opt;
+image_index      index_img;  /// rank and offsets of the used blocks
 int dfr;                  /// file descriptor for source and target
 unsigned long   *bitmap;  /// the point for bitmap data
 file_system_info fs_info;
@@ -84,24 +84,15 @@ size_t get_file_size(unsigned long block)
 size_t read_block_data(unsigned long block, char *buf, size_t size, off_t offset)
 {
     unsigned long long used = 0;
-    unsigned int i;
-    unsigned long int seek_crc_size = 0;
     off_t bseek = 0;
     size_t x = 0;
 
-    for(i = 0; i < block; ++i) {
-	if (pc_test_bit(i, bitmap, fs_info.totalblock))
-	    ++used;
-    }
-
-    seek_crc_size = (used / img_opt.blocks_per_checksum) * img_opt.checksum_size;
-    bseek = (off_t)(fs_info.block_size*used+seek_crc_size+baseseek);
+    used = image_index_rank(&index_img, bitmap, block);
+    bseek = (off_t)image_index_offset(&index_img, &fs_info, &img_opt, used);
 
     //printf("RRRRR read block %lu\n", block);
     //printf("bseek, == %zd, ", bseek);
-    //printf("blockXsiz == %zd, ", (fs_info.block_size*used));
-    //printf("crcXsize == %zd, ", seek_crc_size);
-    //printf("base == %zd, ", baseseek);
+    //printf("used == %llu, ", used);
     //printf("\n");
 
     offset+=bseek;
@@ -315,6 +306,8 @@ int main(int argc, char *argv[])
 
     /// get image information from image file
     load_image_desc(&dfr, &opt, &img_head, &fs_info, &img_opt);
+    if (img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE | IMG_FEATURE_DELTA))
+	log_mesg(0, 1, 1, opt.debug, "fuseimg: compressed, --skip-zero, chunk store and delta images are not supported, restore the image instead\n");
 
     /// alloc a memory to restore bitmap
     bitmap = pc_alloc_bitmap(fs_info.totalblock);
@@ -333,7 +326,8 @@ int main(int argc, char *argv[])
 
 //    print_partclone_info(opt);
 //    print_file_system_info(fs_info, opt);
-    baseseek = lseek(dfr, 0, SEEK_CUR);
+    /// images without an index count the bitmap for each read
+    load_image_index(dfr, &index_img, &fs_info, &img_opt, &opt);
 
     return fuse_main(argc, argv, &ptl_fuse_operations, NULL);
 }
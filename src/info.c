@@ -110,10 +110,12 @@ void info_options (int argc, char **argv){
 int main(int argc, char **argv){ 
 
 	int dfr;                  /// file descriptor for source and target
-	unsigned long   *bitmap;  /// the point for bitmap data
+	unsigned long   *bitmap = NULL;  /// the point for bitmap data
 	image_head_v2    img_head;
 	file_system_info fs_info;
 	image_options    img_opt;
+	image_footer_stats stats;
+	int              has_stats;
 
     if (argc == 2){
 	memset(&opt, 0, sizeof(cmd_opt));
@@ -144,23 +146,29 @@ int main(int argc, char **argv){
     /// get image information from image file
     load_image_desc(&dfr, &opt, &img_head, &fs_info, &img_opt);
 
-    /// alloc a memory to restore bitmap
-    bitmap = pc_alloc_bitmap(fs_info.totalblock);
-    if (bitmap == NULL)
-	log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+    /// the footer of a seekable image has all we print, the bitmap is read otherwise
+    has_stats = load_image_stats(dfr, &stats, &img_opt, &opt) == 0;
+    if (!has_stats) {
+	/// alloc a memory to restore bitmap
+	bitmap = pc_alloc_bitmap(fs_info.totalblock);
+	if (bitmap == NULL)
+	    log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
 
-    log_mesg(0, 0, 0, opt.debug, "initial main bitmap pointer %p\n", bitmap);
-    log_mesg(0, 0, 0, opt.debug, "Initial image hdr: read bitmap table\n");
+	log_mesg(0, 0, 0, opt.debug, "initial main bitmap pointer %p\n", bitmap);
+	log_mesg(0, 0, 0, opt.debug, "Initial image hdr: read bitmap table\n");
 
-    /// read and check bitmap from image file
-    load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
+	/// read and check bitmap from image file
+	load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
 
-    log_mesg(0, 0, 0, opt.debug, "check main bitmap pointer %p\n", bitmap);
+	log_mesg(0, 0, 0, opt.debug, "check main bitmap pointer %p\n", bitmap);
+    }
     log_mesg(0, 0, 0, opt.debug, "print image information\n");
 
     print_file_system_info(fs_info, opt);
     log_mesg(0, 0, 1, opt.debug, "\n");
     print_image_info(img_head, img_opt, opt);
+    if (has_stats)
+	print_image_stats(&stats, opt);
 
     close(dfr);     /// close source
     free(bitmap);   /// free bitmap
@@ -0,0 +1,290 @@
+/**
+ * ioengine.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * asynchronous read engine, io_uring with a pread fallback.
+ *
+ * The engine keeps up to depth reads in flight on one file descriptor and
+ * hands them back in submission order, so the caller can still write the
+ * image stream sequentially. io_uring is driven with the raw system calls,
+ * there is no need for liburing. When the kernel or the build lacks
+ * io_uring, every request is read synchronously with pread() in
+ * io_engine_wait().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "partclone.h"
+#include "ioengine.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define USE_IO_URING 1
+#endif
+
+extern cmd_opt opt;
+
+/// read the rest of a request synchronously, for the fallback and for short reads
+static void io_engine_pread(io_engine *eng, io_request *req) {
+
+	unsigned long long done = req->result > 0 ? req->result : 0;
+	int buffered = 0;
+
+	req->error = 0;
+	while (done < req->size) {
+		ssize_t n = pread(eng->fd, req->buf + done, req->size - done, req->offset + done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			/// unaligned tail on an O_DIRECT descriptor
+			if (errno == EINVAL && opt.direct_io && !buffered && set_direct_io(eng->fd, 0)) {
+				buffered = 1;
+				continue;
+			}
+			req->error = errno;
+			break;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	if (buffered)
+		set_direct_io(eng->fd, 1);
+	req->result = req->error ? -1 : (long long)done;
+}
+
+#ifdef USE_IO_URING
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_engine_uring_init(io_engine *eng) {
+
+	struct io_uring_params p;
+	int debug = opt.debug;
+
+	memset(&p, 0, sizeof(p));
+	eng->ring_fd = io_uring_setup(eng->depth, &p);
+	if (eng->ring_fd < 0) {
+		log_mesg(1, 0, 0, debug, "io_uring setup failed: %s, use pread\n", strerror(errno));
+		eng->ring_fd = -1;
+		return 0;
+	}
+
+	eng->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	eng->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (eng->cq_size > eng->sq_size)
+			eng->sq_size = eng->cq_size;
+		eng->cq_size = eng->sq_size;
+	}
+	eng->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	eng->sq_ptr = mmap(NULL, eng->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, eng->ring_fd, IORING_OFF_SQ_RING);
+	if (eng->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		eng->cq_ptr = eng->sq_ptr;
+	else {
+		eng->cq_ptr = mmap(NULL, eng->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, eng->ring_fd, IORING_OFF_CQ_RING);
+		if (eng->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	eng->sqes = mmap(NULL, eng->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, eng->ring_fd, IORING_OFF_SQES);
+	if (eng->sqes == MAP_FAILED)
+		goto fail;
+
+	eng->sq_head  = (unsigned *)((char *)eng->sq_ptr + p.sq_off.head);
+	eng->sq_tail  = (unsigned *)((char *)eng->sq_ptr + p.sq_off.tail);
+	eng->sq_mask  = (unsigned *)((char *)eng->sq_ptr + p.sq_off.ring_mask);
+	eng->sq_array = (unsigned *)((char *)eng->sq_ptr + p.sq_off.array);
+	eng->cq_head  = (unsigned *)((char *)eng->cq_ptr + p.cq_off.head);
+	eng->cq_tail  = (unsigned *)((char *)eng->cq_ptr + p.cq_off.tail);
+	eng->cq_mask  = (unsigned *)((char *)eng->cq_ptr + p.cq_off.ring_mask);
+	eng->cqes     = (char *)eng->cq_ptr + p.cq_off.cqes;
+
+	log_mesg(1, 0, 0, debug, "io_uring: %u entries, features %x\n", p.sq_entries, p.features);
+	return 1;
+
+fail:
+	log_mesg(1, 0, 0, debug, "io_uring mmap failed: %s, use pread\n", strerror(errno));
+	if (eng->sq_ptr && eng->sq_ptr != MAP_FAILED)
+		munmap(eng->sq_ptr, eng->sq_size);
+	if (eng->cq_ptr && eng->cq_ptr != MAP_FAILED && eng->cq_ptr != eng->sq_ptr)
+		munmap(eng->cq_ptr, eng->cq_size);
+	eng->sq_ptr = eng->cq_ptr = NULL;
+	close(eng->ring_fd);
+	eng->ring_fd = -1;
+	return 0;
+}
+
+static void io_engine_uring_submit(io_engine *eng, io_request *req, unsigned int index) {
+
+	struct io_uring_sqe *sqe;
+	unsigned tail = *eng->sq_tail;
+	unsigned slot = tail & *eng->sq_mask;
+
+	sqe = (struct io_uring_sqe *)eng->sqes + slot;
+	memset(sqe, 0, sizeof(*sqe));
+	/// READV is in every kernel with io_uring, READ needs 5.6
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = eng->fd;
+	sqe->addr = (unsigned long)&req->iov;
+	sqe->len = 1;
+	sqe->off = req->offset;
+	sqe->user_data = index;
+	eng->sq_array[slot] = slot;
+
+	__atomic_store_n(eng->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while (io_uring_enter(eng->ring_fd, 1, 0, 0) < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			continue;
+		log_mesg(0, 1, 1, opt.debug, "io_uring submit ERROR:%s\n", strerror(errno));
+	}
+}
+
+/// move every available completion to its request
+static void io_engine_uring_reap(io_engine *eng) {
+
+	unsigned head = *eng->cq_head;
+
+	while (head != __atomic_load_n(eng->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = (struct io_uring_cqe *)eng->cqes + (head & *eng->cq_mask);
+		io_request *req = &eng->reqs[cqe->user_data];
+
+		if (cqe->res < 0) {
+			req->result = -1;
+			req->error = -cqe->res;
+		} else
+			req->result = cqe->res;
+		req->done = 1;
+		head++;
+	}
+	__atomic_store_n(eng->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void io_engine_uring_exit(io_engine *eng) {
+
+	munmap(eng->sqes, eng->sqes_size);
+	if (eng->cq_ptr != eng->sq_ptr)
+		munmap(eng->cq_ptr, eng->cq_size);
+	munmap(eng->sq_ptr, eng->sq_size);
+	close(eng->ring_fd);
+	eng->ring_fd = -1;
+}
+
+#endif /* USE_IO_URING */
+
+void io_engine_init(io_engine *eng, int fd, unsigned int depth) {
+
+	memset(eng, 0, sizeof(*eng));
+	if (depth < 1)
+		depth = 1;
+	if (depth > IO_ENGINE_MAX_DEPTH)
+		depth = IO_ENGINE_MAX_DEPTH;
+
+	eng->fd = fd;
+	eng->depth = depth;
+	eng->ring_fd = -1;
+	eng->reqs = calloc(depth, sizeof(io_request));
+	if (eng->reqs == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+#ifdef USE_IO_URING
+	eng->uring = io_engine_uring_init(eng);
+#else
+	log_mesg(1, 0, 0, opt.debug, "built without io_uring, use pread\n");
+#endif
+}
+
+void io_engine_exit(io_engine *eng) {
+
+	/// nothing may land in the buffers after we return
+	while (io_engine_pending(eng))
+		io_engine_wait(eng);
+
+#ifdef USE_IO_URING
+	if (eng->uring)
+		io_engine_uring_exit(eng);
+#endif
+	free(eng->reqs);
+	eng->reqs = NULL;
+}
+
+unsigned int io_engine_pending(const io_engine *eng) {
+	return (unsigned int)(eng->submitted - eng->completed);
+}
+
+io_request *io_engine_submit(io_engine *eng, char *buf, unsigned long long size, unsigned long long offset) {
+
+	unsigned int index = eng->submitted % eng->depth;
+	io_request *req = &eng->reqs[index];
+
+	if (io_engine_pending(eng) >= eng->depth)
+		log_mesg(0, 1, 1, opt.debug, "%s: queue is full\n", __func__);
+
+	memset(req, 0, sizeof(*req));
+	req->buf = buf;
+	req->size = size;
+	req->offset = offset;
+	req->iov.iov_base = buf;
+	req->iov.iov_len = size;
+	eng->submitted++;
+
+#ifdef USE_IO_URING
+	if (eng->uring)
+		io_engine_uring_submit(eng, req, index);
+#endif
+
+	return req;
+}
+
+io_request *io_engine_wait(io_engine *eng) {
+
+	io_request *req;
+
+	if (!io_engine_pending(eng))
+		return NULL;
+
+	req = &eng->reqs[eng->completed % eng->depth];
+
+#ifdef USE_IO_URING
+	if (eng->uring) {
+		for (;;) {
+			io_engine_uring_reap(eng);
+			if (req->done)
+				break;
+			if (io_uring_enter(eng->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				log_mesg(0, 1, 1, opt.debug, "io_uring wait ERROR:%s\n", strerror(errno));
+		}
+		/// a short read is not an error, finish it like read_all() does
+		if (req->result >= 0 && (unsigned long long)req->result < req->size)
+			io_engine_pread(eng, req);
+		else if (req->result == -1 && req->error == EINVAL && opt.direct_io) {
+			req->result = 0;
+			io_engine_pread(eng, req);
+		}
+	} else
+#endif
+		io_engine_pread(eng, req);
+
+	eng->completed++;
+	return req;
+}
@@ -0,0 +1,80 @@
+/**
+ * ioengine.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * asynchronous read engine, io_uring with a pread fallback.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef IOENGINE_H_
+#define IOENGINE_H_
+
+#include <sys/uio.h>
+
+#define IO_ENGINE_MAX_DEPTH 256
+
+/// one read in flight
+typedef struct
+{
+	char *buf;
+	unsigned long long offset;
+	unsigned long long size;
+
+	/// bytes read or -1, like read_all()
+	long long result;
+	/// errno when result is -1
+	int error;
+
+	/// caller's bookkeeping, untouched by the engine
+	unsigned long long block;
+	unsigned long long blocks;
+
+	/// private
+	struct iovec iov;
+	int done;
+
+} io_request;
+
+typedef struct
+{
+	int fd;
+	unsigned int depth;
+	int uring;		/// 1 when io_uring is used, 0 for the pread fallback
+
+	io_request *reqs;	/// ring of depth requests, in submission order
+	unsigned long long submitted;
+	unsigned long long completed;
+
+	/// private, io_uring rings
+	int ring_fd;
+	void *sq_ptr, *cq_ptr, *sqes;
+	unsigned long sq_size, cq_size, sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *cqes;
+
+} io_engine;
+
+/// set up an engine reading from fd with up to depth requests in flight
+extern void io_engine_init(io_engine *eng, int fd, unsigned int depth);
+extern void io_engine_exit(io_engine *eng);
+
+/// number of requests submitted and not yet returned by io_engine_wait()
+extern unsigned int io_engine_pending(const io_engine *eng);
+
+/**
+ * queue a read of size bytes at offset into buf. The caller must not have
+ * more than depth requests pending. Return the request so the caller can
+ * fill its bookkeeping fields.
+ */
+extern io_request *io_engine_submit(io_engine *eng, char *buf, unsigned long long size, unsigned long long offset);
+
+/// wait for the oldest pending request, so requests complete in order. NULL when none is pending.
+extern io_request *io_engine_wait(io_engine *eng);
+
+#endif /* IOENGINE_H_ */
@@ -28,9 +28,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 #include <assert.h>
 #include <dirent.h>
 #include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 // SHA1 for torrent info
 #include "torrent_helper.h"
@@ -52,6 +55,9 @@ int done;
 /// cmd_opt structure defined in partclone.h
 cmd_opt opt;
 
+/// the data of the used blocks written by clone, for the image footer
+static image_digest digest;
+
 #include "checksum.h"
 
 /// fs option
@@ -59,6 +65,104 @@ cmd_opt opt;
 /// cmd_opt structure defined in partclone.h
 fs_cmd_opt fs_opt;
 
+#include "pipeline.h"
+#include "ioengine.h"
+#include "compress.h"
+#include "chunkstore.h"
+#include "delta.h"
+#include "split.h"
+#include "fanout.h"
+#include "discard.h"
+#include "checkpoint.h"
+
+static const char *const bad_sectors_warning_msg =
+	"*************************************************************************\n"
+	"* WARNING: The disk has bad sectors. This means physical damage on the  *\n"
+	"* disk surface caused by deterioration, manufacturing faults, or        *\n"
+	"* another reason. The reliability of the disk may remain stable or      *\n"
+	"* degrade quickly. Use the --rescue option to efficiently save as much  *\n"
+	"* data as possible!                                                     *\n"
+	"*************************************************************************\n";
+
+static void clone_image_options(image_options *img_opt);
+static void clone_image_layout(image_options *img_opt, const file_system_info *fs_info);
+static void clone_image_stats(image_index *index, const struct timespec *start);
+static void clone_pipeline(int dfr, int dfw, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt, image_index *index);
+static unsigned int pipeline_item_blocks(unsigned int block_size, unsigned int blocks_per_cs);
+
+static void clone_chunk_store(int dfr, int dfw, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt);
+
+/// restore of framed and chunk store images, see decompress_start()
+typedef struct {
+	int dfr;			/// the image
+	int pipe_w;			/// decompressed data for the restore loop
+	int failed;			/// the restore loop closed the pipe
+	unsigned long long used_blocks;
+	unsigned long long next_block;	/// first used block of the next frame, or device block of the next chunk
+	unsigned int head_size;		/// frame header and zero map
+	size_t max_raw;			/// raw size of a full frame
+	size_t max_size;		/// largest compressed payload, 0 when not compressed
+	unsigned long *zero_map;	/// used blocks left out as zeros, by rank
+	unsigned long *bitmap;
+	unsigned int item_chunks;	/// chunks read together
+	chunk_store store;
+	file_system_info *fs_info;
+	image_options *img_opt;
+	pthread_t thread;
+} decompress_reader;
+
+static int decompress_start(decompress_reader *reader, int dfr, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt);
+static int decompress_stop(decompress_reader *reader, int fd);
+#ifndef CHKIMG
+/// how the zero blocks of an IMG_FEATURE_ZEROMAP image reach the target
+typedef struct {
+	int method;			/// ZERO_PUNCH, ZERO_BLKZEROOUT or ZERO_WRITE
+	char *zeros;			/// ZERO_WRITE: a buffer of zeros
+	unsigned long long zeros_size;
+} zero_target;
+
+enum { ZERO_WRITE, ZERO_PUNCH, ZERO_BLKZEROOUT };
+
+static void zero_target_init(zero_target *zt, int dfw, unsigned long long buffer_size);
+static long long write_blocks_zero_map(int *dfw, char *buffer, unsigned int blocks, unsigned int block_size,
+	const decompress_reader *reader, unsigned long long rank, zero_target *zt);
+static void preallocate_target(int fd, const char *name, const unsigned long *bitmap, unsigned long long total, unsigned int block_size);
+static void restore_parallel(int dfr, int dfw, const char *target, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt);
+
+/// the targets of a restore, flushed before a checkpoint
+typedef struct {
+	fanout_t *fo;			/// NULL without write behind
+	int *dfws;
+	char **targets;
+	int count;
+} restore_targets;
+
+static void restore_checkpoint_sync(void *arg);
+#endif
+static unsigned int io_depth_limit(unsigned long long read_size);
+static void read_ahead(io_engine *io, char *buffers, unsigned int buffer_blocks, unsigned long *bitmap, file_system_info *fs_info, unsigned long long *next);
+static void check_source_read(int *dfr, char *buffer, int size, off_t offset, int r_size);
+static void clone_zero_copy(int dfr, int dfw, unsigned long *bitmap, file_system_info *fs_info, unsigned int buffer_capacity);
+#ifdef CHKIMG
+static void verify_parallel(int dfr, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt);
+static void check_index(int dfr, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt);
+#endif
+#ifdef CONVERT
+/// the new image of partclone.convert, see convert_start()
+typedef struct {
+	int dfw;			/// the new image
+	int pipe_r;			/// used blocks from the restore loop
+	unsigned long *bitmap;
+	file_system_info *fs_info;
+	image_options img_opt;		/// of the new image
+	image_index index;
+	pthread_t thread;
+} convert_writer;
+
+static int convert_start(convert_writer *writer, int dfw, unsigned long *bitmap, file_system_info *fs_info, const image_options *src_opt);
+static int convert_stop(convert_writer *writer, int fd, const struct timespec *start);
+#endif
+
 /**
  * main function - for clone or restore data
  */
@@ -85,19 +189,21 @@ int main(int argc, char **argv) {
 	pthread_t		prog_thread;
 	void			*p_result;
 	struct stat st_dev;
-
-	static const char *const bad_sectors_warning_msg =
-		"*************************************************************************\n"
-		"* WARNING: The disk has bad sectors. This means physical damage on the  *\n"
-		"* disk surface caused by deterioration, manufacturing faults, or        *\n"
-		"* another reason. The reliability of the disk may remain stable or      *\n"
-		"* degrade quickly. Use the --rescue option to efficiently save as much  *\n"
-		"* data as possible!                                                     *\n"
-		"*************************************************************************\n";
+	struct timespec	clone_start;
 
 	file_system_info fs_info;   /// description of the file system
 	image_options    img_opt;
+	decompress_reader decomp;   /// used with compressed images only
+#ifndef CHKIMG
+	int		*dfws = &dfw;		/// every target, several ones for a fan-out restore
+	char		**targets = &target;
+	unsigned int	target_count = 1, t;
+#endif
+#ifdef CONVERT
+	convert_writer	convert;
+#endif
 
+	clock_gettime(CLOCK_MONOTONIC, &clone_start);
 	init_fs_info(&fs_info);
 	init_image_options(&img_opt);
 
@@ -170,6 +276,21 @@ int main(int argc, char **argv) {
 		log_mesg(0, 1, 1, debug, "Error exit\n");
 	    }
 	}
+
+	/// the other targets of a restore to several devices
+	if (opt.target_count > 1) {
+		target_count = opt.target_count;
+		targets = opt.targets;
+		dfws = malloc(target_count * sizeof(int));
+		if (dfws == NULL)
+			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		dfws[0] = dfw;
+		for (t = 1; t < target_count; t++) {
+			log_mesg(1, 0, 0, debug, "target %u=%s\n", t, targets[t]);
+			if ((dfws[t] = open_target(targets[t], &opt)) == -1)
+				log_mesg(0, 1, 1, debug, "Error exit\n");
+		}
+	}
 #else
 	dfw = -1;
 #endif
@@ -179,12 +300,7 @@ int main(int argc, char **argv) {
 	 */
 	if (opt.clone) {
 
-		log_mesg(1, 0, 0, debug, "Initiate image options - version %s\n", IMAGE_VERSION_CURRENT);
-
-		img_opt.checksum_mode = opt.checksum_mode;
-		img_opt.checksum_size = get_checksum_size(opt.checksum_mode, opt.debug);
-		img_opt.blocks_per_checksum = opt.blocks_per_checksum;
-		img_opt.reseed_checksum = opt.reseed_checksum;
+		clone_image_options(&img_opt);
 
 		cs_size = img_opt.checksum_size;
 		cs_reseed = img_opt.reseed_checksum;
@@ -195,15 +311,7 @@ int main(int argc, char **argv) {
 		/// get Super Block information from partition
 		read_super_blocks(source, &fs_info);
 
-		if (img_opt.checksum_mode != CSM_NONE && img_opt.blocks_per_checksum == 0) {
-
-			const unsigned int buffer_capacity = opt.buffer_size > fs_info.block_size
-				? opt.buffer_size / fs_info.block_size : 1; // in blocks
-
-			img_opt.blocks_per_checksum = buffer_capacity;
-
-		}
-		log_mesg(1, 0, 0, debug, "%u blocks per checksum\n", img_opt.blocks_per_checksum);
+		clone_image_layout(&img_opt, &fs_info);
 
 		check_mem_size(fs_info, img_opt, opt);
 
@@ -221,14 +329,29 @@ int main(int argc, char **argv) {
 		read_bitmap(source, fs_info, bitmap, pui);
 		update_used_blocks_count(&fs_info, bitmap);
 
-		/* skip check free space while torrent_only on */
-		if ((opt.check) && (opt.torrent_only == 0)) {
+		/// a delta image only holds the blocks the base images do not have
+		if (img_opt.features & IMG_FEATURE_DELTA) {
+			unsigned long long unchanged = delta_bitmap(dfr, opt.base, opt.base_count, bitmap, &fs_info, &opt);
+
+			update_used_blocks_count(&fs_info, bitmap);
+			log_mesg(0, 0, 1, debug, "delta: %llu blocks unchanged, %llu blocks to copy\n", unchanged, fs_info.used_bitmap);
+			fs_info.usedblocks = fs_info.used_bitmap;
+		}
+
+		set_image_bitmap_mode(&img_opt, &fs_info, bitmap);
+
+		/* skip check free space while torrent_only on, and for segments spread over several directories */
+		if ((opt.check) && (opt.torrent_only == 0) && (opt.split_size == 0)) {
 
 			unsigned long long needed_space = 0;
 
 			needed_space += sizeof(image_head) + sizeof(file_system_info) + sizeof(image_options);
 			needed_space += get_bitmap_size_on_disk(&fs_info, &img_opt, &opt);
-			needed_space += cnv_blocks_to_bytes(0, fs_info.usedblocks, fs_info.block_size, &img_opt);
+			if (img_opt.features & IMG_FEATURE_CHUNKSTORE)
+				needed_space += (fs_info.totalblock / img_opt.chunk_blocks + 1) * CHUNK_ID_SIZE;
+			else
+				needed_space += cnv_blocks_to_bytes(0, fs_info.usedblocks, fs_info.block_size, &img_opt);
+			needed_space += get_image_index_size(&fs_info, &img_opt);
 
 			check_free_space(target, needed_space);
 		}
@@ -254,6 +377,10 @@ int main(int argc, char **argv) {
 		load_image_desc(&dfr, &opt, &img_head, &fs_info, &img_opt);
 		cs_size = img_opt.checksum_size;
 		cs_reseed = img_opt.reseed_checksum;
+#ifndef CHKIMG
+		if ((img_opt.features & IMG_FEATURE_DELTA) && !opt.convert)
+			log_mesg(0, 0, 1, debug, "Delta image: only the changed blocks are written, the target must hold its restored base\n");
+#endif
 
 		check_mem_size(fs_info, img_opt, opt);
 
@@ -270,14 +397,30 @@ int main(int argc, char **argv) {
 		log_mesg(0, 0, 1, debug, "Calculating bitmap... Please wait...\n");
 		load_image_bitmap(&dfr, opt, fs_info, img_opt, bitmap);
 
+#ifdef CHKIMG
+		if (img_opt.features & IMG_FEATURE_INDEX)
+			check_index(dfr, bitmap, &fs_info, &img_opt);
+#endif
+
+		/// from here the restore loop reads the decompressed data
+		if (img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE))
+			dfr = decompress_start(&decomp, dfr, bitmap, &fs_info, &img_opt);
+
 #ifndef CHKIMG
 		/// check the dest partition size.
-		if (opt.restore_raw_file)
-			check_free_space(target, fs_info.device_size);
-		else if ((opt.check) && (opt.blockfile == 0))
-			check_size(&dfw, fs_info.device_size);
-		else if (opt.blockfile == 1 && opt.torrent_only == 0)
-			check_free_space(target, fs_info.usedblocks*fs_info.block_size);
+		for (t = 0; t < target_count && !opt.convert; t++) {
+			if (opt.restore_raw_file)
+				check_free_space(targets[t], fs_info.device_size);
+			else if ((opt.check) && (opt.blockfile == 0))
+				check_size(&dfws[t], fs_info.device_size);
+			else if (opt.blockfile == 1 && opt.torrent_only == 0)
+				check_free_space(targets[t], fs_info.usedblocks*fs_info.block_size);
+		}
+#endif
+
+#ifdef CONVERT
+		/// from here the restore loop writes the used blocks to the new image
+		dfw = convert_start(&convert, dfw, bitmap, &fs_info, &img_opt);
 #endif
 
 		log_mesg(2, 0, 0, debug, "check main bitmap pointer %p\n", bitmap);
@@ -388,6 +531,18 @@ int main(int argc, char **argv) {
 
 	print_file_system_info(fs_info, opt);
 
+	/// the device side of --direct-io may have to fall back to the page cache
+	if (opt.direct_io) {
+		if (opt.clone || opt.dd)
+			check_direct_io(dfr, fs_info.block_size, 0, &opt);
+#ifndef CHKIMG
+		if ((opt.restore || opt.dd) && opt.blockfile == 0) {
+			for (t = 0; t < target_count; t++)
+				check_direct_io(dfws[t], fs_info.block_size, opt.offset, &opt);
+		}
+#endif
+	}
+
 	/**
 	 * initial progress bar
 	 */
@@ -419,8 +574,16 @@ int main(int argc, char **argv) {
 		const unsigned int block_size = fs_info.block_size;
 		const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1; // in blocks
 		unsigned char checksum[cs_size];
-		unsigned int blocks_in_cs, blocks_per_cs, write_size;
-		char *read_buffer, *write_buffer;
+		unsigned int blocks_in_cs, blocks_per_cs;
+		char *read_buffer, *cs_buffer;
+		unsigned char *block_hashes = NULL;	/// for the digest of the image index
+		struct iovec *iov;
+		io_engine io;
+		unsigned long long read_next = 0;	/// next block to queue on io
+		const int pipelined = (opt.threads || (img_opt.features & IMG_FEATURES_FRAMED)) && opt.blockfile == 0
+			&& (cs_reseed || img_opt.checksum_mode == CSM_NONE) && !opt.checkpoint;
+		image_index index;
+		checkpoint_journal ckpt;	/// used with --checkpoint only
 
 		// SHA1 for torrent info
 		int tinfo = -1;
@@ -430,12 +593,17 @@ int main(int argc, char **argv) {
 
 		log_mesg(1, 0, 0, debug, "#\nBuffer capacity = %u, Blocks per cs = %u\n#\n", buffer_capacity, blocks_per_cs);
 
-		write_size = cnv_blocks_to_bytes(0, buffer_capacity, block_size, &img_opt);
+		io.depth = 1;
+		if (opt.io_depth && !pipelined)
+			io_engine_init(&io, dfr, io_depth_limit(buffer_capacity * block_size));
 
-		read_buffer = (char*)malloc(buffer_capacity * block_size);
-		write_buffer = (char*)malloc(write_size + cs_size);
+		/// one read buffer per request in flight
+		read_buffer = alloc_io_buffer((unsigned long long)buffer_capacity * block_size * io.depth);
+		/// the image is written with writev(), the blocks from read_buffer and the checksums from cs_buffer
+		cs_buffer = (char*)malloc((buffer_capacity + 1) * cs_size + 1);
+		iov = (struct iovec*)malloc((2 * buffer_capacity + 1) * sizeof(struct iovec));
 
-		if (read_buffer == NULL || write_buffer == NULL) {
+		if (read_buffer == NULL || cs_buffer == NULL || iov == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
 		}
 
@@ -450,6 +618,7 @@ int main(int argc, char **argv) {
 
 		blocks_in_cs = 0;
 		init_checksum(img_opt.checksum_mode, checksum, debug);
+		image_digest_init(&digest);
 
 		if (opt.blockfile == 1) {
 			char torrent_name[PATH_MAX + 1] = {'\0'};
@@ -459,114 +628,186 @@ int main(int argc, char **argv) {
 			torrent_init(&torrent, tinfo);
 		}
 
+		/// known before the data except the offsets of compressed frames
+		if ((img_opt.features & IMG_FEATURE_INDEX) && opt.blockfile == 0) {
+			build_image_index(&index, bitmap, &fs_info, &img_opt, &opt);
+			block_hashes = malloc((unsigned long long)buffer_capacity * IMAGE_DIGEST_SIZE);
+			if (block_hashes == NULL)
+				log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		}
+
 		block_id = 0;
-		do {
-			/// scan bitmap
-			unsigned long long i, blocks_skip, blocks_read;
-			unsigned int cs_added = 0, write_offset = 0;
-			off_t offset;
+		/// the loop state can only be found back in a plain image written to a file
+		if (opt.checkpoint) {
+			struct stat st;
+
+			if ((img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE)) || fstat(dfw, &st) == -1 ||
+			    !S_ISREG(st.st_mode))
+				log_mesg(0, 1, 1, debug, "--checkpoint needs an uncompressed image written to a file\n");
+
+			checkpoint_start(&ckpt, dfw);
+			ckpt.state.block_size = block_size;
+			ckpt.state.totalblock = blocks_total;
+			ckpt.state.usedblocks = fs_info.usedblocks;
+			ckpt.state.image_size = fs_info.device_size;
+			ckpt.state.checksum_mode = img_opt.checksum_mode;
+			ckpt.state.checksum_size = cs_size;
+			ckpt.state.clone = 1;
+			ckpt.state.bitmap_crc = checkpoint_bitmap_crc(bitmap, blocks_total);
+
+			if (opt.resume) {
+				checkpoint_state saved;
+
+				checkpoint_resume(&ckpt, &saved, (unsigned long long)st.st_size, checksum, &digest, &opt);
+
+				/// the blocks written after the checkpoint are written again
+				if (ftruncate(dfw, (off_t)saved.image_offset) == -1 ||
+				    lseek(dfw, (off_t)saved.image_offset, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "image truncate ERROR:%s\n", strerror(errno));
+
+				block_id = saved.block_id;
+				read_next = block_id;
+				copied = saved.copied;
+				blocks_in_cs = saved.blocks_in_cs;
+				memcpy(checksum, saved.checksum, cs_size);
+				log_mesg(0, 0, 1, debug, "Resume from block %llu, %llu blocks were cloned\n", block_id, copied);
+			}
+		}
 
-			/// skip unused blocks
-			for (blocks_skip = 0;
-			     block_id + blocks_skip < blocks_total &&
-			     !pc_test_bit(block_id + blocks_skip, bitmap, fs_info.totalblock);
-			     blocks_skip++);
-			if (block_id + blocks_skip == blocks_total)
-				break;
+		if (img_opt.features & IMG_FEATURE_CHUNKSTORE) {
+			clone_chunk_store(dfr, dfw, bitmap, &fs_info, &img_opt);
+		} else if (pipelined) {
+			clone_pipeline(dfr, dfw, bitmap, &fs_info, &img_opt,
+				(img_opt.features & IMG_FEATURE_INDEX) ? &index : NULL);
+		} else {
+			if (opt.threads)
+				log_mesg(1, 0, 0, debug, "pipeline disabled for block files, without checksum reseed or with --checkpoint\n");
 
-			if (blocks_skip)
-				block_id += blocks_skip;
+			/// nothing to interleave, let the kernel move the data. The loop below goes on from block_id.
+			if (img_opt.checksum_mode == CSM_NONE && opt.blockfile == 0 && !opt.io_depth && !opt.direct_io && !opt.checkpoint &&
+			    block_hashes == NULL)
+				clone_zero_copy(dfr, dfw, bitmap, &fs_info, buffer_capacity);
 
-			/// read blocks
-			for (blocks_read = 0;
-			     block_id + blocks_read < blocks_total && blocks_read < buffer_capacity &&
-			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock);
-			     ++blocks_read);
-			if (!blocks_read)
-				break;
+			do {
+				/// scan bitmap
+				unsigned long long i, blocks_read;
+				unsigned int cs_added = 0, write_offset = 0, n_iov = 0, run = 0;
+				char *read_ptr = read_buffer;
+				off_t offset;
+
+				if (opt.checkpoint)
+					checkpoint_tick(&ckpt, block_id, copied, blocks_in_cs, checksum, &digest, &opt);
+
+				if (opt.io_depth) {
+					io_request *req;
+
+					/// keep the queue full, the extents still come back in order
+					read_ahead(&io, read_buffer, buffer_capacity, bitmap, &fs_info, &read_next);
+					req = io_engine_wait(&io);
+					if (req == NULL)
+						break;
+
+					block_id = req->block;
+					blocks_read = req->blocks;
+					read_ptr = req->buf;
+					offset = (off_t)req->offset;
+					r_size = req->result;
+					errno = req->error;
+				} else {
+					/// skip unused blocks and read the next used ones
+					blocks_read = pc_next_extent(bitmap, &block_id, buffer_capacity, blocks_total);
+					if (!blocks_read)
+						break;
 
-			offset = (off_t)(block_id * block_size);
-			if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
-				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+					offset = (off_t)(block_id * block_size);
+					if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
+						log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
 
-			r_size = read_all(&dfr, read_buffer, blocks_read * block_size, &opt);
-			if (r_size != (int)(blocks_read * block_size)) {
-				if ((r_size == -1) && (errno == EIO)) {
-					if (opt.rescue) {
-						memset(read_buffer, 0, blocks_read * block_size);
-						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, offset + r_size, read_buffer + r_size, &opt);
-					} else
-						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
-				} else
-					log_mesg(0, 1, 1, debug, "read error: %s\n", strerror(errno));
-			}
+					r_size = read_all(&dfr, read_ptr, blocks_read * block_size, &opt);
+				}
+				check_source_read(&dfr, read_ptr, blocks_read * block_size, offset, r_size);
+				if (r_size == -1)
+					r_size = blocks_read * block_size;
+
+				log_mesg(2, 0, 0, debug, "blocks_read = %i\n", blocks_read);
 
-			log_mesg(2, 0, 0, debug, "blocks_read = %i\n", blocks_read);
+				if (block_hashes) {
+					image_digest_blocks(read_ptr, blocks_read, block_size, block_hashes);
+					image_digest_update(&digest, block_hashes, blocks_read * IMAGE_DIGEST_SIZE);
+				}
 
-			/// calculate checksum
-			if (opt.blockfile == 0) {
-				for (i = 0; i < blocks_read; ++i) {
+				/// calculate checksum, the blocks stay in read_ptr and the checksums go between them
+				if (opt.blockfile == 0) {
+					for (i = 0; i < blocks_read; ++i) {
 
-					memcpy(write_buffer + write_offset,
-						read_buffer + i * block_size, block_size);
+						write_offset += block_size;
+						++run;
 
-					write_offset += block_size;
+						update_checksum(checksum, read_ptr + i * block_size, block_size);
 
-					update_checksum(checksum, read_buffer + i * block_size, block_size);
+						if (blocks_per_cs > 0 && ++blocks_in_cs == blocks_per_cs) {
+						    log_mesg(3, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
 
-					if (blocks_per_cs > 0 && ++blocks_in_cs == blocks_per_cs) {
-					    log_mesg(3, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
+							iov[n_iov].iov_base = read_ptr + (i + 1 - run) * block_size;
+							iov[n_iov++].iov_len = run * block_size;
+							run = 0;
 
-						memcpy(write_buffer + write_offset, checksum, cs_size);
+							memcpy(cs_buffer + cs_added * cs_size, checksum, cs_size);
+							iov[n_iov].iov_base = cs_buffer + cs_added * cs_size;
+							iov[n_iov++].iov_len = cs_size;
 
-						++cs_added;
-						write_offset += cs_size;
+							++cs_added;
+							write_offset += cs_size;
 
-						blocks_in_cs = 0;
-						if (cs_reseed)
-							init_checksum(img_opt.checksum_mode, checksum, debug);
+							blocks_in_cs = 0;
+							if (cs_reseed)
+								init_checksum(img_opt.checksum_mode, checksum, debug);
+						}
+					}
+					if (run) {
+						iov[n_iov].iov_base = read_ptr + (blocks_read - run) * block_size;
+						iov[n_iov++].iov_len = run * block_size;
 					}
 				}
-			}
 
-			/// write buffer to target
-			if (opt.blockfile == 1) {
-				// SHA1 for torrent info
-				// Not always bigger or smaller than 16MB
+				/// write buffer to target
+				if (opt.blockfile == 1) {
+					// SHA1 for torrent info
+					// Not always bigger or smaller than 16MB
 
-				// first we write out block_id * block_size for filename
-				// because when calling write_block_file
-				// we will create a new file to describe a continuous block (or buffer is full)
-				// and never write to same file again
-				torrent_start_offset(&torrent, block_id * block_size);
-				torrent_end_length(&torrent, blocks_read * block_size);
+					// first we write out block_id * block_size for filename
+					// because when calling write_block_file
+					// we will create a new file to describe a continuous block (or buffer is full)
+					// and never write to same file again
+					torrent_start_offset(&torrent, block_id * block_size);
+					torrent_end_length(&torrent, blocks_read * block_size);
 
-				torrent_update(&torrent, read_buffer, blocks_read * block_size);
+					torrent_update(&torrent, read_ptr, blocks_read * block_size);
 
-				if (opt.torrent_only == 1) {
-					w_size = blocks_read * block_size;
+					if (opt.torrent_only == 1) {
+						w_size = blocks_read * block_size;
+					} else {
+						w_size = write_block_file(target, read_ptr, blocks_read * block_size, block_id * block_size, &opt);
+					}
 				} else {
-					w_size = write_block_file(target, read_buffer, blocks_read * block_size, block_id * block_size, &opt);
+					w_size = writev_all(&dfw, iov, n_iov, &opt);
+					if (w_size != write_offset)
+						log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
 				}
-			} else {
-				w_size = write_all(&dfw, write_buffer, write_offset, &opt);
-				if (w_size != write_offset)
-					log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
-			}
 
-			/// count copied block
-			copied += blocks_read;
-			log_mesg(2, 0, 0, debug, "copied = %lld\n", copied);
+				/// count copied block
+				copied += blocks_read;
+				log_mesg(2, 0, 0, debug, "copied = %lld\n", copied);
 
-			/// next block
-			block_id += blocks_read;
+				/// next block
+				block_id += blocks_read;
 
-			/// read or write error
-			if (r_size + cs_added * cs_size != w_size)
-				log_mesg(0, 1, 1, debug, "read(%i) and write(%i) different\n", r_size, w_size);
+				/// read or write error
+				if (r_size + cs_added * cs_size != w_size)
+					log_mesg(0, 1, 1, debug, "read(%i) and write(%i) different\n", r_size, w_size);
 
-		} while (1);
+			} while (1);
+		}
 
 		if (opt.blockfile == 1) {
 			torrent_final(&torrent);
@@ -580,15 +821,26 @@ int main(int argc, char **argv) {
 				if (w_size != cs_size)
 					log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
 			}
+
+			if (img_opt.features & IMG_FEATURE_INDEX) {
+				clone_image_stats(&index, &clone_start);
+				log_mesg(1, 0, 0, debug, "Write the image index\n");
+				write_image_index(&dfw, &index, &fs_info, &img_opt, &opt);
+				free_image_index(&index);
+			}
 		}
 
-		free(write_buffer);
+		if (opt.io_depth && !pipelined)
+			io_engine_exit(&io);
+		free(iov);
+		free(block_hashes);
+		free(cs_buffer);
 		free(read_buffer);
 
 	// check only the size when the image does not contains checksums and does not
 	// comes from a pipe
-	} else if (opt.chkimg && img_opt.checksum_mode == CSM_NONE
-		&& strcmp(opt.source, "-") != 0) {
+	} else if (opt.chkimg && img_opt.checksum_mode == CSM_NONE && fs_info.usedblocks
+		&& strcmp(opt.source, "-") != 0 && !(img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE))) {
 
 		unsigned long long total_offset = (fs_info.usedblocks - 1) * fs_info.block_size;
 		char last_block[fs_info.block_size];
@@ -608,17 +860,62 @@ int main(int argc, char **argv) {
 		if (read_all(&dfr, last_block, fs_info.block_size, &opt) != fs_info.block_size)
 			log_mesg(0, 1, 1, debug, "ERROR: source image too short\n");
 
+#ifdef CHKIMG
+	// every checksum covers its own chunk, check a seekable image on all CPUs
+	} else if (!opt.ignore_crc && img_opt.checksum_mode != CSM_NONE && cs_reseed
+		&& img_opt.blocks_per_checksum && lseek(dfr, 0, SEEK_CUR) != (off_t)-1) {
+
+		verify_parallel(dfr, bitmap, &fs_info, &img_opt);
+#else
+	// the image offset of every chunk is known, restore a seekable image in ranges at once
+	} else if (opt.parallel && !(img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE))
+		&& (img_opt.checksum_mode == CSM_NONE || cs_reseed || opt.ignore_crc) && lseek(dfr, 0, SEEK_CUR) != (off_t)-1) {
+
+		discard_t dc;
+
+		if (!opt.sparse && !(img_opt.features & IMG_FEATURE_DELTA))
+			preallocate_target(dfw, target, bitmap, fs_info.totalblock, fs_info.block_size);
+		if (opt.discard && !(img_opt.features & IMG_FEATURE_DELTA))
+			discard_start(&dc, &dfw, &target, 1, bitmap, fs_info.totalblock, fs_info.block_size, opt.offset, &opt);
+
+		restore_parallel(dfr, dfw, target, bitmap, &fs_info, &img_opt);
+
+		if (opt.discard && !(img_opt.features & IMG_FEATURE_DELTA) && discard_finish(&dc))
+			log_mesg(0, 1, 1, debug, "discard failed on %s\n", target);
+
+		/// restore_raw_file option
+		if (opt.restore_raw_file && !pc_test_bit(fs_info.totalblock - 1, bitmap, fs_info.totalblock)) {
+		    if (ftruncate(dfw, (off_t)fs_info.device_size) == -1)
+			log_mesg(0, 0, 1, debug, "ftruncate ERROR:%s\n", strerror(errno));
+		}
+#endif
+
 	} else if (opt.restore) {
+#ifndef CHKIMG
+		if (opt.parallel)
+			log_mesg(0, 0, 1, debug, "--parallel needs an uncompressed image read from a file, with a checksum\n"
+				"for every chunk or --ignore_crc, restore sequentially\n");
+#endif
 
 		const unsigned long long blocks_total = fs_info.totalblock;
 		const unsigned int block_size = fs_info.block_size;
 		const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1; // in blocks
 		const unsigned int blocks_per_cs = img_opt.blocks_per_checksum;
 		unsigned long long blocks_used = fs_info.usedblocks;
-		unsigned int blocks_in_cs, buffer_size, read_offset;
+		unsigned int blocks_in_cs;
 		unsigned char checksum[cs_size];
-		char *read_buffer, *write_buffer;
-		unsigned long long blocks_used_fix = 0, test_block = 0;
+		char *cs_buffer, *write_buffer;
+		struct iovec *iov;
+		unsigned long long blocks_used_fix = 0;
+#ifndef CHKIMG
+		zero_target zt;		/// used with IMG_FEATURE_ZEROMAP only
+		fanout_t fo;		/// used with write_behind only
+		int write_behind;
+		discard_t dc;		/// used with --discard only
+		int discarding = 0;
+		checkpoint_journal ckpt;	/// used with --checkpoint only
+		restore_targets rt;		/// flushed before a checkpoint
+#endif
 
 		// SHA1 for torrent info
 		int tinfo = -1;
@@ -627,36 +924,86 @@ int main(int argc, char **argv) {
 		log_mesg(1, 0, 0, debug, "#\nBuffer capacity = %u, Blocks per cs = %u\n#\n", buffer_capacity, blocks_per_cs);
 
 		// fix some super block record incorrect
-		for (test_block = 0; test_block < blocks_total; ++test_block)
-			if (pc_test_bit(test_block, bitmap, fs_info.totalblock))
-				blocks_used_fix++;
+		blocks_used_fix = pc_count_bits(bitmap, blocks_total);
 
 		if (blocks_used_fix != blocks_used) {
 			blocks_used = blocks_used_fix;
 			log_mesg(1, 0, 0, debug, "info: fixed used blocks count\n");
 		}
-		buffer_size = cnv_blocks_to_bytes(0, buffer_capacity, block_size, &img_opt);
-
-		if (img_opt.image_version != 0x0001)
-			read_buffer = (char*)malloc(buffer_size);
-		else {
-			// Allocate more memory in case the image is affected by the 64 bits bug
-			read_buffer = (char*)malloc(buffer_size + buffer_capacity * cs_size);
-		}
-		//write_buffer = (char*)malloc(buffer_capacity * block_size);
-		#define BSIZE 512
-		posix_memalign((void**)&write_buffer, BSIZE, buffer_capacity * block_size);
-		if (read_buffer == NULL || write_buffer == NULL) {
+		/**
+		 * The image is read with readv(): the blocks go straight to write_buffer,
+		 * aligned for --direct-io, and the checksums between them to cs_buffer.
+		 * write_buffer is then a slot of the fan-out ring, read and checked once
+		 * then written by one thread per target while the next one is read. It
+		 * is used for a single target too, but for the block files and the zero
+		 * blocks of a zero map which are written in place.
+		 */
+#ifndef CHKIMG
+		write_behind = target_count > 1 || (opt.blockfile == 0 && !opt.convert &&
+			!(img_opt.features & IMG_FEATURE_ZEROMAP) && lseek(dfw, 0, SEEK_CUR) != (off_t)-1);
+		if (write_behind) {
+			if (target_count > 1)
+				log_mesg(0, 0, 1, debug, "Restoring to %u targets at once\n", target_count);
+			fanout_init(&fo, dfws, targets, target_count, (unsigned long long)buffer_capacity * block_size, buffer_capacity, &opt);
+			write_buffer = fanout_buffer(&fo);
+		} else
+#endif
+		write_buffer = alloc_io_buffer((unsigned long long)buffer_capacity * block_size);
+		cs_buffer = (char*)malloc((buffer_capacity + 1) * cs_size + 1);
+		iov = (struct iovec*)malloc((2 * buffer_capacity + 1) * sizeof(struct iovec));
+		if (cs_buffer == NULL || write_buffer == NULL || iov == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
 		}
 
 #ifndef CHKIMG
 		/// seek to the first
-		if (opt.blockfile == 0) {
+		if (opt.blockfile == 0 && !opt.convert) {
 		    if (lseek(dfw, opt.offset, SEEK_SET) == (off_t)-1){
 			log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 		    }
 		}
+		/// a file target gets its used extents in one piece each, the others are holes
+		if (!opt.sparse && !opt.convert && opt.blockfile == 0 && !(img_opt.features & IMG_FEATURE_DELTA)) {
+			for (t = 0; t < target_count; t++)
+				preallocate_target(dfws[t], targets[t], bitmap, blocks_total, block_size);
+		}
+
+		/// convert writes the zero blocks to the new image like the others
+		if ((img_opt.features & IMG_FEATURE_ZEROMAP) && !opt.convert)
+			zero_target_init(&zt, dfw, (unsigned long long)buffer_capacity * block_size);
+
+		/// the unused blocks of a delta image are the ones of its base
+		if (opt.discard && (img_opt.features & IMG_FEATURE_DELTA)) {
+			log_mesg(0, 0, 1, debug, "--discard is ignored for a delta image\n");
+		} else if (opt.discard) {
+			discard_start(&dc, dfws, targets, target_count, bitmap, blocks_total, block_size, opt.offset, &opt);
+			discarding = 1;
+		}
+
+		/// the loop state can only be found back in a plain image read from a file
+		if (opt.checkpoint) {
+			struct stat st;
+
+			if ((img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE)) || fstat(dfr, &st) == -1 ||
+			    lseek(dfr, 0, SEEK_CUR) == (off_t)-1)
+				log_mesg(0, 1, 1, debug, "--checkpoint needs an uncompressed image read from a file\n");
+
+			checkpoint_start(&ckpt, dfr);
+			ckpt.state.block_size = block_size;
+			ckpt.state.totalblock = blocks_total;
+			ckpt.state.usedblocks = blocks_used;
+			ckpt.state.image_size = st.st_size;
+			ckpt.state.checksum_mode = img_opt.checksum_mode;
+			ckpt.state.checksum_size = cs_size;
+			ckpt.state.bitmap_crc = checkpoint_bitmap_crc(bitmap, blocks_total);
+
+			rt.fo = write_behind ? &fo : NULL;
+			rt.dfws = dfws;
+			rt.targets = targets;
+			rt.count = target_count;
+			ckpt.sync = restore_checkpoint_sync;
+			ckpt.sync_arg = &rt;
+		}
 #endif
 
 		/// start restore image file to partition
@@ -676,10 +1023,28 @@ int main(int argc, char **argv) {
 		}
 
 		block_id = 0;
+#ifndef CHKIMG
+		if (opt.resume) {
+			checkpoint_state saved;
+
+			checkpoint_resume(&ckpt, &saved, ckpt.state.image_size, checksum, NULL, &opt);
+			if (lseek(dfr, (off_t)saved.image_offset, SEEK_SET) == (off_t)-1)
+				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+			if (!write_behind && lseek(dfw, opt.offset + (off_t)(saved.block_id * block_size), SEEK_SET) == (off_t)-1)
+				log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
+
+			block_id = saved.block_id;
+			copied = saved.copied;
+			blocks_in_cs = saved.blocks_in_cs;
+			memcpy(checksum, saved.checksum, cs_size);
+			log_mesg(0, 0, 1, debug, "Resume from block %llu, %llu blocks were restored\n", block_id, copied);
+		}
+#endif
 		do {
-			unsigned int i;
+			unsigned int i, n_iov = 0, run = 0, cs_read = 0, cs_index = 0, chunk;
 			unsigned long long blocks_written, bytes_skip;
 			unsigned int read_size;
+			int partial = 0;
 			// max chunk to read using one read(2) syscall
 			unsigned int blocks_read = copied + buffer_capacity < blocks_used ?
 				buffer_capacity : blocks_used - copied;
@@ -687,6 +1052,12 @@ int main(int argc, char **argv) {
 			    break;
 			if (blocks_read < 0)
 			    log_mesg(0, 1, 1, debug, "blocks_read ERROR: impossible size of blocks_read\n");
+#ifndef CHKIMG
+			if (opt.checkpoint)
+				checkpoint_tick(&ckpt, block_id, copied, blocks_in_cs, checksum, NULL, &opt);
+			if (write_behind)
+				write_buffer = fanout_buffer(&fo);
+#endif
 
 			log_mesg(1, 0, 0, debug, "blocks_read = %d and copied = %lld\n", blocks_read, copied);
 			read_size = cnv_blocks_to_bytes(copied, blocks_read, block_size, &img_opt);
@@ -697,62 +1068,71 @@ int main(int argc, char **argv) {
 				/// it is the last read and there is a partial chunk at the end
 				log_mesg(1, 0, 0, debug, "# PARTIAL CHUNK\n");
 				read_size += cs_size;
+				partial = 1;
+			}
+
+			// the image is the follows:
+			// <blocks_per_cs><cs1><blocks_per_cs><cs2>...
+
+			// write buffer should be the following:
+			// <block1><block2>...
+			// and the checksums go to cs_buffer
+			for (i = 0, chunk = blocks_in_cs; i < blocks_read; ++i) {
+				++run;
+				if (blocks_per_cs && ++chunk == blocks_per_cs) {
+					iov[n_iov].iov_base = write_buffer + (i + 1 - run) * block_size;
+					iov[n_iov++].iov_len = run * block_size;
+					iov[n_iov].iov_base = cs_buffer + cs_read++ * cs_size;
+					iov[n_iov++].iov_len = cs_size;
+					run = 0;
+					chunk = 0;
+				}
+			}
+			if (run) {
+				iov[n_iov].iov_base = write_buffer + (blocks_read - run) * block_size;
+				iov[n_iov++].iov_len = run * block_size;
+			}
+			if (partial) {
+				iov[n_iov].iov_base = cs_buffer + cs_read++ * cs_size;
+				iov[n_iov++].iov_len = cs_size;
 			}
 
 			// read chunk from image
 			log_mesg(1, 0, 0, debug, "read more: ");
 
-			r_size = read_all(&dfr, read_buffer, read_size, &opt);
+			r_size = readv_all(&dfr, iov, n_iov, &opt);
 			if (r_size != read_size)
 				log_mesg(0, 1, 1, debug, "read ERROR:%s\n", strerror(errno));
 
-			// read buffer is the follows:
-			// <blocks_per_cs><cs1><blocks_per_cs><cs2>...
-
-			// write buffer should be the following:
-			// <block1><block2>...
-
-			read_offset = 0;
 			for (i = 0; i < blocks_read; ++i) {
 
-				memcpy(write_buffer + i * block_size,
-					read_buffer + read_offset, block_size);
-
 				if (opt.ignore_crc) {
-					read_offset += block_size;
 					if (++blocks_in_cs == blocks_per_cs)
-						read_offset += cs_size;
+						blocks_in_cs = 0;
 					continue;
 				}
 
-				update_checksum(checksum, read_buffer + read_offset, block_size);
+				update_checksum(checksum, write_buffer + i * block_size, block_size);
 
 				if (++blocks_in_cs == blocks_per_cs) {
 
-				    unsigned char checksum_orig[cs_size];
-				    memcpy(checksum_orig, read_buffer + read_offset + block_size, cs_size);
+				    unsigned char *checksum_orig = (unsigned char *)cs_buffer + cs_index++ * cs_size;
 				    log_mesg(3, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
 				    log_mesg(3, 0, 0, debug, "CRC.orig = %x%x%x%x \n", checksum_orig[0], checksum_orig[1], checksum_orig[2], checksum_orig[3]);
-					if (memcmp(read_buffer + read_offset + block_size, checksum, cs_size)) {
+					if (memcmp(checksum_orig, checksum, cs_size)) {
 					    log_mesg(0, 1, 1, debug, "CRC error, block_id=%llu...\n ", block_id + i);
 					}
 
-					read_offset += cs_size;
-
 					blocks_in_cs = 0;
 					if (cs_reseed)
 						init_checksum(img_opt.checksum_mode, checksum, debug);
 				}
-
-				read_offset += block_size;
 			}
-			if (blocks_in_cs && blocks_per_cs && blocks_read < buffer_capacity &&
-					(blocks_read % blocks_per_cs)) {
+			if (!opt.ignore_crc && partial && blocks_in_cs) {
 
 			    log_mesg(1, 0, 0, debug, "check latest chunk's checksum covering %u blocks\n", blocks_in_cs);
-			    if (memcmp(read_buffer + read_offset, checksum, cs_size)){
-				unsigned char checksum_orig[cs_size];
-				memcpy(checksum_orig, read_buffer + read_offset, cs_size);
+			    if (memcmp(cs_buffer + cs_index * cs_size, checksum, cs_size)){
+				unsigned char *checksum_orig = (unsigned char *)cs_buffer + cs_index * cs_size;
 				log_mesg(1, 0, 0, debug, "CRC = %x%x%x%x \n", checksum[0], checksum[1], checksum[2], checksum[3]);
 				log_mesg(1, 0, 0, debug, "CRC.orig = %x%x%x%x \n", checksum_orig[0], checksum_orig[1], checksum_orig[2], checksum_orig[3]);
 				log_mesg(0, 1, 1, debug, "CRC error, block_id=%llu...\n ", block_id + i);
@@ -766,26 +1146,23 @@ int main(int argc, char **argv) {
 				unsigned int blocks_write = 0;
 
 				/// count bytes to skip
-				for (bytes_skip = 0;
-				     block_id < blocks_total &&
-				     !pc_test_bit(block_id, bitmap, fs_info.totalblock);
-				     block_id++, bytes_skip += block_size);
+				bytes_skip = block_id;
+				block_id = pc_find_next_set(bitmap, block_id, blocks_total);
+				bytes_skip = (block_id - bytes_skip) * block_size;
 
 #ifndef CHKIMG
 				/// skip empty blocks
 				if (blocks_write == 0) {
-				    if (opt.blockfile == 0 && bytes_skip > 0 && lseek(dfw, (off_t)bytes_skip, SEEK_CUR) == (off_t)-1) {
+				    if (opt.blockfile == 0 && !write_behind && !opt.convert && bytes_skip > 0 && lseek(dfw, (off_t)bytes_skip, SEEK_CUR) == (off_t)-1) {
 					log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 				    }
 				}
 #endif
 
 				/// blocks to write
-				for (blocks_write = 0;
-				     block_id + blocks_write < blocks_total &&
-				     blocks_written + blocks_write < blocks_read &&
-				     pc_test_bit(block_id + blocks_write, bitmap, fs_info.totalblock);
-				     blocks_write++);
+				blocks_write = pc_find_next_zero(bitmap, block_id,
+					blocks_total - block_id > blocks_read - blocks_written ?
+					block_id + blocks_read - blocks_written : blocks_total) - block_id;
 
 #ifndef CHKIMG
 				// write blocks
@@ -809,6 +1186,14 @@ int main(int argc, char **argv) {
 					    	w_size = write_block_file(target, write_buffer + blocks_written * block_size,
 							blocks_write * block_size, (block_id*block_size), &opt);
 					    }
+					}else if (write_behind){
+					    /// the zero blocks are in the buffer, written like the others
+					    fanout_add(&fo, opt.offset + (off_t)block_id * block_size, write_buffer + blocks_written * block_size,
+						    (unsigned long long)blocks_write * block_size);
+					    w_size = blocks_write * block_size;
+					}else if ((img_opt.features & IMG_FEATURE_ZEROMAP) && !opt.convert){
+					    w_size = write_blocks_zero_map(&dfw, write_buffer + blocks_written * block_size,
+						    blocks_write, block_size, &decomp, copied, &zt);
 					}else{
 					    w_size = write_all(&dfw, write_buffer + blocks_written * block_size,
 						    blocks_write * block_size, &opt);
@@ -827,6 +1212,15 @@ int main(int argc, char **argv) {
 				copied += blocks_write;
 			} while (blocks_written < blocks_read);
 
+#ifndef CHKIMG
+			if (write_behind) {
+				fanout_submit(&fo);
+				if (fanout_failed(&fo) == target_count) {
+					log_mesg(0, 1, 1, debug, "write ERROR on %s\n", target_count > 1 ? "all the targets" : target);
+					break;
+				}
+			}
+#endif
 		} while(1);
 
 		// finish SHA1 for torrent info
@@ -834,12 +1228,56 @@ int main(int argc, char **argv) {
 			torrent_final(&torrent);
 		}
 
+#ifndef CHKIMG
+		if (discarding) {
+			unsigned int failed = discard_finish(&dc);
+
+			if (failed)
+				log_mesg(0, 1, 1, debug, "discard failed on %u of %u targets\n", failed, target_count);
+		}
+
+		/// the writers truncate a raw file and sync their target, then a slot is free for the index
+		if (write_behind) {
+			off_t size = opt.restore_raw_file && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock) ?
+				(off_t)fs_info.device_size : 0;
+			unsigned int failed = fanout_finish(&fo, size);
+
+			if (failed)
+				log_mesg(0, 1, 1, debug, "restore failed on %u of %u targets\n", failed, target_count);
+			write_buffer = fanout_buffer(&fo);
+		}
+#endif
+
+		/// the index follows the data, read it from a pipe so that the writer can finish
+		if ((img_opt.features & IMG_FEATURE_INDEX) && lseek(dfr, 0, SEEK_CUR) == (off_t)-1) {
+			ssize_t r;
+
+			while ((r = read(dfr, write_buffer, (size_t)buffer_capacity * block_size)) > 0 || (r < 0 && errno == EINTR))
+				;
+		}
+
+#ifndef CHKIMG
+		if (write_behind)
+			fanout_free(&fo);
+		else
+#endif
 		free(write_buffer);
-		free(read_buffer);
+		free(cs_buffer);
+		free(iov);
+#ifndef CHKIMG
+		if ((img_opt.features & IMG_FEATURE_ZEROMAP) && !opt.convert)
+			free(zt.zeros);
+#endif
+
+		if (img_opt.features & (IMG_FEATURES_FRAMED | IMG_FEATURE_CHUNKSTORE))
+			dfr = decompress_stop(&decomp, dfr);
+#ifdef CONVERT
+		dfw = convert_stop(&convert, dfw, &clone_start);
+#endif
 
 #ifndef CHKIMG
 		/// restore_raw_file option
-		if (opt.restore_raw_file && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock)) {
+		if (opt.restore_raw_file && !write_behind && !pc_test_bit(blocks_total - 1, bitmap, fs_info.totalblock)) {
 		    if (ftruncate(dfw, (off_t)fs_info.device_size) == -1){
 			log_mesg(0, 0, 1, debug, "ftruncate ERROR:%s\n", strerror(errno));
 		    }
@@ -853,8 +1291,15 @@ int main(int argc, char **argv) {
 		int block_size = fs_info.block_size;
 		unsigned long long blocks_total = fs_info.totalblock;
 		int buffer_capacity = block_size < opt.buffer_size ? opt.buffer_size / block_size : 1;
+		io_engine io;
+		unsigned long long read_next = 0;	/// next block to queue on io
 
-		buffer = (char*)malloc(buffer_capacity * block_size);
+		io.depth = 1;
+		if (opt.io_depth)
+			io_engine_init(&io, dfr, io_depth_limit(buffer_capacity * block_size));
+
+		/// one buffer per request in flight
+		buffer = alloc_io_buffer((unsigned long long)buffer_capacity * block_size * io.depth);
 		if (buffer == NULL) {
 			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
 		}
@@ -870,43 +1315,45 @@ int main(int argc, char **argv) {
 		log_mesg(1, 0, 0, debug, "start backup data device-to-device...\n");
 		do {
 			/// scan bitmap
-			unsigned long long blocks_skip, blocks_read;
+			unsigned long long blocks_read;
+			char *read_ptr = buffer;
 			off_t offset;
 
-			/// skip unused blocks
-			for (blocks_skip = 0;
-			     block_id + blocks_skip < blocks_total &&
-			     !pc_test_bit(block_id + blocks_skip, bitmap, fs_info.totalblock);
-			     blocks_skip++);
-
-			if (block_id + blocks_skip == blocks_total)
-				break;
+			if (opt.io_depth) {
+				io_request *req;
 
-			if (blocks_skip)
-				block_id += blocks_skip;
+				read_ahead(&io, buffer, buffer_capacity, bitmap, &fs_info, &read_next);
+				req = io_engine_wait(&io);
+				if (req == NULL)
+					break;
 
-			/// read chunk from source
-			for (blocks_read = 0;
-			     block_id + blocks_read < blocks_total && blocks_read < buffer_capacity &&
-			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock);
-			     ++blocks_read);
+				block_id = req->block;
+				blocks_read = req->blocks;
+				read_ptr = req->buf;
+				offset = (off_t)req->offset;
+				r_size = req->result;
+				errno = req->error;
+			} else {
+				/// skip unused blocks and read the next chunk from source
+				blocks_read = pc_next_extent(bitmap, &block_id, buffer_capacity, blocks_total);
+				if (!blocks_read)
+					break;
 
-			if (!blocks_read)
-				break;
+				offset = (off_t)(block_id * block_size);
+				if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
+					log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
 
-			offset = (off_t)(block_id * block_size);
-			if (lseek(dfr, offset, SEEK_SET) == (off_t)-1)
-				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+				r_size = read_all(&dfr, read_ptr, blocks_read * block_size, &opt);
+			}
 			if (lseek(dfw, offset + opt.offset, SEEK_SET) == (off_t)-1)
 				log_mesg(0, 1, 1, debug, "target seek ERROR:%s\n", strerror(errno));
 
-			r_size = read_all(&dfr, buffer, blocks_read * block_size, &opt);
 			if (r_size != (int)(blocks_read * block_size)) {
 				if ((r_size == -1) && (errno == EIO)) {
 					if (opt.rescue) {
-						memset(buffer, 0, blocks_read * block_size);
+						memset(read_ptr, 0, blocks_read * block_size);
 						for (r_size = 0; r_size < blocks_read * block_size; r_size += PART_SECTOR_SIZE)
-							rescue_sector(&dfr, offset + r_size, buffer + r_size, &opt);
+							rescue_sector(&dfr, offset + r_size, read_ptr + r_size, &opt);
 					} else
 						log_mesg(0, 1, 1, debug, "%s", bad_sectors_warning_msg);
 				} else
@@ -914,7 +1361,7 @@ int main(int argc, char **argv) {
 			}
 
 			/// write buffer to target
-			w_size = write_all(&dfw, buffer, blocks_read * block_size, &opt);
+			w_size = write_all(&dfw, read_ptr, blocks_read * block_size, &opt);
 			if (w_size != (int)(blocks_read * block_size)) {
 				if (opt.skip_write_error)
 					log_mesg(0, 0, 1, debug, "skip write block %lli error:%s\n", block_id, strerror(errno));
@@ -937,6 +1384,8 @@ int main(int argc, char **argv) {
 			}
 		} while (1);
 
+		if (opt.io_depth)
+			io_engine_exit(&io);
 		free(buffer);
 
 		/// restore_raw_file option
@@ -949,7 +1398,7 @@ int main(int argc, char **argv) {
 
 	} else if (opt.domain) {
 
-		int cmp, nx_current = 0;
+		int cmp;
 		unsigned long long next_block_id = 0;
 		log_mesg(0, 0, 0, debug, "Total block %i\n", fs_info.totalblock);
 		log_mesg(1, 0, 0, debug, "start writing domain log...\n");
@@ -960,23 +1409,18 @@ int main(int argc, char **argv) {
 		dprintf(dfw, "# current_pos  current_status\n");
 		dprintf(dfw, "0x%08llX     ?\n", opt.offset_domain + (fs_info.totalblock * fs_info.block_size));
 		dprintf(dfw, "#      pos        size  status\n");
-		// start logging the used/unused areas
-		cmp = pc_test_bit(0, bitmap, fs_info.totalblock);
-		for (block_id = 0; block_id <= fs_info.totalblock; block_id++) {
-			if (block_id < fs_info.totalblock) {
-				nx_current = pc_test_bit(block_id, bitmap, fs_info.totalblock);
-				if (nx_current)
-					copied++;
+		// start logging the used/unused areas, one line per run
+		for (block_id = 0; block_id < fs_info.totalblock; block_id = next_block_id) {
+			cmp = pc_test_bit(block_id, bitmap, fs_info.totalblock);
+			if (cmp) {
+				next_block_id = pc_find_next_zero(bitmap, block_id, fs_info.totalblock);
+				copied += next_block_id - block_id;
 			} else
-				nx_current = -1;
-			if (nx_current != cmp) {
-				dprintf(dfw, "0x%08llX  0x%08llX  %c\n",
-					opt.offset_domain + (next_block_id * fs_info.block_size),
-					(block_id - next_block_id) * fs_info.block_size,
-					cmp ? '+' : '?');
-				next_block_id = block_id;
-				cmp = nx_current;
-			}
+				next_block_id = pc_find_next_set(bitmap, block_id, fs_info.totalblock);
+			dprintf(dfw, "0x%08llX  0x%08llX  %c\n",
+				opt.offset_domain + (block_id * fs_info.block_size),
+				(next_block_id - block_id) * fs_info.block_size,
+				cmp ? '+' : '?');
 			// don't bother updating progress
 		} /// end of for
 	} else if (opt.ddd) {
@@ -1014,10 +1458,8 @@ int main(int argc, char **argv) {
 			unsigned long long blocks_read;
 
 			/// read chunk from source
-			for (blocks_read = 0;
-			     block_id + blocks_read < blocks_total && blocks_read < blocks_in_buffer &&
-			     pc_test_bit(block_id + blocks_read, bitmap, fs_info.totalblock);
-			     blocks_read++);
+			blocks_read = pc_find_next_zero(bitmap, block_id,
+				blocks_total - block_id > blocks_in_buffer ? block_id + blocks_in_buffer : blocks_total) - block_id;
 
 			if (!blocks_read)
 				break;
@@ -1130,14 +1572,23 @@ int main(int argc, char **argv) {
 	update_pui(&prog, copied, block_id, done);
 #ifndef CHKIMG
 	sync_data(dfw, &opt);
+	/// the image or the restore is on the disk, there is nothing to resume
+	if (opt.checkpoint && unlink(opt.checkpoint) == -1 && errno != ENOENT)
+		log_mesg(0, 0, 1, debug, "checkpoint %s: unlink ERROR:%s\n", opt.checkpoint, strerror(errno));
 #endif
 	print_finish_info(opt);
 
 	/// close source
-	close(dfr);
+	split_close(dfr);
 	/// close target
 	if (dfw != -1)
 		close_target(dfw);
+#ifndef CHKIMG
+	for (t = 1; t < target_count; t++)
+		close_target(dfws[t]);
+	if (dfws != &dfw)
+		free(dfws);
+#endif
 	/// free bitmp
 	free(bitmap);
 	close_pui(pui);
@@ -1163,3 +1614,2001 @@ void *thread_update_pui(void *arg) {
 	}
 	pthread_exit("exit");
 }
+
+/// image options of a clone from the command line, before the file system is known
+static void clone_image_options(image_options *img_opt) {
+
+	if (opt.image_version == 3)
+		set_image_options_v3(img_opt);
+	if (opt.compress_mode != CMP_NONE) {
+		img_opt->features |= IMG_FEATURE_COMPRESS;
+		img_opt->compress_mode = opt.compress_mode;
+		img_opt->compress_level = opt.compress_level;
+	}
+	if (opt.skip_zero)
+		img_opt->features |= IMG_FEATURE_ZEROMAP;
+	if (opt.chunk_store && opt.clone)
+		img_opt->features = IMG_FEATURE_CHUNKSTORE;
+	if (opt.base_count)
+		img_opt->features |= IMG_FEATURE_DELTA;
+	log_mesg(1, 0, 0, opt.debug, "Initiate image options - version %04d\n", img_opt->image_version);
+
+	img_opt->checksum_mode = opt.checksum_mode;
+	img_opt->checksum_size = get_checksum_size(opt.checksum_mode, opt.debug);
+	img_opt->blocks_per_checksum = opt.blocks_per_checksum;
+	img_opt->reseed_checksum = opt.reseed_checksum;
+
+	/// the chunk ids replace the checksums
+	if (img_opt->features & IMG_FEATURE_CHUNKSTORE) {
+		img_opt->checksum_mode = CSM_NONE;
+		img_opt->checksum_size = 0;
+		img_opt->blocks_per_checksum = 0;
+	}
+}
+
+/// the rest of the image options, they depend on the block size
+static void clone_image_layout(image_options *img_opt, const file_system_info *fs_info) {
+
+	int debug = opt.debug;
+
+	if (img_opt->checksum_mode != CSM_NONE && img_opt->blocks_per_checksum == 0) {
+
+		const unsigned int buffer_capacity = opt.buffer_size > fs_info->block_size
+			? opt.buffer_size / fs_info->block_size : 1; // in blocks
+
+		img_opt->blocks_per_checksum = buffer_capacity;
+
+	}
+	log_mesg(1, 0, 0, debug, "%u blocks per checksum\n", img_opt->blocks_per_checksum);
+
+	if (img_opt->features & IMG_FEATURE_CHUNKSTORE) {
+		img_opt->chunk_blocks = CHUNK_STORE_SIZE > fs_info->block_size ? CHUNK_STORE_SIZE / fs_info->block_size : 1;
+		log_mesg(1, 0, 0, debug, "%u blocks per chunk\n", img_opt->chunk_blocks);
+	}
+
+	/// a frame is one item of the clone pipeline
+	if (img_opt->features & IMG_FEATURES_FRAMED) {
+		img_opt->blocks_per_frame = pipeline_item_blocks(fs_info->block_size, img_opt->blocks_per_checksum);
+		if (get_frame_raw_size(0, img_opt->blocks_per_frame, fs_info, img_opt) > FRAME_SIZE_MASK)
+			log_mesg(0, 1, 1, debug, "Frames of %u blocks are too large, lower the buffer size or the blocks per checksum\n",
+				img_opt->blocks_per_frame);
+		log_mesg(1, 0, 0, debug, "%u blocks per frame\n", img_opt->blocks_per_frame);
+	}
+}
+
+/// the statistics of the footer known at the end only, the index has the others
+static void clone_image_stats(image_index *index, const struct timespec *start) {
+
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	index->stats.clone_time = (end.tv_sec - start->tv_sec) * 1000ULL
+		+ end.tv_nsec / 1000000 - start->tv_nsec / 1000000;
+	index->stats.digest_size = IMAGE_DIGEST_SIZE;
+	image_digest_final(&digest, index->stats.digest);
+}
+
+/**
+ * Pipelined clone: one thread reads the used blocks, opt.threads workers
+ * interleave the checksums and the calling thread writes the image.
+ *
+ * An item always holds a whole number of checksum chunks, except the last
+ * one, so each worker can start from a fresh seed and the image is the same
+ * as the one written by the single threaded loop.
+ */
+typedef struct {
+	int dfr;
+	unsigned long *bitmap;
+	unsigned long long blocks_total;
+	unsigned int block_size;
+	unsigned int cs_size;
+	unsigned int blocks_per_cs;
+	unsigned int item_blocks;	/// capacity of one item, in blocks
+	int checksum_mode;
+	unsigned long long next_block;	/// where the reader continues
+	io_engine *io;			/// reads in flight, NULL for blocking reads
+	unsigned int io_blocks;		/// largest read queued on io, a share of an item
+	int dfw;
+	int compress_mode;		/// CMP_NONE or the frames are compressed
+	int skip_zero;			/// leave the all-zero blocks out, see IMG_FEATURE_ZEROMAP
+	unsigned int frame_head_size;	/// items are written as frames when not 0
+	image_index *index;		/// offsets of the frames, NULL without index
+} clone_ctx;
+
+typedef struct {
+	char *read_buffer;
+	char *cs_buffer;		/// checksums of the item
+	struct iovec *iov;		/// what to write, blocks and checksums in image order
+	unsigned int n_iov;
+	unsigned int blocks;		/// used blocks in read_buffer
+	unsigned int out_size;		/// bytes to write
+	unsigned long long end_block;	/// block_id after the last block read
+	unsigned long long seq;		/// item number, the frame number when compressed
+	char *frame_buffer;		/// blocks and checksums in one piece, for the compressor
+	char *comp_buffer;		/// frame header and compressed data
+	char *frame_head;		/// frame header and zero map
+	unsigned int cs_count;		/// checksums in cs_buffer
+	unsigned char *block_hashes;	/// for the digest of the index, NULL without index
+	compress_ctx cmp;
+} clone_item;
+
+static int clone_produce(void *arg, void *data, unsigned long long seq) {
+
+	clone_ctx *ctx = (clone_ctx *)arg;
+	clone_item *item = (clone_item *)data;
+	unsigned long long block = ctx->next_block;
+	io_request *req;
+	int debug = opt.debug;
+
+	item->blocks = 0;
+
+	while (item->blocks < ctx->item_blocks) {
+		unsigned long long blocks_read, max = ctx->item_blocks - item->blocks;
+		char *buffer;
+		off_t offset;
+		int size, r_size;
+
+		/// a contiguous item is cut in requests too, to keep the queue full
+		if (ctx->io && max > ctx->io_blocks)
+			max = ctx->io_blocks;
+
+		/// skip unused blocks and read the used ones
+		blocks_read = pc_next_extent(ctx->bitmap, &block, max, ctx->blocks_total);
+		if (!blocks_read)
+			break;
+
+		offset = (off_t)(block * ctx->block_size);
+		buffer = item->read_buffer + (unsigned long long)item->blocks * ctx->block_size;
+		size = blocks_read * ctx->block_size;
+
+		if (ctx->io) {
+			/// the extents of an item are read concurrently
+			if (io_engine_pending(ctx->io) == ctx->io->depth) {
+				req = io_engine_wait(ctx->io);
+				errno = req->error;
+				check_source_read(&ctx->dfr, req->buf, req->size, req->offset, req->result);
+			}
+			io_engine_submit(ctx->io, buffer, size, offset);
+		} else {
+			/// convert reads the used blocks one after the other from a pipe
+			if (!opt.convert && lseek(ctx->dfr, offset, SEEK_SET) == (off_t)-1)
+				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+
+			r_size = read_all(&ctx->dfr, buffer, size, &opt);
+			check_source_read(&ctx->dfr, buffer, size, offset, r_size);
+		}
+
+		item->blocks += blocks_read;
+		block += blocks_read;
+	}
+
+	/// the item is filled only when all its reads are done
+	while (ctx->io && (req = io_engine_wait(ctx->io)) != NULL) {
+		errno = req->error;
+		check_source_read(&ctx->dfr, req->buf, req->size, req->offset, req->result);
+	}
+
+	ctx->next_block = block;
+	item->end_block = block;
+	item->seq = seq;
+
+	log_mesg(2, 0, 0, debug, "pipeline item %llu: %u blocks\n", seq, item->blocks);
+
+	return item->blocks > 0;
+}
+
+/// true when the block only holds zeros, the inner loop is left to the vectorizer
+static int is_zero_block(const char *block, unsigned int size) {
+
+	const unsigned long *word = (const unsigned long *)block;
+	const unsigned int words = size / sizeof(unsigned long);
+	unsigned long acc = 0;
+	unsigned int i, j;
+
+	for (i = 0; i + 32 <= words; i += 32) {
+		for (j = 0; j < 32; j++)
+			acc |= word[i + j];
+		if (acc)
+			return 0;
+	}
+	for (; i < words; i++)
+		acc |= word[i];
+	for (i = words * sizeof(unsigned long); i < size; i++)
+		acc |= (unsigned char)block[i];
+
+	return acc == 0;
+}
+
+/// drop the all-zero blocks from the item, their bits are set in the zero map of the frame
+static void clone_skip_zero(clone_ctx *ctx, clone_item *item) {
+
+	unsigned char *zero_map = (unsigned char *)item->frame_head + FRAME_HEAD_SIZE;
+	struct iovec *iov = item->iov;
+	unsigned int i, n_iov = 0, blocks_in_cs = 0, cs_added = 0, zeros = 0;
+	char *run_end = NULL;		/// end of the last iov when it holds blocks
+
+	memset(zero_map, 0, ctx->frame_head_size - FRAME_HEAD_SIZE);
+
+	for (i = 0; i < item->blocks; ++i) {
+		char *block = item->read_buffer + (unsigned long long)i * ctx->block_size;
+
+		if (is_zero_block(block, ctx->block_size)) {
+			zero_map[i / 8] |= 1 << (i % 8);
+			zeros++;
+		} else if (run_end == block) {
+			iov[n_iov - 1].iov_len += ctx->block_size;
+			run_end += ctx->block_size;
+		} else {
+			iov[n_iov].iov_base = block;
+			iov[n_iov++].iov_len = ctx->block_size;
+			run_end = block + ctx->block_size;
+		}
+
+		/// the checksums computed by clone_work() stay in place
+		if (ctx->cs_size && (++blocks_in_cs == ctx->blocks_per_cs || i + 1 == item->blocks)) {
+			iov[n_iov].iov_base = item->cs_buffer + cs_added++ * ctx->cs_size;
+			iov[n_iov++].iov_len = ctx->cs_size;
+			run_end = NULL;
+			blocks_in_cs = 0;
+		}
+	}
+
+	item->n_iov = n_iov;
+	item->out_size -= zeros * ctx->block_size;
+}
+
+/// replace the item by a frame: compressed when it shrinks, else stored after FRAME_STORED
+static void clone_frame(clone_ctx *ctx, clone_item *item) {
+
+	size_t size = item->out_size, comp_size = 0;
+	uint32_t head;
+	unsigned int i;
+
+	if (ctx->compress_mode != CMP_NONE && size) {
+		char *raw = item->iov[0].iov_base;
+
+		/// the checksums are interleaved, gather the frame
+		if (item->n_iov > 1) {
+			raw = item->frame_buffer;
+			for (i = 0, size = 0; i < item->n_iov; i++) {
+				memcpy(raw + size, item->iov[i].iov_base, item->iov[i].iov_len);
+				size += item->iov[i].iov_len;
+			}
+			item->iov[0].iov_base = raw;
+			item->iov[0].iov_len = size;
+			item->n_iov = 1;
+		}
+
+		comp_size = compress_frame(&item->cmp, raw, size, item->comp_buffer + ctx->frame_head_size,
+			compress_bound(ctx->compress_mode, size));
+	}
+
+	if (comp_size) {
+		head = comp_size;
+		memcpy(item->frame_head, &head, FRAME_HEAD_SIZE);
+		memcpy(item->comp_buffer, item->frame_head, ctx->frame_head_size);
+		item->iov[0].iov_base = item->comp_buffer;
+		item->iov[0].iov_len = ctx->frame_head_size + comp_size;
+		item->n_iov = 1;
+		item->out_size = item->iov[0].iov_len;
+	} else {
+		/// the header goes in front of the blocks and checksums
+		head = size | FRAME_STORED;
+		memcpy(item->frame_head, &head, FRAME_HEAD_SIZE);
+		memmove(item->iov + 1, item->iov, item->n_iov * sizeof(struct iovec));
+		item->iov[0].iov_base = item->frame_head;
+		item->iov[0].iov_len = ctx->frame_head_size;
+		item->n_iov++;
+		item->out_size = ctx->frame_head_size + size;
+	}
+}
+
+static void clone_work(void *arg, void *data) {
+
+	clone_ctx *ctx = (clone_ctx *)arg;
+	clone_item *item = (clone_item *)data;
+	unsigned char checksum[ctx->cs_size];
+	unsigned int i, blocks_in_cs = 0, write_offset = 0, cs_added = 0;
+	struct iovec *iov = item->iov;
+
+	item->n_iov = 0;
+	item->out_size = item->blocks * ctx->block_size;
+	item->cs_count = 0;
+
+	/// before the zero blocks are left out, the digest covers them
+	if (item->block_hashes)
+		image_digest_blocks(item->read_buffer, item->blocks, ctx->block_size, item->block_hashes);
+
+	if (ctx->cs_size == 0) {
+		iov[0].iov_base = item->read_buffer;
+		iov[0].iov_len = item->out_size;
+		item->n_iov = 1;
+		if (ctx->skip_zero)
+			clone_skip_zero(ctx, item);
+		if (ctx->frame_head_size)
+			clone_frame(ctx, item);
+		return;
+	}
+
+	init_checksum(ctx->checksum_mode, checksum, opt.debug);
+
+	/// the blocks stay in read_buffer, each chunk is followed by its checksum
+	for (i = 0; i < item->blocks; ++i) {
+		char *block = item->read_buffer + (unsigned long long)i * ctx->block_size;
+
+		update_checksum(checksum, block, ctx->block_size);
+
+		if (++blocks_in_cs == ctx->blocks_per_cs || i + 1 == item->blocks) {
+			/// only the last item can end with a partial chunk
+			char *cs = item->cs_buffer + cs_added++ * ctx->cs_size;
+
+			iov[item->n_iov].iov_base = block - (unsigned long long)(blocks_in_cs - 1) * ctx->block_size;
+			iov[item->n_iov++].iov_len = (unsigned long long)blocks_in_cs * ctx->block_size;
+			memcpy(cs, checksum, ctx->cs_size);
+			iov[item->n_iov].iov_base = cs;
+			iov[item->n_iov++].iov_len = ctx->cs_size;
+			write_offset += ctx->cs_size;
+
+			blocks_in_cs = 0;
+			init_checksum(ctx->checksum_mode, checksum, opt.debug);
+		}
+	}
+
+	item->cs_count = cs_added;
+	item->out_size += write_offset;
+	if (ctx->skip_zero)
+		clone_skip_zero(ctx, item);
+	if (ctx->frame_head_size)
+		clone_frame(ctx, item);
+}
+
+static void clone_consume(void *arg, void *data) {
+
+	clone_ctx *ctx = (clone_ctx *)arg;
+	clone_item *item = (clone_item *)data;
+	int w_size;
+
+	w_size = writev_all(&ctx->dfw, item->iov, item->n_iov, &opt);
+	if (w_size != (int)item->out_size)
+		log_mesg(0, 1, 1, opt.debug, "image write ERROR:%s\n", strerror(errno));
+	if (item->block_hashes)
+		image_digest_update(&digest, item->block_hashes, (unsigned long long)item->blocks * IMAGE_DIGEST_SIZE);
+
+	/// frames are written in order, the index learns where they start
+	if (ctx->frame_head_size && ctx->index) {
+		ctx->index->offset[item->seq] = ctx->index->data_offset + ctx->index->data_size;
+		ctx->index->data_size += item->out_size;
+	}
+
+	/// with convert the restore loop feeding the pipeline counts the progress
+	if (opt.convert)
+		return;
+	copied += item->blocks;
+	block_id = item->end_block;
+	log_mesg(2, 0, 0, opt.debug, "copied = %lld\n", copied);
+}
+
+/// blocks in one item, a whole number of checksum chunks
+static unsigned int pipeline_item_blocks(unsigned int block_size, unsigned int blocks_per_cs) {
+
+	const unsigned int buffer_capacity = opt.buffer_size > block_size ? opt.buffer_size / block_size : 1; // in blocks
+
+	if (blocks_per_cs == 0)
+		return buffer_capacity;
+	else if (blocks_per_cs >= buffer_capacity)
+		return blocks_per_cs;
+	else
+		return buffer_capacity - buffer_capacity % blocks_per_cs;
+}
+
+static void clone_pipeline(int dfr, int dfw, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt, image_index *index) {
+
+	const unsigned int block_size = fs_info->block_size;
+	const unsigned int blocks_per_cs = img_opt->blocks_per_checksum;
+	unsigned long long cs_count, slot_size, frame_size = 0;
+	unsigned int iov_count;
+	clone_ctx ctx;
+	clone_item *items;
+	io_engine io;
+	pipeline_t pl;
+	unsigned int i;
+	int debug = opt.debug;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.dfr = dfr;
+	ctx.dfw = dfw;
+	ctx.bitmap = bitmap;
+	ctx.blocks_total = fs_info->totalblock;
+	ctx.block_size = block_size;
+	ctx.cs_size = img_opt->checksum_size;
+	ctx.blocks_per_cs = blocks_per_cs;
+	ctx.checksum_mode = img_opt->checksum_mode;
+	ctx.next_block = 0;
+	ctx.index = index;
+	ctx.compress_mode = (img_opt->features & IMG_FEATURE_COMPRESS) ? img_opt->compress_mode : CMP_NONE;
+	ctx.skip_zero = (img_opt->features & IMG_FEATURE_ZEROMAP) != 0;
+	if (img_opt->features & IMG_FEATURES_FRAMED)
+		ctx.frame_head_size = get_frame_head_size(img_opt);
+
+	/// keep items aligned on checksum chunks, an item is a frame when framed
+	ctx.item_blocks = pipeline_item_blocks(block_size, blocks_per_cs);
+
+	cs_count = blocks_per_cs ? ctx.item_blocks / blocks_per_cs + 1 : 1;
+	/// blocks and checksums alternate, one more for the frame header
+	iov_count = 2 * cs_count + 1;
+	if (ctx.skip_zero)
+		iov_count += ctx.item_blocks;
+	slot_size = (unsigned long long)ctx.item_blocks * block_size + cs_count * ctx.cs_size + iov_count * sizeof(struct iovec);
+	if (index)
+		slot_size += (unsigned long long)ctx.item_blocks * IMAGE_DIGEST_SIZE;
+	if (ctx.compress_mode != CMP_NONE) {
+		frame_size = (unsigned long long)ctx.item_blocks * block_size + cs_count * ctx.cs_size;
+		slot_size += frame_size + ctx.frame_head_size + compress_bound(ctx.compress_mode, frame_size);
+	}
+
+	memset(&pl, 0, sizeof(pl));
+	pl.ctx = &ctx;
+	pl.workers = opt.threads;
+	/// compression is the slow part, use every CPU unless told otherwise, convert does nothing else
+	if ((ctx.compress_mode != CMP_NONE || opt.convert) && pl.workers == 0)
+		pl.workers = pipeline_cpu_count();
+	pl.slots = pipeline_slot_count(opt.mem_limit, slot_size, pl.workers);
+	pl.produce = clone_produce;
+	pl.work = clone_work;
+	pl.consume = clone_consume;
+
+	log_mesg(1, 0, 0, debug, "pipeline: %u blocks per item, %llu bytes per slot\n", ctx.item_blocks, slot_size);
+
+	items = calloc(pl.slots, sizeof(clone_item));
+	pl.items = calloc(pl.slots, sizeof(void *));
+	if (items == NULL || pl.items == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (i = 0; i < pl.slots; i++) {
+		items[i].read_buffer = alloc_io_buffer((unsigned long long)ctx.item_blocks * block_size);
+		items[i].cs_buffer = malloc(cs_count * ctx.cs_size + 1);
+		items[i].iov = malloc(iov_count * sizeof(struct iovec));
+		if (index) {
+			items[i].block_hashes = malloc((unsigned long long)ctx.item_blocks * IMAGE_DIGEST_SIZE);
+			if (items[i].block_hashes == NULL)
+				log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		}
+		if (ctx.frame_head_size) {
+			items[i].frame_head = malloc(ctx.frame_head_size);
+			if (items[i].frame_head == NULL)
+				log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		}
+		if (ctx.compress_mode != CMP_NONE) {
+			items[i].frame_buffer = malloc(frame_size);
+			items[i].comp_buffer = malloc(ctx.frame_head_size + compress_bound(ctx.compress_mode, frame_size));
+			init_compress(&items[i].cmp, ctx.compress_mode, img_opt->compress_level);
+			if (items[i].frame_buffer == NULL || items[i].comp_buffer == NULL)
+				log_mesg(0, 1, 1, debug, "There is not enough free memory for %u pipeline slots, try a lower --mem-limit\n", pl.slots);
+		}
+		if (items[i].read_buffer == NULL || items[i].cs_buffer == NULL || items[i].iov == NULL)
+			log_mesg(0, 1, 1, debug, "There is not enough free memory for %u pipeline slots, try a lower --mem-limit\n", pl.slots);
+		pl.items[i] = &items[i];
+	}
+
+	/// the reader thread is the only user of the engine, the requests read into the items
+	if (opt.io_depth) {
+		io_engine_init(&io, dfr, io_depth_limit(0));
+		ctx.io = &io;
+		ctx.io_blocks = ctx.item_blocks / io.depth ? ctx.item_blocks / io.depth : 1;
+	}
+
+	pipeline_run(&pl);
+
+	if (ctx.io)
+		io_engine_exit(ctx.io);
+
+	for (i = 0; i < pl.slots; i++) {
+		free(items[i].read_buffer);
+		free(items[i].cs_buffer);
+		free(items[i].iov);
+		free(items[i].block_hashes);
+		free(items[i].frame_head);
+		if (ctx.compress_mode != CMP_NONE) {
+			free(items[i].frame_buffer);
+			free(items[i].comp_buffer);
+			free_compress(&items[i].cmp);
+		}
+	}
+	free(pl.items);
+	free(items);
+}
+
+/**
+ * Clone to a chunk store: the device is cut in ranges of chunk_blocks blocks
+ * and the used blocks of a range are one chunk. The reader reads the chunks,
+ * the workers hash them and add the new ones to the store, and the calling
+ * thread writes their ids to the image, in device order.
+ */
+typedef struct {
+	int dfr;
+	int dfw;
+	unsigned long *bitmap;
+	unsigned long long blocks_total;
+	unsigned int block_size;
+	unsigned int chunk_blocks;
+	unsigned int item_chunks;	/// capacity of one item, in chunks
+	unsigned long long next_block;	/// first block of the next range
+	chunk_store *store;
+	unsigned long long chunks;	/// statistics for the end of the clone
+	unsigned long long new_chunks;
+	unsigned long long new_bytes;
+} chunk_clone_ctx;
+
+/// chunks read or written together, for clone and restore
+typedef struct {
+	char *buffer;			/// the used blocks of the chunks, one after the other
+	unsigned int count;		/// chunks in the item
+	unsigned int *blocks;		/// used blocks of each chunk
+	unsigned char *ids;		/// CHUNK_ID_SIZE bytes per chunk
+	unsigned int new_chunks;	/// added to the store by the clone
+	unsigned long long new_bytes;
+	unsigned long long end_block;	/// block_id after the last range
+} chunk_item;
+
+/// number of used blocks in [start, end)
+static unsigned int chunk_used_blocks(unsigned long *bitmap, unsigned long long start, unsigned long long end) {
+
+	unsigned long long block = start, n;
+	unsigned int used = 0;
+
+	while ((n = pc_next_extent(bitmap, &block, end - block, end)) > 0) {
+		used += n;
+		block += n;
+	}
+
+	return used;
+}
+
+static int chunk_clone_produce(void *arg, void *data, unsigned long long seq) {
+
+	chunk_clone_ctx *ctx = (chunk_clone_ctx *)arg;
+	chunk_item *item = (chunk_item *)data;
+	char *buffer = item->buffer;
+	int debug = opt.debug;
+
+	item->count = 0;
+
+	while (item->count < ctx->item_chunks && ctx->next_block < ctx->blocks_total) {
+		unsigned long long block = ctx->next_block, n;
+		unsigned long long end = ctx->blocks_total - block > ctx->chunk_blocks ? block + ctx->chunk_blocks : ctx->blocks_total;
+		unsigned int used = 0;
+
+		/// read the used extents of the range
+		while ((n = pc_next_extent(ctx->bitmap, &block, end - block, end)) > 0) {
+			off_t offset = (off_t)(block * ctx->block_size);
+			int size = n * ctx->block_size, r_size;
+
+			if (lseek(ctx->dfr, offset, SEEK_SET) == (off_t)-1)
+				log_mesg(0, 1, 1, debug, "source seek ERROR:%s\n", strerror(errno));
+			r_size = read_all(&ctx->dfr, buffer, size, &opt);
+			check_source_read(&ctx->dfr, buffer, size, offset, r_size);
+
+			buffer += size;
+			used += n;
+			block += n;
+		}
+
+		ctx->next_block = end;
+		if (used)
+			item->blocks[item->count++] = used;
+	}
+
+	item->end_block = ctx->next_block;
+
+	return item->count > 0;
+}
+
+static void chunk_clone_work(void *arg, void *data) {
+
+	chunk_clone_ctx *ctx = (chunk_clone_ctx *)arg;
+	chunk_item *item = (chunk_item *)data;
+	char *buffer = item->buffer;
+	unsigned int i;
+	int r;
+
+	item->new_chunks = 0;
+	item->new_bytes = 0;
+
+	for (i = 0; i < item->count; i++) {
+		unsigned long long size = (unsigned long long)item->blocks[i] * ctx->block_size;
+		unsigned char *id = item->ids + i * CHUNK_ID_SIZE;
+
+		chunk_id(buffer, size, id);
+		r = chunk_store_put(ctx->store, id, buffer, size);
+		if (r < 0)
+			log_mesg(0, 1, 1, opt.debug, "chunk store: unable to add a chunk to %s: %s\n", ctx->store->dir, strerror(errno));
+		if (r > 0) {
+			item->new_chunks++;
+			item->new_bytes += size;
+		}
+		buffer += size;
+	}
+}
+
+static void chunk_clone_consume(void *arg, void *data) {
+
+	chunk_clone_ctx *ctx = (chunk_clone_ctx *)arg;
+	chunk_item *item = (chunk_item *)data;
+	int size = item->count * CHUNK_ID_SIZE;
+	unsigned int i;
+
+	if (write_all(&ctx->dfw, (char *)item->ids, size, &opt) != size)
+		log_mesg(0, 1, 1, opt.debug, "image write ERROR:%s\n", strerror(errno));
+
+	ctx->chunks += item->count;
+	ctx->new_chunks += item->new_chunks;
+	ctx->new_bytes += item->new_bytes;
+	for (i = 0; i < item->count; i++)
+		copied += item->blocks[i];
+	block_id = item->end_block;
+	log_mesg(2, 0, 0, opt.debug, "copied = %lld\n", copied);
+}
+
+/// allocate the items of a chunk pipeline, a chunk is at most chunk_blocks blocks
+static chunk_item *chunk_items_alloc(pipeline_t *pl, unsigned int item_chunks, unsigned int chunk_blocks, unsigned int block_size) {
+
+	chunk_item *items;
+	unsigned int i;
+
+	items = calloc(pl->slots, sizeof(chunk_item));
+	pl->items = calloc(pl->slots, sizeof(void *));
+	if (items == NULL || pl->items == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (i = 0; i < pl->slots; i++) {
+		items[i].buffer = malloc((unsigned long long)item_chunks * chunk_blocks * block_size);
+		items[i].blocks = malloc(item_chunks * sizeof(unsigned int));
+		items[i].ids = malloc(item_chunks * CHUNK_ID_SIZE);
+		if (items[i].buffer == NULL || items[i].blocks == NULL || items[i].ids == NULL)
+			log_mesg(0, 1, 1, opt.debug, "There is not enough free memory for %u pipeline slots, try a lower --mem-limit\n", pl->slots);
+		pl->items[i] = &items[i];
+	}
+
+	return items;
+}
+
+static void chunk_items_free(pipeline_t *pl, chunk_item *items) {
+
+	unsigned int i;
+
+	for (i = 0; i < pl->slots; i++) {
+		free(items[i].buffer);
+		free(items[i].blocks);
+		free(items[i].ids);
+	}
+	free(pl->items);
+	free(items);
+}
+
+/// chunks of one pipeline item, about one buffer of data
+static unsigned int chunk_item_chunks(unsigned int chunk_blocks, unsigned int block_size) {
+
+	unsigned int capacity = pipeline_item_blocks(block_size, 0);
+
+	return capacity > chunk_blocks ? capacity / chunk_blocks : 1;
+}
+
+static void clone_chunk_store(int dfr, int dfw, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt) {
+
+	chunk_clone_ctx ctx;
+	chunk_store store;
+	chunk_item *items;
+	pipeline_t pl;
+	int debug = opt.debug;
+
+	chunk_store_open(&store, opt.chunk_store, 1, &opt);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.dfr = dfr;
+	ctx.dfw = dfw;
+	ctx.bitmap = bitmap;
+	ctx.blocks_total = fs_info->totalblock;
+	ctx.block_size = fs_info->block_size;
+	ctx.chunk_blocks = img_opt->chunk_blocks;
+	ctx.item_chunks = chunk_item_chunks(ctx.chunk_blocks, ctx.block_size);
+	ctx.store = &store;
+
+	/// hashing and writing the new chunks is the slow part
+	memset(&pl, 0, sizeof(pl));
+	pl.ctx = &ctx;
+	pl.workers = opt.threads ? opt.threads : pipeline_cpu_count();
+	pl.slots = pipeline_slot_count(opt.mem_limit, (unsigned long long)ctx.item_chunks * ctx.chunk_blocks * ctx.block_size, pl.workers);
+	pl.produce = chunk_clone_produce;
+	pl.work = chunk_clone_work;
+	pl.consume = chunk_clone_consume;
+
+	items = chunk_items_alloc(&pl, ctx.item_chunks, ctx.chunk_blocks, ctx.block_size);
+	pipeline_run(&pl);
+	chunk_items_free(&pl, items);
+
+	log_mesg(0, 0, 1, debug, "chunk store %s: %llu chunks, %llu new (%llu bytes)\n",
+		store.dir, ctx.chunks, ctx.new_chunks, ctx.new_bytes);
+	/// the image refers to the new chunks once its index is written
+	if (ctx.new_chunks && chunk_store_sync(&store) == -1)
+		log_mesg(0, 1, 1, debug, "chunk store %s: sync ERROR: %s\n", store.dir, strerror(errno));
+	chunk_store_close(&store);
+}
+
+/**
+ * The io engine needs a read buffer per request in flight, keep them within
+ * --mem-limit.
+ */
+static unsigned int io_depth_limit(unsigned long long read_size) {
+
+	unsigned long long depth = opt.io_depth;
+
+	if (read_size && depth * read_size > opt.mem_limit) {
+		depth = opt.mem_limit / read_size;
+		if (depth < 1)
+			depth = 1;
+		log_mesg(1, 0, 0, opt.debug, "io depth lowered to %llu by --mem-limit\n", depth);
+	}
+	if (depth > IO_ENGINE_MAX_DEPTH)
+		depth = IO_ENGINE_MAX_DEPTH;
+
+	return (unsigned int)depth;
+}
+
+/**
+ * Queue the next used extents of the bitmap on io until it is full. Extents
+ * are at most buffer_blocks long and request n reads into the n-th buffer
+ * of buffers, which the caller must not be using any more.
+ */
+static void read_ahead(io_engine *io, char *buffers, unsigned int buffer_blocks, unsigned long *bitmap, file_system_info *fs_info, unsigned long long *next) {
+
+	const unsigned long long blocks_total = fs_info->totalblock;
+	const unsigned int block_size = fs_info->block_size;
+	unsigned long long block = *next;
+
+	while (io_engine_pending(io) < io->depth) {
+		unsigned long long blocks_read;
+		char *buffer;
+		io_request *req;
+
+		blocks_read = pc_next_extent(bitmap, &block, buffer_blocks, blocks_total);
+		if (!blocks_read)
+			break;
+
+		buffer = buffers + (io->submitted % io->depth) * buffer_blocks * block_size;
+		req = io_engine_submit(io, buffer, blocks_read * block_size, block * block_size);
+		req->block = block;
+		req->blocks = blocks_read;
+
+		block += blocks_read;
+	}
+
+	*next = block;
+}
+
+/// handle a failed or short read of the source, rescue the sectors when asked to
+static void check_source_read(int *dfr, char *buffer, int size, off_t offset, int r_size) {
+
+	if (r_size == size)
+		return;
+
+	if ((r_size == -1) && (errno == EIO)) {
+		if (opt.rescue) {
+			memset(buffer, 0, size);
+			for (r_size = 0; r_size < size; r_size += PART_SECTOR_SIZE)
+				rescue_sector(dfr, offset + r_size, buffer + r_size, &opt);
+		} else
+			log_mesg(0, 1, 1, opt.debug, "%s", bad_sectors_warning_msg);
+	} else
+		log_mesg(0, 1, 1, opt.debug, "read error: %s\n", strerror(errno));
+}
+
+/**
+ * Clone without checksums: the used extents go from the device to the image
+ * with copy_file_range() or splice() and never pass through a user space
+ * buffer. splice() needs a pipe on one side, so a private pipe sits between
+ * the device and a regular image file.
+ *
+ * It stops at the first extent the kernel does not copy, read errors
+ * included, and leaves block_id on the first block not written. The caller
+ * goes on with the read/write loop from there, which also does --rescue.
+ */
+static void clone_zero_copy(int dfr, int dfw, unsigned long *bitmap, file_system_info *fs_info, unsigned int buffer_capacity) {
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SPLICE)
+	const unsigned long long blocks_total = fs_info->totalblock;
+	const unsigned int block_size = fs_info->block_size;
+	int debug = opt.debug;
+	int use_cfr = 0, use_splice = 0, out_pipe = 0;
+	int pipefd[2] = {-1, -1};
+	struct stat st;
+
+	if (fstat(dfw, &st) == -1)
+		return;
+	out_pipe = S_ISFIFO(st.st_mode);
+#ifdef HAVE_COPY_FILE_RANGE
+	use_cfr = !out_pipe;
+#endif
+#ifdef HAVE_SPLICE
+	use_splice = 1;
+	if (!out_pipe && pipe(pipefd) == -1)
+		use_splice = 0;
+#endif
+
+	log_mesg(1, 0, 0, debug, "zero-copy clone with %s\n", use_cfr ? "copy_file_range" : "splice");
+
+	while (use_cfr || use_splice) {
+		unsigned long long blocks_read, done = 0, size;
+		off_t offset;
+
+		blocks_read = pc_next_extent(bitmap, &block_id, buffer_capacity, blocks_total);
+		if (!blocks_read)
+			break;
+
+		offset = (off_t)(block_id * block_size);
+		size = blocks_read * block_size;
+
+		while (done < size) {
+			loff_t off_in = offset + done;
+			ssize_t n = -1, w = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+			if (use_cfr) {
+				n = copy_file_range(dfr, &off_in, dfw, NULL, size - done, 0);
+				if (n == -1 && done == 0 && errno != EIO) {
+					/// not between these files, e.g. from a block device
+					log_mesg(1, 0, 0, debug, "copy_file_range: %s, use splice\n", strerror(errno));
+					use_cfr = 0;
+					continue;
+				}
+			} else
+#endif
+#ifdef HAVE_SPLICE
+			if (out_pipe) {
+				n = splice(dfr, &off_in, dfw, NULL, size - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+			} else {
+				n = splice(dfr, &off_in, pipefd[1], NULL, size - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+				/// empty the pipe, whatever is in it belongs to the image
+				while (n > 0 && w < n) {
+					ssize_t k = splice(pipefd[0], NULL, dfw, NULL, n - w, SPLICE_F_MOVE | SPLICE_F_MORE);
+					if (k <= 0) {
+						char tail[PIPE_BUF];
+						int r = read_all(&pipefd[0], tail, (n - w) < PIPE_BUF ? (n - w) : PIPE_BUF, &opt);
+						if (r <= 0 || write_all(&dfw, tail, r, &opt) != r)
+							log_mesg(0, 1, 1, debug, "image write ERROR:%s\n", strerror(errno));
+						k = r;
+					}
+					w += k;
+				}
+			}
+#endif
+			if (n <= 0)
+				break;
+			done += n;
+		}
+
+		if (done < size) {
+			/// finish the block in progress, the loop restarts on a block boundary
+			unsigned long long part = done % block_size;
+
+			if (part) {
+				char block[block_size];
+
+				if (pread(dfr, block, block_size - part, offset + done) != (ssize_t)(block_size - part) ||
+				    write_all(&dfw, block, block_size - part, &opt) != (int)(block_size - part))
+					log_mesg(0, 1, 1, debug, "zero-copy clone: can not finish block %llu: %s\n",
+						block_id + done / block_size, strerror(errno));
+				done += block_size - part;
+			}
+			log_mesg(1, 0, 0, debug, "zero-copy clone stopped at block %llu: %s\n",
+				block_id + done / block_size, strerror(errno));
+			copied += done / block_size;
+			block_id += done / block_size;
+			break;
+		}
+
+		copied += blocks_read;
+		block_id += blocks_read;
+		log_mesg(2, 0, 0, debug, "copied = %lld\n", copied);
+	}
+
+	if (pipefd[0] != -1) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+#endif
+}
+
+/**
+ * Restore of a framed image: a thread reads the frames and writes their
+ * content, the same bytes as in a plain image, to a pipe which the restore
+ * loop reads in place of the image. Frames are independent, so the thread
+ * runs a pipeline: its reader reads the frames in sequence, the workers
+ * decompress them and the thread writes them to the pipe in order.
+ *
+ * The zero blocks of an IMG_FEATURE_ZEROMAP image are put back in the frame
+ * and recorded in reader->zero_map before the frame is written, so the
+ * restore loop knows them when it reads their data.
+ */
+typedef struct {
+	char *head_buffer;		/// frame header and zero map
+	char *comp_buffer;		/// compressed payload
+	char *raw_buffer;		/// the frame content
+	uint32_t head;
+	size_t payload_size;		/// raw size without the zero blocks
+	size_t raw_size;
+	unsigned int blocks;		/// used blocks in the frame
+	unsigned int zeros;		/// of which are left out
+	unsigned long long frame;
+	unsigned long long first;	/// first block of the frame
+	compress_ctx cmp;
+} decompress_item;
+
+static int decompress_produce(void *arg, void *data, unsigned long long seq) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	decompress_item *item = (decompress_item *)data;
+	const unsigned char *zero_map = (unsigned char *)item->head_buffer + FRAME_HEAD_SIZE;
+	uint32_t size;
+	unsigned int i;
+	char *payload;
+	int debug = opt.debug;
+
+	if (reader->next_block >= reader->used_blocks || reader->failed)
+		return 0;
+
+	item->frame = seq;
+	item->first = reader->next_block;
+	item->raw_size = get_frame_raw_size(item->first, reader->used_blocks, reader->fs_info, reader->img_opt);
+	item->blocks = reader->used_blocks - item->first < reader->img_opt->blocks_per_frame
+		? reader->used_blocks - item->first : reader->img_opt->blocks_per_frame;
+	reader->next_block += item->blocks;
+
+	if (read_all(&reader->dfr, item->head_buffer, reader->head_size, &opt) != reader->head_size)
+		log_mesg(0, 1, 1, debug, "ERROR: source image too short, frame %llu\n", seq);
+	memcpy(&item->head, item->head_buffer, FRAME_HEAD_SIZE);
+
+	item->zeros = 0;
+	if (reader->zero_map) {
+		for (i = 0; i < item->blocks; i++)
+			item->zeros += (zero_map[i / 8] >> (i % 8)) & 1;
+	}
+	item->payload_size = item->raw_size - (size_t)item->zeros * reader->fs_info->block_size;
+
+	size = item->head & FRAME_SIZE_MASK;
+	if ((item->head & FRAME_STORED) ? size != item->payload_size : size > reader->max_size)
+		log_mesg(0, 1, 1, debug, "ERROR: bad frame %llu size [%u]\n", seq, size);
+
+	/// stored frames go straight to their place
+	payload = (item->head & FRAME_STORED) ? item->raw_buffer : item->comp_buffer;
+	if (read_all(&reader->dfr, payload, size, &opt) != size)
+		log_mesg(0, 1, 1, debug, "ERROR: source image too short, frame %llu\n", seq);
+
+	return 1;
+}
+
+/// put the zero blocks back, from the end of the frame so that nothing is overwritten before it moves
+static void decompress_expand(decompress_reader *reader, decompress_item *item) {
+
+	const unsigned int block_size = reader->fs_info->block_size;
+	const unsigned int cs_size = reader->img_opt->checksum_size;
+	const unsigned int blocks_per_cs = reader->img_opt->blocks_per_checksum;
+	const unsigned char *zero_map = (unsigned char *)item->head_buffer + FRAME_HEAD_SIZE;
+	char *src = item->raw_buffer + item->payload_size;
+	char *dst = item->raw_buffer + item->raw_size;
+	unsigned int i = item->blocks;
+
+	while (i-- > 0 && dst != src) {
+		/// frames start on a checksum chunk
+		if (blocks_per_cs && ((i + 1) % blocks_per_cs == 0 || i + 1 == item->blocks)) {
+			src -= cs_size;
+			dst -= cs_size;
+			memmove(dst, src, cs_size);
+		}
+
+		dst -= block_size;
+		if ((zero_map[i / 8] >> (i % 8)) & 1) {
+			memset(dst, 0, block_size);
+		} else {
+			src -= block_size;
+			memmove(dst, src, block_size);
+		}
+	}
+}
+
+static void decompress_work(void *arg, void *data) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	decompress_item *item = (decompress_item *)data;
+
+	if (!(item->head & FRAME_STORED) &&
+	    decompress_frame(&item->cmp, item->comp_buffer, item->head & FRAME_SIZE_MASK, item->raw_buffer, item->payload_size))
+		log_mesg(0, 1, 1, opt.debug, "ERROR: frame %llu is damaged, blocks %llu-%llu\n",
+			item->frame, item->first, item->first + item->blocks - 1);
+
+	if (item->zeros)
+		decompress_expand(reader, item);
+}
+
+static void decompress_consume(void *arg, void *data) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	decompress_item *item = (decompress_item *)data;
+	const unsigned char *zero_map = (unsigned char *)item->head_buffer + FRAME_HEAD_SIZE;
+	unsigned int i;
+
+	if (reader->failed)
+		return;
+
+	for (i = 0; item->zeros && i < item->blocks; i++) {
+		if ((zero_map[i / 8] >> (i % 8)) & 1)
+			pc_set_bit(item->first + i, reader->zero_map, reader->used_blocks);
+	}
+
+	if (write_all(&reader->pipe_w, item->raw_buffer, item->raw_size, &opt) != item->raw_size)
+		reader->failed = 1;
+}
+
+static void *decompress_thread(void *arg) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	const image_options *img_opt = reader->img_opt;
+	decompress_item *items;
+	pipeline_t pl;
+	unsigned int i;
+	int debug = opt.debug;
+	ssize_t r;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.ctx = reader;
+	pl.workers = opt.threads ? opt.threads : pipeline_cpu_count();
+	pl.slots = pipeline_slot_count(opt.mem_limit, reader->max_raw + reader->max_size, pl.workers);
+	pl.produce = decompress_produce;
+	pl.work = decompress_work;
+	pl.consume = decompress_consume;
+
+	items = calloc(pl.slots, sizeof(decompress_item));
+	pl.items = calloc(pl.slots, sizeof(void *));
+	if (items == NULL || pl.items == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (i = 0; i < pl.slots; i++) {
+		items[i].head_buffer = malloc(reader->head_size);
+		items[i].raw_buffer = malloc(reader->max_raw);
+		if (reader->max_size)
+			items[i].comp_buffer = malloc(reader->max_size);
+		if (items[i].head_buffer == NULL || items[i].raw_buffer == NULL || (reader->max_size && items[i].comp_buffer == NULL))
+			log_mesg(0, 1, 1, debug, "There is not enough free memory for %u pipeline slots, try a lower --mem-limit\n", pl.slots);
+		if (img_opt->features & IMG_FEATURE_COMPRESS)
+			init_compress(&items[i].cmp, img_opt->compress_mode, img_opt->compress_level);
+		pl.items[i] = &items[i];
+	}
+
+	pipeline_run(&pl);
+
+	/// the index follows the data, read it from a pipe so that the writer can finish
+	if (lseek(reader->dfr, 0, SEEK_CUR) == (off_t)-1) {
+		while ((r = read(reader->dfr, items[0].raw_buffer, reader->max_raw)) > 0 || (r < 0 && errno == EINTR))
+			;
+	}
+
+	close(reader->pipe_w);
+	for (i = 0; i < pl.slots; i++) {
+		free_compress(&items[i].cmp);
+		free(items[i].head_buffer);
+		free(items[i].comp_buffer);
+		free(items[i].raw_buffer);
+	}
+	free(pl.items);
+	free(items);
+	return NULL;
+}
+
+/**
+ * Restore of a chunk store image: the same thread and pipe, the reader reads
+ * the ids of the chunks, the workers read the chunks from the store and
+ * check them, and the thread writes their blocks to the pipe.
+ */
+static int chunk_restore_produce(void *arg, void *data, unsigned long long seq) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	chunk_item *item = (chunk_item *)data;
+	const unsigned long long total = reader->fs_info->totalblock;
+	const unsigned int chunk_blocks = reader->img_opt->chunk_blocks;
+	int size;
+
+	item->count = 0;
+
+	while (item->count < reader->item_chunks && reader->next_block < total) {
+		unsigned long long start = reader->next_block;
+		unsigned long long end = total - start > chunk_blocks ? start + chunk_blocks : total;
+		unsigned int used = chunk_used_blocks(reader->bitmap, start, end);
+
+		reader->next_block = end;
+		if (used)
+			item->blocks[item->count++] = used;
+	}
+
+	if (item->count == 0 || reader->failed)
+		return 0;
+
+	size = item->count * CHUNK_ID_SIZE;
+	if (read_all(&reader->dfr, (char *)item->ids, size, &opt) != size)
+		log_mesg(0, 1, 1, opt.debug, "ERROR: source image too short, chunk list %llu\n", seq);
+
+	return 1;
+}
+
+static void chunk_restore_work(void *arg, void *data) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	chunk_item *item = (chunk_item *)data;
+	const unsigned int block_size = reader->fs_info->block_size;
+	char *buffer = item->buffer;
+	unsigned int i;
+
+	for (i = 0; i < item->count; i++) {
+		unsigned long long size = (unsigned long long)item->blocks[i] * block_size;
+		const unsigned char *id = item->ids + i * CHUNK_ID_SIZE;
+
+		if (chunk_store_get(&reader->store, id, buffer, size)) {
+			char str[2 * CHUNK_ID_SIZE + 1];
+
+			chunk_id_str(id, str);
+			log_mesg(0, 1, 1, opt.debug, "ERROR: chunk %s is missing or damaged in %s\n", str, reader->store.dir);
+		}
+		buffer += size;
+	}
+}
+
+static void chunk_restore_consume(void *arg, void *data) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	chunk_item *item = (chunk_item *)data;
+	unsigned long long size = 0;
+	unsigned int i;
+
+	if (reader->failed)
+		return;
+
+	for (i = 0; i < item->count; i++)
+		size += (unsigned long long)item->blocks[i] * reader->fs_info->block_size;
+	if (write_all(&reader->pipe_w, item->buffer, size, &opt) != (int)size)
+		reader->failed = 1;
+}
+
+static void *chunk_restore_thread(void *arg) {
+
+	decompress_reader *reader = (decompress_reader *)arg;
+	const unsigned int block_size = reader->fs_info->block_size;
+	const unsigned int chunk_blocks = reader->img_opt->chunk_blocks;
+	chunk_item *items;
+	pipeline_t pl;
+
+	memset(&pl, 0, sizeof(pl));
+	pl.ctx = reader;
+	pl.workers = opt.threads ? opt.threads : pipeline_cpu_count();
+	pl.slots = pipeline_slot_count(opt.mem_limit, (unsigned long long)reader->item_chunks * chunk_blocks * block_size, pl.workers);
+	pl.produce = chunk_restore_produce;
+	pl.work = chunk_restore_work;
+	pl.consume = chunk_restore_consume;
+
+	items = chunk_items_alloc(&pl, reader->item_chunks, chunk_blocks, block_size);
+	pipeline_run(&pl);
+
+	close(reader->pipe_w);
+	chunk_items_free(&pl, items);
+	return NULL;
+}
+
+/// return the file descriptor to read the decompressed data from
+static int decompress_start(decompress_reader *reader, int dfr, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt) {
+
+	int pipefd[2];
+
+	memset(reader, 0, sizeof(decompress_reader));
+	reader->dfr = dfr;
+	reader->fs_info = fs_info;
+	reader->img_opt = img_opt;
+	reader->used_blocks = pc_count_bits(bitmap, fs_info->totalblock);
+	reader->head_size = get_frame_head_size(img_opt);
+	reader->max_raw = get_frame_raw_size(0, img_opt->blocks_per_frame, fs_info, img_opt);
+	if (img_opt->features & IMG_FEATURE_COMPRESS)
+		reader->max_size = compress_bound(img_opt->compress_mode, reader->max_raw);
+	if (img_opt->features & IMG_FEATURE_ZEROMAP) {
+		reader->zero_map = pc_alloc_bitmap(reader->used_blocks);
+		if (reader->zero_map == NULL)
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+	if (img_opt->features & IMG_FEATURE_CHUNKSTORE) {
+		if (opt.chunk_store == NULL)
+			log_mesg(0, 1, 1, opt.debug, "The image lists the chunks of a chunk store, give its directory with --chunk-store\n");
+		if (img_opt->chunk_blocks == 0)
+			log_mesg(0, 1, 1, opt.debug, "ERROR: bad chunk size in the image options\n");
+		chunk_store_open(&reader->store, opt.chunk_store, 0, &opt);
+		reader->bitmap = bitmap;
+		reader->item_chunks = chunk_item_chunks(img_opt->chunk_blocks, fs_info->block_size);
+	}
+
+	if (pipe(pipefd) == -1)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, pipe error: %s\n", __func__, __LINE__, strerror(errno));
+#ifdef F_SETPIPE_SZ
+	fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+	reader->pipe_w = pipefd[1];
+
+	if (img_opt->features & IMG_FEATURE_CHUNKSTORE) {
+		log_mesg(1, 0, 0, opt.debug, "read chunks of %u blocks from %s\n", img_opt->chunk_blocks, opt.chunk_store);
+		if (pthread_create(&reader->thread, NULL, chunk_restore_thread, reader))
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+		return pipefd[0];
+	}
+
+	log_mesg(1, 0, 0, opt.debug, "decompress %s frames of %u blocks\n",
+		get_compress_str(img_opt->compress_mode), img_opt->blocks_per_frame);
+
+	if (pthread_create(&reader->thread, NULL, decompress_thread, reader))
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+
+	return pipefd[0];
+}
+
+/// close the pipe read end fd and return the image file descriptor
+static int decompress_stop(decompress_reader *reader, int fd) {
+
+	close(fd);
+	pthread_join(reader->thread, NULL);
+	free(reader->zero_map);
+	if (reader->store.dir)
+		chunk_store_close(&reader->store);
+
+	return reader->dfr;
+}
+
+#ifndef CHKIMG
+/// punch holes in files, zero out block devices, write zeros to anything else
+static void zero_target_init(zero_target *zt, int dfw, unsigned long long buffer_size) {
+
+	struct stat st;
+
+	memset(zt, 0, sizeof(zero_target));
+	zt->zeros_size = buffer_size;
+
+	if (fstat(dfw, &st) == 0 && S_ISREG(st.st_mode)) {
+		zt->method = ZERO_PUNCH;
+	} else if (fstat(dfw, &st) == 0 && S_ISBLK(st.st_mode)) {
+		zt->method = ZERO_BLKZEROOUT;
+	}
+
+	log_mesg(1, 0, 0, opt.debug, "zero blocks: %s\n", zt->method == ZERO_PUNCH ? "punch holes" :
+		zt->method == ZERO_BLKZEROOUT ? "BLKZEROOUT" : "write zeros");
+}
+
+/// zero size bytes at the target offset and move past them, return 0 or -1
+static int zero_target_range(zero_target *zt, int *dfw, unsigned long long size) {
+
+	off_t offset = lseek(*dfw, 0, SEEK_CUR);
+	unsigned long long done = 0;
+
+	if (offset == (off_t)-1)
+		zt->method = ZERO_WRITE;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (zt->method == ZERO_PUNCH) {
+		off_t end = offset + (off_t)size;
+		struct stat st;
+
+		/// the file grows with the data and the preallocation, past its end there are holes already
+		if (fstat(*dfw, &st) == -1) {
+			log_mesg(1, 0, 0, opt.debug, "fstat: %s, write zeros instead\n", strerror(errno));
+			zt->method = ZERO_WRITE;
+		} else if (offset < st.st_size && fallocate(*dfw, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, (end < st.st_size ? end : st.st_size) - offset) == -1) {
+			log_mesg(1, 0, 0, opt.debug, "punch hole: %s, write zeros instead\n", strerror(errno));
+			zt->method = ZERO_WRITE;
+		} else if (end > st.st_size && ftruncate(*dfw, end) == -1) {
+			log_mesg(1, 0, 0, opt.debug, "ftruncate: %s, write zeros instead\n", strerror(errno));
+			zt->method = ZERO_WRITE;
+		} else {
+			return lseek(*dfw, end, SEEK_SET) == (off_t)-1 ? -1 : 0;
+		}
+	}
+#endif
+
+#ifdef BLKZEROOUT
+	if (zt->method == ZERO_BLKZEROOUT) {
+		uint64_t range[2] = { (uint64_t)offset, size };
+
+		if (ioctl(*dfw, BLKZEROOUT, range) == -1) {
+			log_mesg(1, 0, 0, opt.debug, "BLKZEROOUT: %s, write zeros instead\n", strerror(errno));
+			zt->method = ZERO_WRITE;
+		} else {
+			return lseek(*dfw, offset + (off_t)size, SEEK_SET) == (off_t)-1 ? -1 : 0;
+		}
+	}
+#endif
+
+	if (zt->zeros == NULL) {
+		zt->zeros = alloc_io_buffer(zt->zeros_size);
+		if (zt->zeros == NULL)
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		memset(zt->zeros, 0, zt->zeros_size);
+	}
+
+	while (done < size) {
+		unsigned long long len = size - done < zt->zeros_size ? size - done : zt->zeros_size;
+
+		if (write_all(dfw, zt->zeros, len, &opt) != (long long)len)
+			return -1;
+		done += len;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the blocks of buffer, the first one being the used block rank, at
+ * the target offset. Runs of zero blocks recorded in the reader zero map are
+ * zeroed on the target instead of written. Return the bytes done.
+ */
+static long long write_blocks_zero_map(int *dfw, char *buffer, unsigned int blocks, unsigned int block_size,
+	const decompress_reader *reader, unsigned long long rank, zero_target *zt) {
+
+	unsigned int i = 0;
+
+	while (i < blocks) {
+		int zero = pc_test_bit(rank + i, reader->zero_map, reader->used_blocks);
+		unsigned int run = 1;
+		unsigned long long size;
+
+		while (i + run < blocks && pc_test_bit(rank + i + run, reader->zero_map, reader->used_blocks) == zero)
+			run++;
+		size = (unsigned long long)run * block_size;
+
+		if (zero) {
+			if (zero_target_range(zt, dfw, size))
+				break;
+		} else if (write_all(dfw, buffer + (unsigned long long)i * block_size, size, &opt) != (long long)size) {
+			break;
+		}
+		i += run;
+	}
+
+	return (long long)i * block_size;
+}
+
+/// free extents shorter than this are allocated with the used blocks around them
+#define PREALLOC_MIN_HOLE (64 * 1024)
+
+/**
+ * Allocate the used extents of a file target with fallocate() before the
+ * restore writes them. The writes skip the unused blocks, without it a large
+ * raw disk image ends up in many small fragments. The long free extents stay
+ * holes.
+ */
+static void preallocate_target(int fd, const char *name, const unsigned long *bitmap, unsigned long long total, unsigned int block_size) {
+
+	const unsigned long long min_hole = PREALLOC_MIN_HOLE / block_size;
+	unsigned long long next = 0, extents = 0, bytes = 0;
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return;
+
+	while ((next = pc_find_next_set(bitmap, next, total)) < total) {
+		unsigned long long start = next;
+		unsigned long long end = pc_find_next_zero(bitmap, start, total);
+		unsigned long long size;
+
+		next = pc_find_next_set(bitmap, end, total);
+		while (next < total && next - end < min_hole) {
+			end = pc_find_next_zero(bitmap, next, total);
+			next = pc_find_next_set(bitmap, end, total);
+		}
+		size = (end - start) * block_size;
+
+		if (fallocate(fd, 0, opt.offset + (off_t)(start * block_size), (off_t)size) == -1) {
+			log_mesg(errno == EOPNOTSUPP ? 1 : 0, 0, 0, opt.debug, "target %s: fallocate: %s, not preallocated\n",
+				name, strerror(errno));
+			return;
+		}
+		extents++;
+		bytes += size;
+	}
+
+	log_mesg(1, 0, 0, opt.debug, "target %s: preallocated %llu extents, %llu bytes\n", name, extents, bytes);
+}
+
+/// the checkpoint may only record what every target holds, see checkpoint_tick
+static void restore_checkpoint_sync(void *arg) {
+
+	restore_targets *rt = (restore_targets *)arg;
+	int t;
+
+	if (rt->fo)
+		fanout_drain(rt->fo);
+	for (t = 0; t < rt->count; t++) {
+		if (fdatasync(rt->dfws[t]) == -1 && errno != EINVAL)
+			log_mesg(0, 1, 1, opt.debug, "target %s: fdatasync ERROR:%s\n", rt->targets[t], strerror(errno));
+	}
+}
+#endif
+
+/// block number of the used block target, walking forward from the used block *used at *block
+static unsigned long long used_block_id(unsigned long *bitmap, unsigned long long total,
+		unsigned long long *block, unsigned long long *used, unsigned long long target) {
+
+	for (;;) {
+		unsigned long long start = *block;
+		unsigned long long len = pc_next_extent(bitmap, &start, total, total);
+
+		if (!len)
+			return total;
+		if (target < *used + len) {
+			*block = start;
+			return start + (target - *used);
+		}
+		*used += len;
+		*block = start + len;
+	}
+}
+
+/**
+ * Chunk batches: when every checksum covers its own chunk of used blocks,
+ * the image offset of a chunk follows from its rank. Worker threads then
+ * read a seekable uncompressed image in batches of chunks with preadv(), the
+ * blocks back to back in an aligned buffer and the checksums on the side.
+ */
+typedef struct {
+	int dfr;
+	off_t data_start;
+	unsigned long long blocks_used;
+	unsigned int block_size;
+	unsigned int cs_size;		/// 0 without checksums in the image
+	unsigned int blocks_per_chunk;
+	int checksum_mode;
+	unsigned long long chunks;
+	unsigned long long chunk_bytes;	/// blocks and checksum of a full chunk in the image
+	unsigned long long batch;	/// chunks per read
+	unsigned long long batches;
+	unsigned int threads;
+	unsigned long long next;	/// next batch to hand out, atomic
+} chunk_batches;
+
+typedef struct {
+	char *blocks;			/// the blocks of a batch, from alloc_io_buffer()
+	unsigned char *sums;		/// the checksums of its chunks
+	struct iovec *iov;		/// blocks and checksum of each chunk
+} chunk_buffer;
+
+static void chunk_batches_init(chunk_batches *cb, int dfr, unsigned long *bitmap, file_system_info *fs_info,
+		image_options *img_opt, unsigned int blocks_per_chunk, unsigned int cs_size) {
+
+	unsigned long long per_thread, batches;
+	unsigned int threads = opt.threads ? opt.threads : pipeline_cpu_count();
+
+	memset(cb, 0, sizeof(chunk_batches));
+	cb->dfr = dfr;
+	cb->data_start = lseek(dfr, 0, SEEK_CUR);
+	cb->blocks_used = pc_count_bits(bitmap, fs_info->totalblock);
+	cb->block_size = fs_info->block_size;
+	cb->cs_size = cs_size;
+	cb->blocks_per_chunk = blocks_per_chunk;
+	cb->checksum_mode = img_opt->checksum_mode;
+	cb->chunks = (cb->blocks_used + blocks_per_chunk - 1) / blocks_per_chunk;
+	cb->chunk_bytes = (unsigned long long)blocks_per_chunk * cb->block_size + cs_size;
+
+	if (threads > PIPELINE_MAX_WORKERS)
+		threads = PIPELINE_MAX_WORKERS;
+	if (threads > cb->chunks)
+		threads = cb->chunks ? cb->chunks : 1;
+	cb->threads = threads;
+
+	/// fill mem_limit, but keep a few batches per thread so they end together
+	per_thread = opt.mem_limit / threads / cb->chunk_bytes;
+	batches = (cb->chunks + 4 * threads - 1) / (4 * threads);
+	cb->batch = per_thread < batches ? per_thread : batches;
+	if (cb->batch < 1)
+		cb->batch = 1;
+	cb->batches = (cb->chunks + cb->batch - 1) / cb->batch;
+}
+
+static void chunk_buffer_alloc(chunk_batches *cb, chunk_buffer *buf) {
+
+	buf->blocks = alloc_io_buffer(cb->batch * cb->blocks_per_chunk * cb->block_size);
+	buf->sums = malloc(cb->batch * cb->cs_size + 1);
+	buf->iov = malloc(2 * cb->batch * sizeof(struct iovec));
+	if (buf->blocks == NULL || buf->sums == NULL || buf->iov == NULL)
+		log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+}
+
+static void chunk_buffer_free(chunk_buffer *buf) {
+
+	free(buf->blocks);
+	free(buf->sums);
+	free(buf->iov);
+}
+
+/// take the next batch, its first chunk and its size, 0 when all are taken
+static int chunk_batch_next(chunk_batches *cb, unsigned long long *b, unsigned long long *first, unsigned long long *n) {
+
+	*b = __atomic_fetch_add(&cb->next, 1, __ATOMIC_RELAXED);
+	*first = *b * cb->batch;
+	if (*first >= cb->chunks)
+		return 0;
+	*n = cb->chunks - *first < cb->batch ? cb->chunks - *first : cb->batch;
+	return 1;
+}
+
+/// used blocks of a chunk, only the very last one can be partial
+static unsigned int chunk_blocks(chunk_batches *cb, unsigned long long chunk) {
+
+	unsigned long long used = chunk * cb->blocks_per_chunk;
+
+	return cb->blocks_used - used < cb->blocks_per_chunk ? cb->blocks_used - used : cb->blocks_per_chunk;
+}
+
+/// block data of chunk c of the batch in buf
+static char *chunk_data(chunk_batches *cb, chunk_buffer *buf, unsigned long long c) {
+
+	return buf->blocks + c * cb->blocks_per_chunk * cb->block_size;
+}
+
+/**
+ * Read the n chunks of a batch from first, return the image bytes read. A
+ * short read sets *error to the errno of the read, or to -1 at the end of
+ * the image, the chunks before it are whole.
+ */
+static unsigned long long chunk_batch_read(chunk_batches *cb, chunk_buffer *buf, unsigned long long first,
+		unsigned long long n, int *error) {
+
+	struct iovec *iov = buf->iov;
+	off_t offset = cb->data_start + (off_t)(first * cb->chunk_bytes);
+	unsigned long long c, got = 0;
+	int iovcnt = 0;
+
+	for (c = 0; c < n; c++) {
+		iov[iovcnt].iov_base = chunk_data(cb, buf, c);
+		iov[iovcnt++].iov_len = (size_t)chunk_blocks(cb, first + c) * cb->block_size;
+		if (cb->cs_size) {
+			iov[iovcnt].iov_base = buf->sums + c * cb->cs_size;
+			iov[iovcnt++].iov_len = cb->cs_size;
+		}
+	}
+
+	*error = 0;
+	while (iovcnt > 0) {
+		ssize_t r = preadv(cb->dfr, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset + (off_t)got);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			*error = r ? errno : -1;
+			break;
+		}
+		got += r;
+		while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return got;
+}
+
+/// 1 when chunk c of a batch read up to got bytes is whole
+static int chunk_complete(chunk_batches *cb, unsigned long long first, unsigned long long c, unsigned long long got) {
+
+	return c * cb->chunk_bytes + (unsigned long long)chunk_blocks(cb, first + c) * cb->block_size + cb->cs_size <= got;
+}
+
+/// 1 when chunk c of the batch in buf matches its checksum
+static int chunk_check(chunk_batches *cb, chunk_buffer *buf, unsigned long long first, unsigned long long c) {
+
+	unsigned char checksum[cb->cs_size];
+	unsigned int i, nb = chunk_blocks(cb, first + c);
+	char *data = chunk_data(cb, buf, c);
+
+	init_checksum(cb->checksum_mode, checksum, opt.debug);
+	for (i = 0; i < nb; i++)
+		update_checksum(checksum, data + (size_t)i * cb->block_size, cb->block_size);
+
+	return memcmp(buf->sums + c * cb->cs_size, checksum, cb->cs_size) == 0;
+}
+
+/// run cb->threads workers on arg and wait for them
+static void chunk_batches_run(chunk_batches *cb, void *(*worker)(void *), void *arg) {
+
+	pthread_t workers[PIPELINE_MAX_WORKERS];
+	unsigned int w;
+
+	for (w = 0; w < cb->threads; w++) {
+		if (pthread_create(&workers[w], NULL, worker, arg))
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	}
+	for (w = 0; w < cb->threads; w++)
+		pthread_join(workers[w], NULL);
+}
+
+#ifndef CHKIMG
+/**
+ * Parallel restore: workers take batches of chunks, check them when every
+ * checksum covers its own chunk, and write them with pwritev() at the
+ * blocks of the bitmap. The first block of every batch comes from a single
+ * pass over the bitmap.
+ */
+typedef struct {
+	chunk_batches cb;
+	int dfw;
+	int dfw_buffered;		/// the target without O_DIRECT for unaligned writes, or -1
+	const unsigned long *bitmap;
+	unsigned long long totalblock;
+	int check;			/// the chunks are checked before they are written
+	unsigned long long *batch_block;	/// first block of each batch
+} restore_ctx;
+
+/// extents merged in one pwritev()
+#define RESTORE_MAX_IOV 256
+
+static void restore_write(restore_ctx *ctx, struct iovec *iov, int *iov_count, off_t offset, unsigned long long block) {
+
+	if (*iov_count && pwritev_all(ctx->dfw, ctx->dfw_buffered, iov, *iov_count, offset, &opt)) {
+		if (!opt.skip_write_error)
+			log_mesg(0, 1, 1, opt.debug, "write block %llu ERROR:%s\n", block, strerror(errno));
+		else
+			log_mesg(0, 0, 1, opt.debug, "skip write block %llu error:%s\n", block, strerror(errno));
+	}
+	*iov_count = 0;
+}
+
+static void *restore_worker(void *arg) {
+
+	restore_ctx *ctx = (restore_ctx *)arg;
+	chunk_batches *cb = &ctx->cb;
+	const unsigned int block_size = cb->block_size;
+	struct iovec iov[RESTORE_MAX_IOV];
+	chunk_buffer buf;
+	unsigned long long b, first, n;
+
+	chunk_buffer_alloc(cb, &buf);
+
+	while (chunk_batch_next(cb, &b, &first, &n)) {
+		unsigned long long c, got, blocks = 0, block = ctx->batch_block[b], run_block = 0;
+		off_t run_offset = 0, run_end = 0;
+		int iov_count = 0, error;
+
+		got = chunk_batch_read(cb, &buf, first, n, &error);
+		if (!chunk_complete(cb, first, n - 1, got)) {
+			if (error > 0)
+				log_mesg(0, 1, 1, opt.debug, "read ERROR:%s\n", strerror(error));
+			log_mesg(0, 1, 1, opt.debug, "ERROR: source image too short\n");
+		}
+
+		for (c = 0; c < n; c++) {
+			unsigned long long i, nb = chunk_blocks(cb, first + c);
+			char *data = chunk_data(cb, &buf, c);
+
+			if (ctx->check && !chunk_check(cb, &buf, first, c))
+				log_mesg(0, 1, 1, opt.debug, "CRC error, block_id=%llu...\n ", block);
+
+			/// the blocks of the chunk go to the used blocks of the bitmap
+			for (i = 0; i < nb; ) {
+				unsigned long long len = pc_next_extent(ctx->bitmap, &block, nb - i, ctx->totalblock);
+				off_t offset = opt.offset + (off_t)(block * block_size);
+
+				if (iov_count && (offset != run_end || iov_count == RESTORE_MAX_IOV))
+					restore_write(ctx, iov, &iov_count, run_offset, run_block);
+				if (!iov_count) {
+					run_offset = run_end = offset;
+					run_block = block;
+				}
+				iov[iov_count].iov_base = data + i * block_size;
+				iov[iov_count++].iov_len = len * block_size;
+				run_end += (off_t)(len * block_size);
+				block += len;
+				i += len;
+			}
+			blocks += nb;
+		}
+		restore_write(ctx, iov, &iov_count, run_offset, run_block);
+
+		__atomic_add_fetch(&copied, blocks, __ATOMIC_RELAXED);
+	}
+
+	chunk_buffer_free(&buf);
+	return NULL;
+}
+
+/**
+ * Restore a seekable uncompressed image to dfw with opt.threads workers.
+ * Every checksum must cover its own chunk, or not be checked.
+ */
+static void restore_parallel(int dfr, int dfw, const char *target, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt) {
+
+	restore_ctx ctx;
+	unsigned long long b, block = 0, used = 0;
+	unsigned int blocks_per_chunk, cs_size = 0;
+	int debug = opt.debug;
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (img_opt->checksum_mode != CSM_NONE && img_opt->blocks_per_checksum) {
+		cs_size = img_opt->checksum_size;
+		blocks_per_chunk = img_opt->blocks_per_checksum;
+		ctx.check = !opt.ignore_crc;
+	} else {
+		blocks_per_chunk = opt.buffer_size > fs_info->block_size ? opt.buffer_size / fs_info->block_size : 1;
+	}
+	chunk_batches_init(&ctx.cb, dfr, bitmap, fs_info, img_opt, blocks_per_chunk, cs_size);
+	ctx.dfw = dfw;
+	ctx.bitmap = bitmap;
+	ctx.totalblock = fs_info->totalblock;
+
+	/// check_direct_io() made the choice, the workers share dfw and never change its flags
+	ctx.dfw_buffered = -1;
+	if (fcntl(dfw, F_GETFL) & O_DIRECT) {
+		ctx.dfw_buffered = open(target, O_WRONLY | O_LARGEFILE);
+		if (ctx.dfw_buffered == -1)
+			log_mesg(0, 1, 1, debug, "open target %s ERROR:%s\n", target, strerror(errno));
+	}
+
+	/// the rank pass, used_block_id() walks the bitmap forward only
+	ctx.batch_block = malloc((ctx.cb.batches ? ctx.cb.batches : 1) * sizeof(unsigned long long));
+	if (ctx.batch_block == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	for (b = 0; b < ctx.cb.batches; b++)
+		ctx.batch_block[b] = used_block_id(bitmap, fs_info->totalblock, &block, &used, b * ctx.cb.batch * blocks_per_chunk);
+
+	log_mesg(0, 0, 1, debug, "Parallel restore: %llu ranges of up to %llu blocks on %u threads\n",
+		ctx.cb.batches, ctx.cb.batch * blocks_per_chunk, ctx.cb.threads);
+
+	chunk_batches_run(&ctx.cb, restore_worker, &ctx);
+
+	if (ctx.dfw_buffered != -1)
+		close(ctx.dfw_buffered);
+	free(ctx.batch_block);
+	block_id = fs_info->totalblock;
+}
+#endif
+
+#ifdef CHKIMG
+/**
+ * Parallel chkimg: with reseed every checksum covers its own chunk, so
+ * workers check the batches of a seekable image independently. A failing
+ * chunk does not stop the check, all of them are reported as block ranges
+ * once the workers are done.
+ */
+typedef struct {
+	unsigned long long chunk;
+	int error;		/// 0 for a checksum mismatch, else errno of the read, -1 when the image is short
+} verify_bad;
+
+typedef struct {
+	chunk_batches cb;
+
+	pthread_mutex_t lock;
+	verify_bad *bad;
+	unsigned long long n_bad;
+	unsigned long long bad_size;
+} verify_ctx;
+
+static void verify_report(verify_ctx *ctx, unsigned long long chunk, int error) {
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->n_bad == ctx->bad_size) {
+		ctx->bad_size = ctx->bad_size ? 2 * ctx->bad_size : 64;
+		ctx->bad = realloc(ctx->bad, ctx->bad_size * sizeof(verify_bad));
+		if (ctx->bad == NULL)
+			log_mesg(0, 1, 1, opt.debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+	ctx->bad[ctx->n_bad].chunk = chunk;
+	ctx->bad[ctx->n_bad].error = error;
+	ctx->n_bad++;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void *verify_worker(void *arg) {
+
+	verify_ctx *ctx = (verify_ctx *)arg;
+	chunk_batches *cb = &ctx->cb;
+	chunk_buffer buf;
+	unsigned long long b, first, n;
+
+	chunk_buffer_alloc(cb, &buf);
+
+	while (chunk_batch_next(cb, &b, &first, &n)) {
+		unsigned long long c, got, blocks = 0;
+		int error;
+
+		got = chunk_batch_read(cb, &buf, first, n, &error);
+		for (c = 0; c < n; c++) {
+			if (!chunk_complete(cb, first, c, got)) {
+				verify_report(ctx, first + c, error);
+				continue;
+			}
+			if (!chunk_check(cb, &buf, first, c))
+				verify_report(ctx, first + c, 0);
+			blocks += chunk_blocks(cb, first + c);
+		}
+
+		__atomic_add_fetch(&copied, blocks, __ATOMIC_RELAXED);
+	}
+
+	chunk_buffer_free(&buf);
+	return NULL;
+}
+
+static int verify_bad_cmp(const void *a, const void *b) {
+
+	unsigned long long x = ((const verify_bad *)a)->chunk, y = ((const verify_bad *)b)->chunk;
+
+	return x < y ? -1 : x > y;
+}
+
+static void verify_parallel(int dfr, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt) {
+
+	verify_ctx ctx;
+	unsigned long long i, block = 0, used = 0;
+	int debug = opt.debug;
+
+	memset(&ctx, 0, sizeof(ctx));
+	chunk_batches_init(&ctx.cb, dfr, bitmap, fs_info, img_opt, img_opt->blocks_per_checksum, img_opt->checksum_size);
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	log_mesg(1, 0, 0, debug, "parallel check: %llu chunks of %u blocks, %u threads, %llu chunks per read\n",
+		ctx.cb.chunks, ctx.cb.blocks_per_chunk, ctx.cb.threads, ctx.cb.batch);
+
+	chunk_batches_run(&ctx.cb, verify_worker, &ctx);
+	pthread_mutex_destroy(&ctx.lock);
+	block_id = fs_info->totalblock;
+
+	if (!ctx.n_bad)
+		return;
+
+	qsort(ctx.bad, ctx.n_bad, sizeof(verify_bad), verify_bad_cmp);
+	for (i = 0; i < ctx.n_bad; i++) {
+		unsigned long long first_used = ctx.bad[i].chunk * ctx.cb.blocks_per_chunk;
+		unsigned long long last_used = first_used + ctx.cb.blocks_per_chunk - 1;
+		unsigned long long first, last;
+
+		if (last_used >= ctx.cb.blocks_used)
+			last_used = ctx.cb.blocks_used - 1;
+		first = used_block_id(bitmap, fs_info->totalblock, &block, &used, first_used);
+		last = used_block_id(bitmap, fs_info->totalblock, &block, &used, last_used);
+
+		if (ctx.bad[i].error == 0)
+			log_mesg(0, 0, 1, debug, "CRC error, blocks %llu-%llu (checksum %llu)\n", first, last, ctx.bad[i].chunk);
+		else if (ctx.bad[i].error == -1)
+			log_mesg(0, 0, 1, debug, "image too short, blocks %llu-%llu (checksum %llu) missing\n", first, last, ctx.bad[i].chunk);
+		else
+			log_mesg(0, 0, 1, debug, "read ERROR:%s, blocks %llu-%llu (checksum %llu)\n",
+				strerror(ctx.bad[i].error), first, last, ctx.bad[i].chunk);
+	}
+	log_mesg(0, 1, 1, debug, "%llu of %llu checksums failed\n", ctx.n_bad, ctx.cb.chunks);
+}
+
+/// the index of a seekable image must match the one computed from its bitmap
+static void check_index(int dfr, unsigned long *bitmap, file_system_info *fs_info, image_options *img_opt) {
+
+	image_index stored, computed;
+	int debug = opt.debug;
+
+	if (lseek(dfr, 0, SEEK_CUR) == (off_t)-1)
+		return;
+
+	if (load_image_index(dfr, &stored, fs_info, img_opt, &opt))
+		log_mesg(0, 1, 1, debug, "ERROR: the image index is missing or damaged\n");
+
+	build_image_index(&computed, bitmap, fs_info, img_opt, &opt);
+
+	/// walk the frame headers, the frames are checked while reading the data
+	if (img_opt->features & IMG_FEATURES_FRAMED) {
+		unsigned long long i, offset = computed.data_offset;
+		uint32_t head;
+
+		for (i = 0; i < computed.head.offset_count; i++) {
+			if (pread(dfr, &head, FRAME_HEAD_SIZE, offset) != FRAME_HEAD_SIZE)
+				log_mesg(0, 1, 1, debug, "ERROR: source image too short, frame %llu\n", i);
+			computed.offset[i] = offset;
+			offset += get_frame_head_size(img_opt) + (head & FRAME_SIZE_MASK);
+		}
+		computed.data_size = offset - computed.data_offset;
+		if (computed.data_size != stored.data_size)
+			log_mesg(0, 1, 1, debug, "ERROR: the image index does not follow the data\n");
+	}
+
+	if (memcmp(&stored.head, &computed.head, sizeof(image_index_head)) ||
+	    memcmp(stored.rank, computed.rank, stored.head.rank_count * sizeof(uint64_t)) ||
+	    memcmp(stored.offset, computed.offset, stored.head.offset_count * sizeof(uint64_t)))
+		log_mesg(0, 1, 1, debug, "ERROR: the image index does not match the bitmap\n");
+
+	log_mesg(1, 0, 0, debug, "image index: ok\n");
+	free_image_index(&stored);
+	free_image_index(&computed);
+}
+#endif
+
+#ifdef CONVERT
+static void *convert_thread(void *arg) {
+
+	convert_writer *writer = (convert_writer *)arg;
+
+	clone_pipeline(writer->pipe_r, writer->dfw, writer->bitmap, writer->fs_info, &writer->img_opt,
+		(writer->img_opt.features & IMG_FEATURE_INDEX) ? &writer->index : NULL);
+
+	return NULL;
+}
+
+/**
+ * partclone.convert: the source image is restored as usual, with its
+ * checksums checked, but the restore loop writes the used blocks to a pipe.
+ * On the other side the clone pipeline reads them in order, as if it read
+ * the used blocks of a device, and writes the new image with the image
+ * options of the command line. Return the end of the pipe for the restore
+ * loop, convert_stop() returns the new image.
+ */
+static int convert_start(convert_writer *writer, int dfw, unsigned long *bitmap, file_system_info *fs_info, const image_options *src_opt) {
+
+	image_options *img_opt = &writer->img_opt;
+	int debug = opt.debug;
+	int fds[2];
+
+	memset(writer, 0, sizeof(convert_writer));
+	writer->dfw = dfw;
+	writer->bitmap = bitmap;
+	writer->fs_info = fs_info;
+
+	init_image_options(img_opt);
+	/// a delta image stays one, its bitmap only has the changed blocks
+	if (src_opt->features & IMG_FEATURE_DELTA) {
+		if (opt.image_version == 2)
+			log_mesg(0, 1, 1, debug, "convert: a delta image needs the image version 3\n");
+		opt.image_version = 3;
+	}
+	clone_image_options(img_opt);
+	img_opt->features |= src_opt->features & IMG_FEATURE_DELTA;
+	clone_image_layout(img_opt, fs_info);
+	set_image_bitmap_mode(img_opt, fs_info, bitmap);
+
+	log_mesg(0, 0, 1, debug, "Converting to an image %04d, checksum %s, compression %s\n", img_opt->image_version,
+		get_checksum_str(img_opt->checksum_mode), get_compress_str((img_opt->features & IMG_FEATURE_COMPRESS) ? img_opt->compress_mode : CMP_NONE));
+
+	write_image_desc(&writer->dfw, *fs_info, *img_opt, &opt);
+	write_image_bitmap(&writer->dfw, *fs_info, *img_opt, bitmap, &opt);
+
+	if (img_opt->features & IMG_FEATURE_INDEX)
+		build_image_index(&writer->index, bitmap, fs_info, img_opt, &opt);
+	image_digest_init(&digest);
+
+	if (pipe(fds) == -1)
+		log_mesg(0, 1, 1, debug, "%s, %i, pipe error: %s\n", __func__, __LINE__, strerror(errno));
+#ifdef F_SETPIPE_SZ
+	fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+	writer->pipe_r = fds[0];
+
+	if (pthread_create(&writer->thread, NULL, convert_thread, writer))
+		log_mesg(0, 1, 1, debug, "%s, %i, thread create error\n", __func__, __LINE__);
+
+	return fds[1];
+}
+
+static int convert_stop(convert_writer *writer, int fd, const struct timespec *start) {
+
+	close(fd);
+	pthread_join(writer->thread, NULL);
+	close(writer->pipe_r);
+
+	if (writer->img_opt.features & IMG_FEATURE_INDEX) {
+		clone_image_stats(&writer->index, start);
+		log_mesg(1, 0, 0, opt.debug, "Write the image index\n");
+		write_image_index(&writer->dfw, &writer->index, writer->fs_info, &writer->img_opt, &opt);
+		free_image_index(&writer->index);
+	}
+
+	return writer->dfw;
+}
+#endif
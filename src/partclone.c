@@ -25,9 +25,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <malloc.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <getopt.h>
 #include <locale.h>
 #include <mntent.h>
@@ -45,6 +47,10 @@
 #include "version.h"
 #include "partclone.h"
 #include "checksum.h"
+#include "blake3.h"
+#include "compress.h"
+#include "split.h"
+#include "checkpoint.h"
 
 #if defined(linux) && defined(_IO) && !defined(BLKGETSIZE)
 #define BLKGETSIZE      _IO(0x12,96)  /* Get device size in 512-byte blocks. */
@@ -127,6 +133,66 @@ void set_image_options_v2(image_options* img_opt)
 	img_opt->bitmap_mode = BM_BIT;
 }
 
+/**
+ * Set the default options for image version 0003: the same stream as 0002
+ * followed by an index and a footer for random access.
+ */
+void set_image_options_v3(image_options* img_opt)
+{
+	set_image_options_v2(img_opt);
+
+	img_opt->feature_size = sizeof(image_options_v3);
+	img_opt->image_version = 0x0003;
+	img_opt->features = IMG_FEATURE_INDEX;
+}
+
+/**
+ * Encode the runs of bitmap for BM_EXTENT into out, or only count their
+ * bytes when out is NULL. Return the size of the encoded runs.
+ */
+static unsigned long long encode_bitmap_extents(const unsigned long* bitmap, unsigned long long total, unsigned char* out)
+{
+	unsigned long long nr = 0, size = 0;
+	int used = 0;
+
+	while (nr < total) {
+		unsigned long long next = used ? pc_find_next_zero(bitmap, nr, total) : pc_find_next_set(bitmap, nr, total);
+		unsigned long long run = next - nr;
+
+		do {
+			unsigned char byte = run & 0x7F;
+
+			run >>= 7;
+			if (out)
+				out[size] = run ? byte | 0x80 : byte;
+			size++;
+		} while (run);
+
+		nr = next;
+		used = !used;
+	}
+
+	return size;
+}
+
+/**
+ * Pick the bitmap of an image 0003: the runs when they are smaller than one
+ * bit per block, as on nearly empty or nearly full file systems.
+ */
+void set_image_bitmap_mode(image_options* img_opt, const file_system_info* fs_info, const unsigned long* bitmap)
+{
+	unsigned long long size;
+
+	if (img_opt->image_version != 0x0003 || img_opt->bitmap_mode != BM_BIT)
+		return;
+
+	size = encode_bitmap_extents(bitmap, fs_info->totalblock, NULL);
+	if (size < BITS_TO_BYTES(fs_info->totalblock)) {
+		img_opt->bitmap_mode = BM_EXTENT;
+		img_opt->bitmap_size = size;
+	}
+}
+
 void init_image_head_v1(image_head_v1* image_hdr, char* fs)
 {
 	memset(image_hdr, 0, sizeof(image_head_v1));
@@ -203,6 +269,8 @@ void usage(void) {
 #else
 #ifdef RESTORE
 		"    Restore partclone image to a device or standard output.\n"
+#elif CONVERT
+		"    Rewrite a partclone image with other image options, without a restore.\n"
 #else
 		"    Efficiently clone to an image, device or standard output.\n"
 #endif
@@ -211,30 +279,124 @@ void usage(void) {
 #ifndef CHKIMG
 		"    -o,  --output FILE      Output FILE\n"
 		"    -O   --overwrite FILE   Output FILE, overwriting if exists\n"
+#ifndef CONVERT
+		"                            Repeat -o or -O to restore to several devices at\n"
+		"                            once, the image is read a single time\n"
+#endif
+#ifndef CONVERT
 		"    -W   --restore_raw_file create special raw file for loop device\n"
+#endif
 #endif
 		"    -s,  --source FILE      Source FILE\n"
 		"    -L,  --logfile FILE     Log FILE\n"
 #ifndef CHKIMG
 #ifndef RESTORE
 #ifndef DD
+#ifndef CONVERT
 		"    -c,  --clone            Save to the special image format\n"
+#endif
 		"    -x,  --compresscmd CMD  Start CMD as an output pipe to compress the cloned image\n"
+#ifndef CONVERT
 		"    -r,  --restore          Restore from the special image format\n"
 		"    -b,  --dev-to-dev       Local device to device copy mode\n"
 #endif
+		"         --image-version=X  Image format to write, 2 (default) or 3 (with an\n"
+		"                            index for random access)\n"
+		"         --compress=ALGO[:LEVEL]\n"
+		"                            Compress the data on --threads workers, image\n"
+		"                            version 3. ALGO is one of:"
+#ifdef HAVE_LIBZSTD
+		" zstd (level 1-22, default 3)"
+#endif
+#ifdef HAVE_LIBLZ4
+		" lz4 (level 1, 2-12 for LZ4HC)"
+#endif
+		" none\n"
+		"         --skip-zero        Leave the all-zero blocks out of the image, restore\n"
+		"                            zeroes them on the target (image version 3)\n"
+#ifdef CONVERT
+		"         --chunk-store=DIR  Read the chunks of a chunk store image from DIR\n"
+#else
+		"         --chunk-store=DIR  Add the data to the shared chunk store DIR, the\n"
+		"                            image only lists the chunks (image version 3)\n"
+		"         --base=IMAGE       Only copy the blocks changed since IMAGE. Repeat it\n"
+		"                            for a chain, the full image first then its deltas.\n"
+		"                            Restore the chain in the same order (image version 3)\n"
+#endif
+		"         --split-size=SIZE  Write the image in segments of SIZE bytes (K, M, G\n"
+		"                            suffixes), named TARGET.000, TARGET.001, ...\n"
+		"         --split-dir=DIR    Put the next segments in DIR too, repeat it to spread\n"
+		"                            them over several disks\n"
+#endif
+#ifndef CONVERT
 		"    -D,  --domain           Create ddrescue domain log from source device\n"
 		"         --offset_domain=X  Add offset X (bytes) to domain log values\n"
 		"    -R,  --rescue           Continue clone while disk read errors\n"
+#endif
 		"    -aX  --checksum-mode=X  Checksum formula to use to add error detection\n"
 		"                            where X:\n"
 		"                            0: No checksum (no slowdown, smallest image)\n"
 		"                            1: CRC32 (Fast to compute, basic detection)\n"
+		"                            2: CRC32C (Hardware accelerated on most CPUs)\n"
+		"                            3: XXH3-64 (Faster than CRC32C, 8 bytes)\n"
+		"                            4: BLAKE3 (Cryptographic strength, 32 bytes)\n"
 		"    -kX  --blocks-per-checksum=X\n"
 		"                            Write one checksum for every X blocks\n"
+#ifdef CONVERT
+		"         --threads=N        Decompress and compute the checksums on N worker\n"
+		"                            threads each (0: one per CPU, default)\n"
+		"         --mem-limit=SIZE   Memory for the parallel buffers (default: %lluM)\n"
+#else
 		"    -K,  --no-reseed        Do not reseed the checksum at each write (TEST)\n"
+		"         --threads=N        Compute checksums on N worker threads while reading\n"
+		"                            and writing in parallel (0: disabled, default)\n"
+		"         --mem-limit=SIZE   Memory for the parallel buffers (default: %lluM)\n"
+		"         --io-depth=N       Keep N source reads in flight with io_uring\n"
+		"                            (0: one blocking read at a time, default)\n"
 #endif
+#endif
+#ifndef CONVERT
 		"    -w,  --skip_write_error Continue restore while write errors\n"
+		"         --direct-io        Bypass the page cache (O_DIRECT) on the device\n"
+#if defined(RESTORE) || !defined(DD)
+		"         --discard[=MODE[:SIZE]]\n"
+		"                            Discard the unused blocks of the targets while\n"
+		"                            restoring, MODE is trim (default) or zero to make\n"
+		"                            them read back as zeros. Free extents smaller than\n"
+		"                            SIZE (default: 1M) are left as is\n"
+		"         --sparse           Do not preallocate the used blocks of a file target\n"
+		"                            before writing them, only skip the unused ones\n"
+		"         --checkpoint=FILE  Record in FILE how far the clone or restore went,\n"
+		"                            once the targets are synced, an uncompressed image\n"
+		"                            in a file\n"
+		"         --checkpoint-interval=SECONDS\n"
+		"                            Time between two checkpoints (default: 60, 0: after\n"
+		"                            every buffer)\n"
+		"         --resume           Go on from the checkpoint of a clone or restore\n"
+		"                            which failed\n"
+		"         --parallel         Restore an uncompressed image read from a file in\n"
+		"                            ranges read and written at once by --threads\n"
+		"                            workers (0: one per CPU), for striped targets\n"
+#endif
+#endif
+#endif
+#ifdef RESTORE
+		"         --threads=N        Decompress a compressed image on N threads\n"
+		"                            (0: one per CPU, default)\n"
+		"         --mem-limit=SIZE   Memory for the decompression buffers (default: %lluM)\n"
+		"         --chunk-store=DIR  Read the chunks of a chunk store image from DIR\n"
+		"                            A delta image is restored over its restored base,\n"
+		"                            without -W\n"
+		"         --split-dir=DIR    Look for the segments in DIR too, with a source\n"
+		"                            ending in .000\n"
+#endif
+#ifdef CHKIMG
+		"         --threads=N        Check the checksums of a seekable image on N threads\n"
+		"                            (0: one per CPU, default)\n"
+		"         --mem-limit=SIZE   Memory for the read buffers (default: %lluM)\n"
+		"         --chunk-store=DIR  Check the chunks of a chunk store image in DIR\n"
+		"         --split-dir=DIR    Look for the segments in DIR too, with a source\n"
+		"                            ending in .000\n"
 #endif
 		"    -dX, --debug=X          Set the debug level to X = [0|1|2]\n"
 		"    -C,  --no_check         Don't check device size and free space\n"
@@ -251,14 +413,18 @@ void usage(void) {
 		"    -z,  --buffer_size SIZE Read/write buffer size (default: %d)\n"
 #ifndef CHKIMG
 		"    -q,  --quiet            Disable progress message\n"
+#ifndef CONVERT
 		"    -E,  --offset=X         Add offset X (bytes) to OUTPUT\n"
 		"    -T,  --btfiles          Restore block as file for ClonezillaBT\n"
 		"    -t,  --btfiles_torrent  Restore block as file for ClonezillaBT but only generate torrent\n"
+#endif
 #endif
 		"    -n,  --note NOTE        Display Message Note (128 words)\n"
 		"    -v,  --version          Display partclone version\n"
 		"    -h,  --help             Display this help\n"
-		, get_exec_name(), VERSION, get_exec_name(), DEFAULT_BUFFER_SIZE);
+		, get_exec_name(), VERSION, get_exec_name(),
+		DEFAULT_MEM_LIMIT / (1024 * 1024),
+		DEFAULT_BUFFER_SIZE);
 	exit(0);
 }
 
@@ -279,6 +445,18 @@ int convert_to_checksum_mode(unsigned long mode) {
 		return CSM_CRC32;
 		break;
 
+	case 2:
+		return CSM_CRC32C;
+		break;
+
+	case 3:
+		return CSM_XXH3_64;
+		break;
+
+	case 4:
+		return CSM_BLAKE3;
+		break;
+
 	// note: we do not allow the user to use CSM_CRC32_0001. That mode exist only
 	// to support image created in format 0001.
 
@@ -291,9 +469,101 @@ int convert_to_checksum_mode(unsigned long mode) {
 }
 
 enum {
-	OPT_OFFSET_DOMAIN = 1000
+	OPT_OFFSET_DOMAIN = 1000,
+	OPT_THREADS,
+	OPT_MEM_LIMIT,
+	OPT_IO_DEPTH,
+	OPT_DIRECT_IO,
+	OPT_IMAGE_VERSION,
+	OPT_COMPRESS,
+	OPT_SKIP_ZERO,
+	OPT_CHUNK_STORE,
+	OPT_BASE,
+	OPT_SPLIT_SIZE,
+	OPT_SPLIT_DIR,
+	OPT_DISCARD,
+	OPT_SPARSE,
+	OPT_CHECKPOINT,
+	OPT_CHECKPOINT_INTERVAL,
+	OPT_RESUME,
+	OPT_PARALLEL,
 };
 
+#ifndef CHKIMG
+#ifndef RESTORE
+#ifndef DD
+/// parse ALGO[:LEVEL] for --compress, exit on error
+static void parse_compress(const char *str, cmd_opt *opt) {
+
+	static const int modes[] = { CMP_NONE, CMP_ZSTD, CMP_LZ4 };
+	const char *level = strchr(str, ':');
+	size_t len = level ? (size_t)(level - str) : strlen(str);
+	unsigned int i;
+
+	opt->compress_mode = -1;
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (strlen(get_compress_str(modes[i])) == len && !strncasecmp(str, get_compress_str(modes[i]), len))
+			opt->compress_mode = modes[i];
+	}
+
+	if (opt->compress_mode == -1 || !compress_available(opt->compress_mode)) {
+		fprintf(stderr, "Unsupported compression '%s'. Use --help get more info.\n", str);
+		exit(0);
+	}
+
+	opt->compress_level = level ? atoi(level + 1) : get_compress_default_level(opt->compress_mode);
+	if (!compress_level_valid(opt->compress_mode, opt->compress_level)) {
+		fprintf(stderr, "Bad compression level '%s'. Use --help get more info.\n", str);
+		exit(0);
+	}
+}
+#endif
+#endif
+#endif
+
+#ifndef CHKIMG
+/// parse [MODE[:SIZE]] for --discard, exit on error
+static void parse_discard(const char *str, cmd_opt *opt) {
+
+	const char *size = str ? strchr(str, ':') : NULL;
+	size_t len = str ? (size ? (size_t)(size - str) : strlen(str)) : 0;
+
+	opt->discard = DISCARD_TRIM;
+	if (len == 4 && !strncasecmp(str, "zero", len))
+		opt->discard = DISCARD_ZERO;
+	else if (len && (len != 4 || strncasecmp(str, "trim", len)))
+		opt->discard = 0;
+
+	if (size)
+		opt->discard_min = parse_size(size + 1);
+
+	if (!opt->discard || (size && !opt->discard_min)) {
+		fprintf(stderr, "Bad discard mode '%s'. Use --help get more info.\n", str);
+		exit(0);
+	}
+}
+#endif
+
+/// parse a size with an optional K, M or G suffix (powers of 1024)
+unsigned long long parse_size(const char *str) {
+
+	char *end = NULL;
+	unsigned long long size = strtoull(str, &end, 0);
+
+	switch (end ? *end : '\0') {
+	case 'g': case 'G':
+		size *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		size *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		size *= 1024;
+	}
+
+	return size;
+}
+
 const char *exec_name = "unset_name";
 
 const char* get_exec_name() {
@@ -319,6 +589,8 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	static const char *sopt = "-hvd::L:o:O:s:f:CFINiqWBz:E:n:Tt";
 #elif DD
 	static const char *sopt = "-hvd::L:o:O:s:f:CFINiqWBz:E:n:Tt";
+#elif CONVERT
+	static const char *sopt = "-hvd::L:x:o:O:s:f:CFINiqBz:a:k:n:";
 #else
 	static const char *sopt = "-hvd::L:cx:brDo:O:s:f:RCFINiqWBz:E:a:k:Kn:Tt";
 #endif
@@ -345,6 +617,11 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "compresscmd",	required_argument,	NULL,	'x' },
 		{ "restore",		no_argument,		NULL,   'r' },
 		{ "dev-to-dev",		no_argument,		NULL,   'b' },
+		{ "image-version",	required_argument,	NULL,   OPT_IMAGE_VERSION },
+		{ "compress",		required_argument,	NULL,   OPT_COMPRESS },
+		{ "skip-zero",		no_argument,		NULL,   OPT_SKIP_ZERO },
+		{ "base",		required_argument,	NULL,   OPT_BASE },
+		{ "split-size",		required_argument,	NULL,   OPT_SPLIT_SIZE },
 #endif
 		{ "domain",		no_argument,		NULL,   'D' },
 		{ "offset_domain",	required_argument,	NULL,   OPT_OFFSET_DOMAIN },
@@ -352,7 +629,14 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "checksum-mode",       required_argument, NULL, 'a' },
 		{ "blocks-per-checksum", required_argument, NULL, 'k' },
 		{ "no-reseed",           no_argument,       NULL, 'K' },
+		{ "io-depth",		required_argument,	NULL,   OPT_IO_DEPTH },
 #endif
+#endif
+		{ "threads",		required_argument,	NULL,   OPT_THREADS },
+		{ "mem-limit",		required_argument,	NULL,   OPT_MEM_LIMIT },
+#if defined(RESTORE) || defined(CHKIMG) || !defined(DD)
+		{ "chunk-store",	required_argument,	NULL,   OPT_CHUNK_STORE },
+		{ "split-dir",		required_argument,	NULL,   OPT_SPLIT_DIR },
 #endif
 // not CHKIMG
 #ifndef CHKIMG
@@ -365,6 +649,13 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		{ "offset",		required_argument,	NULL,   'E' },
 		{ "btfiles",		no_argument,		NULL,   'T' },
 		{ "btfiles_torrent",	no_argument,		NULL,   't' },
+		{ "direct-io",		no_argument,		NULL,   OPT_DIRECT_IO },
+		{ "discard",		optional_argument,	NULL,   OPT_DISCARD },
+		{ "sparse",		no_argument,		NULL,   OPT_SPARSE },
+		{ "checkpoint",		required_argument,	NULL,   OPT_CHECKPOINT },
+		{ "checkpoint-interval",	required_argument,	NULL,   OPT_CHECKPOINT_INTERVAL },
+		{ "resume",		no_argument,		NULL,   OPT_RESUME },
+		{ "parallel",		no_argument,		NULL,   OPT_PARALLEL },
 #endif
 #ifdef HAVE_LIBNCURSESW
 		{ "ncurses",		no_argument,		NULL,   'N' },
@@ -393,6 +684,27 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	opt->reseed_checksum = 1;
 	opt->blocks_per_checksum = 0;
 	opt->blockfile = 0;
+	opt->threads = 0;
+	opt->mem_limit = DEFAULT_MEM_LIMIT;
+	opt->io_depth = 0;
+	opt->image_version = 0;
+	opt->compress_mode = CMP_NONE;
+	opt->skip_zero = 0;
+	opt->chunk_store = NULL;
+	opt->base = NULL;
+	opt->base_count = 0;
+	opt->split_size = 0;
+	opt->split_dir = NULL;
+	opt->split_dir_count = 0;
+	opt->targets = NULL;
+	opt->target_count = 0;
+	opt->discard = 0;
+	opt->discard_min = DEFAULT_DISCARD_MIN;
+	opt->sparse = 0;
+	opt->checkpoint = NULL;
+	opt->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+	opt->resume = 0;
+	opt->parallel = 0;
 
 
 #ifdef DD
@@ -413,6 +725,11 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	opt->chkimg++;
 	mode=1;
 #endif
+#ifdef CONVERT
+	opt->restore++;
+	opt->convert++;
+	mode=1;
+#endif
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -473,6 +790,30 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 				opt->dd++;
 				mode=1;
 				break;
+			case OPT_IMAGE_VERSION:
+                assert(optarg != NULL);
+				opt->image_version = atol(optarg);
+				break;
+			case OPT_COMPRESS:
+                assert(optarg != NULL);
+				parse_compress(optarg, opt);
+				break;
+			case OPT_SKIP_ZERO:
+				opt->skip_zero = 1;
+				break;
+			case OPT_BASE:
+                assert(optarg != NULL);
+				opt->base = realloc(opt->base, (opt->base_count + 1) * sizeof(char*));
+				if (opt->base == NULL) {
+					fprintf(stderr, "Not enough memory for --base.\n");
+					exit(1);
+				}
+				opt->base[opt->base_count++] = optarg;
+				break;
+			case OPT_SPLIT_SIZE:
+                assert(optarg != NULL);
+				opt->split_size = parse_size(optarg);
+				break;
 #endif
 			case 'D':
 				opt->domain++;
@@ -496,13 +837,46 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 			case 'K':
 				opt->reseed_checksum = 0;
 				break;
+			case OPT_IO_DEPTH:
+                assert(optarg != NULL);
+				opt->io_depth = atol(optarg);
+				break;
 #endif
+#endif
+			case OPT_THREADS:
+                assert(optarg != NULL);
+				opt->threads = atol(optarg);
+				break;
+			case OPT_MEM_LIMIT:
+                assert(optarg != NULL);
+				opt->mem_limit = parse_size(optarg);
+				break;
+#if defined(RESTORE) || defined(CHKIMG) || !defined(DD)
+			case OPT_CHUNK_STORE:
+                assert(optarg != NULL);
+				opt->chunk_store = optarg;
+				break;
+			case OPT_SPLIT_DIR:
+                assert(optarg != NULL);
+				opt->split_dir = realloc(opt->split_dir, (opt->split_dir_count + 1) * sizeof(char*));
+				if (opt->split_dir == NULL) {
+					fprintf(stderr, "Not enough memory for --split-dir.\n");
+					exit(1);
+				}
+				opt->split_dir[opt->split_dir_count++] = optarg;
+				break;
 #endif
 #ifndef CHKIMG
 			case 'O':
 				opt->overwrite++;
 			case 'o':
-				opt->target = optarg;
+				opt->targets = realloc(opt->targets, (opt->target_count + 1) * sizeof(char*));
+				if (opt->targets == NULL) {
+					fprintf(stderr, "Not enough memory for the targets.\n");
+					exit(1);
+				}
+				opt->targets[opt->target_count++] = optarg;
+				opt->target = opt->targets[0];
 				break;
 			case 'W':
 				opt->restore_raw_file = 1;
@@ -527,6 +901,29 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
                 assert(optarg != NULL);
 				opt->offset = (off_t)atol(optarg);
 				break;
+			case OPT_DIRECT_IO:
+				opt->direct_io = 1;
+				break;
+			case OPT_DISCARD:
+				parse_discard(optarg, opt);
+				break;
+			case OPT_SPARSE:
+				opt->sparse = 1;
+				break;
+			case OPT_CHECKPOINT:
+                assert(optarg != NULL);
+				opt->checkpoint = optarg;
+				break;
+			case OPT_CHECKPOINT_INTERVAL:
+                assert(optarg != NULL);
+				opt->checkpoint_interval = atol(optarg);
+				break;
+			case OPT_RESUME:
+				opt->resume = 1;
+				break;
+			case OPT_PARALLEL:
+				opt->parallel = 1;
+				break;
 #endif
 #ifdef HAVE_LIBNCURSESW
 			case 'N':
@@ -547,6 +944,15 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		opt->debug = 0;
 	}
 
+	/// the source is restored into a clone, the options of the clone apply to the new image
+	if (opt->convert && (opt->clone || opt->dd || opt->domain || opt->base_count || opt->target_count > 1 ||
+	    opt->restore_raw_file || opt->blockfile || opt->offset || opt->io_depth || opt->direct_io || !opt->reseed_checksum)) {
+		fprintf(stderr, "partclone.convert writes one image, it cannot be used with --clone, --dev-to-dev, --domain,\n"
+			"--base, --restore_raw_file, --btfiles, --offset, --io-depth, --direct-io, --no-reseed or several targets.\n"
+			"Use --help to get more info.\n");
+		exit(0);
+	}
+
 	// fix conflict option for dev-to-dev
 	if (opt->dd != 0 || opt->domain != 0) {
 	    opt->checksum_mode = CSM_NONE;
@@ -570,6 +976,41 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 		exit(0);
 	}
 
+	if (opt->image_version && opt->image_version != 2 && opt->image_version != 3) {
+		fprintf(stderr, "Unsupported image version %d. Use --help get more info.\n", opt->image_version);
+		exit(0);
+	}
+
+	/// frames are only in image 0003, they need independent checksums
+	if (opt->compress_mode != CMP_NONE || opt->skip_zero) {
+		if (opt->image_version == 2 || !opt->reseed_checksum || opt->blockfile) {
+			fprintf(stderr, "Compression and --skip-zero need the image version 3 and cannot be used with --no-reseed or --btfiles.\n"
+				"Use --help to get more info.\n");
+			exit(0);
+		}
+		opt->image_version = 3;
+	}
+
+	/// the chunks replace the data, they are checked by their ids
+	if (opt->chunk_store && opt->clone) {
+		if (opt->image_version == 2 || opt->compress_mode != CMP_NONE || opt->skip_zero || opt->blockfile) {
+			fprintf(stderr, "--chunk-store needs the image version 3 and cannot be used with --compress, --skip-zero or --btfiles.\n"
+				"Use --help to get more info.\n");
+			exit(0);
+		}
+		opt->image_version = 3;
+	}
+
+	/// the base images are compared through their checksums
+	if (opt->base_count) {
+		if (!opt->clone || opt->image_version == 2 || opt->chunk_store || opt->blockfile) {
+			fprintf(stderr, "--base clones to an image version 3 and cannot be used with --chunk-store or --btfiles.\n"
+				"Use --help to get more info.\n");
+			exit(0);
+		}
+		opt->image_version = 3;
+	}
+
 	if (opt->offset_domain < 0) {
 		fprintf(stderr, "Too small or bad offset of domain file. Use --help get more info.\n");
 		exit(0);
@@ -578,6 +1019,64 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	if (!opt->target)
 		opt->target = "-";
 
+	/// the segments are files, the pipe to them is internal
+	if (opt->split_size) {
+		if (!strcmp(opt->target, "-") || opt->compresscmd || opt->blockfile) {
+			fprintf(stderr, "--split-size writes files, it cannot be used with stdout, --compresscmd or --btfiles.\n"
+				"Use --help to get more info.\n");
+			exit(0);
+		}
+	} else if (opt->split_dir_count && opt->clone) {
+		fprintf(stderr, "--split-dir needs --split-size when cloning.\n"
+			"Use --help to get more info.\n");
+		exit(0);
+	}
+
+	/// the image is read once and written to every target
+	if (opt->target_count > 1) {
+		int i;
+
+		if (!opt->restore || opt->blockfile) {
+			fprintf(stderr, "Several targets can only be restored to, and not with --btfiles.\n"
+				"Use --help to get more info.\n");
+			exit(0);
+		}
+		for (i = 0; i < opt->target_count; i++) {
+			if (!strcmp(opt->targets[i], "-")) {
+				fprintf(stderr, "Partclone can't restore to stdout.\nFor help,type: %s -h\n", get_exec_name());
+				exit(0);
+			}
+		}
+	}
+
+	/// the free extents are known from the bitmap of the image
+	if ((opt->discard || opt->sparse) && (!opt->restore || opt->convert || opt->blockfile)) {
+		fprintf(stderr, "--discard and --sparse only apply to a restore to devices or files, not with --btfiles.\n"
+			"Use --help to get more info.\n");
+		exit(0);
+	}
+
+	/// the checkpoint is the state of the clone or restore loop
+	if ((opt->checkpoint || opt->resume) && ((!opt->restore && !opt->clone) || opt->convert || opt->blockfile || !opt->checkpoint)) {
+		fprintf(stderr, "--checkpoint only applies to a clone or a restore to devices or files, not with --btfiles,\n"
+			"--resume needs it. Use --help to get more info.\n");
+		exit(0);
+	}
+
+	/// a clone goes on from an offset of the image file
+	if (opt->checkpoint && opt->clone && (opt->compresscmd || opt->split_size || opt->chunk_store)) {
+		fprintf(stderr, "--checkpoint clones to a single image file, it cannot be used with --compresscmd,\n"
+			"--split-size or --chunk-store. Use --help to get more info.\n");
+		exit(0);
+	}
+
+	/// the workers write their ranges with pwrite(), the blocks out of order
+	if (opt->parallel && (!opt->restore || opt->convert || opt->blockfile || opt->checkpoint || opt->target_count > 1)) {
+		fprintf(stderr, "--parallel restores to a single device or file, it cannot be used with --btfiles or --checkpoint.\n"
+			"Use --help to get more info.\n");
+		exit(0);
+	}
+
 	if (!opt->source)
 		opt->source = "-";
 
@@ -607,7 +1106,7 @@ void parse_options(int argc, char **argv, cmd_opt* opt) {
 	}
 
 #ifndef CHKIMG
-	if (opt->restore) {
+	if (opt->restore && !opt->convert) {
 		if ((!strcmp(opt->target, "-")) || (!opt->target)) {
 			fprintf(stderr, "Partclone can't restore to stdout.\nFor help,type: %s -h\n", get_exec_name());
 			exit(0);
@@ -910,9 +1409,34 @@ void load_image_desc_v2(file_system_info* fs_info, image_options* img_opt,
 		log_mesg(0, 1, 1, opt->debug, "The image have been created from an incompatible architecture\n");
 
 	memcpy(fs_info, &fs_info_v2, sizeof(file_system_info_v2));
+	memset(img_opt, 0, sizeof(image_options));
 	memcpy(img_opt, &img_opt_v2, sizeof(image_options_v2));
 }
 
+void load_image_desc_v3(file_system_info* fs_info, image_options* img_opt,
+		const image_head_v2 img_hdr_v3, const file_system_info_v2 fs_info_v3, const image_options_v3 img_opt_v3, cmd_opt* opt) {
+
+	log_mesg(1, 0, 0, opt->debug, "Image created with Partclone v%s\n", img_hdr_v3.ptc_version);
+
+	if (img_hdr_v3.endianess != ENDIAN_MAGIC)
+		log_mesg(0, 1, 1, opt->debug, "The image have been created from an incompatible architecture\n");
+
+	if (img_opt_v3.features & ~IMG_FEATURES_SUPPORTED)
+		log_mesg(0, 1, 1, opt->debug, "The image uses unsupported features [0x%08X]\n", img_opt_v3.features);
+
+	memcpy(fs_info, &fs_info_v3, sizeof(file_system_info_v2));
+	memcpy(img_opt, &img_opt_v3, sizeof(image_options_v3));
+}
+
+/// size of the image description on disk, crc included
+static unsigned long long get_image_desc_size(const image_options* img_opt) {
+
+	if (img_opt->image_version == 0x0001)
+		return sizeof(image_desc_v1);
+
+	return sizeof(image_head_v2) + sizeof(file_system_info_v2) + img_opt->feature_size + CRC32_SIZE;
+}
+
 /**
  * load the image description from the image file
  *
@@ -965,6 +1489,44 @@ void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_syste
 		break;
 	}
 
+	case 0x0003: {
+		const uint32_t feature_size = buf_v2.options.feature_size;
+		unsigned long long desc_size;
+		image_options_v3 options;
+		uint32_t crc, r_crc;
+		char *desc;
+
+		// options may have grown since this version of partclone
+		if (feature_size < IMAGE_OPTIONS_V3_MIN_SIZE || feature_size > IMAGE_EXTRA_MAX_SIZE)
+			log_mesg(0, 1, 1, debug, "Invalid image options size [%u]\n", feature_size);
+
+		desc_size = sizeof(image_head_v2) + sizeof(file_system_info_v2) + feature_size + CRC32_SIZE;
+		desc = (char*)malloc(desc_size);
+		if (desc == NULL)
+			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+		// read the extra bytes
+		memcpy(desc, &buf_v2, sizeof(buf_v2));
+		if (read_all(ret, desc + sizeof(buf_v2), desc_size - sizeof(buf_v2), opt) != desc_size - sizeof(buf_v2))
+			log_mesg(0, 1, 1, debug, "read image_hdr error (%s)\n", strerror(errno));
+
+		// Verify checksum
+		init_crc32(&crc);
+		crc = crc32(crc, desc, desc_size - CRC32_SIZE);
+		memcpy(&r_crc, desc + desc_size - CRC32_SIZE, CRC32_SIZE);
+		if (crc != r_crc)
+			log_mesg(0, 1, 1, debug, "Invalid header checksum [0x%08X != 0x%08X]\n", crc, r_crc);
+
+		memset(&options, 0, sizeof(options));
+		memcpy(&options, desc + offsetof(image_desc_v3, options),
+			feature_size < sizeof(options) ? feature_size : sizeof(options));
+		free(desc);
+
+		load_image_desc_v3(fs_info, img_opt, buf_v2.head, buf_v2.fs_info, options, opt);
+		memcpy(img_head, &(buf_v2.head), sizeof(image_head_v2));
+		break;
+	}
+
 	default: {
 
 		char version[IMAGE_VERSION_SIZE+1] = { 0x00 };
@@ -979,17 +1541,23 @@ void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_syste
 
 void write_image_desc(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt) {
 
-	image_desc_v2 buf_v2;
+	image_desc_v3 buf;
+	unsigned long long desc_size = get_image_desc_size(&img_opt);
+	uint32_t crc;
 
-	init_image_head_v2(&buf_v2.head);
+	/// image 0002 has the same layout with shorter options, the crc follows them
+	init_image_head_v2(&buf.head);
+	if (img_opt.image_version == 0x0003)
+		memcpy(buf.head.version, IMAGE_VERSION_0003, IMAGE_VERSION_SIZE);
 
-	memcpy(&buf_v2.fs_info, &fs_info, sizeof(file_system_info));
-	memcpy(&buf_v2.options, &img_opt, sizeof(image_options));
+	memcpy(&buf.fs_info, &fs_info, sizeof(file_system_info));
+	memcpy(&buf.options, &img_opt, img_opt.feature_size);
 
-	init_crc32(&buf_v2.crc);
-	buf_v2.crc = crc32(buf_v2.crc, &buf_v2, sizeof(image_desc_v2) - CRC32_SIZE);
+	init_crc32(&crc);
+	crc = crc32(crc, &buf, desc_size - CRC32_SIZE);
+	memcpy((char*)&buf + desc_size - CRC32_SIZE, &crc, CRC32_SIZE);
 
-	if (write_all(ret, (char*)&buf_v2, sizeof(image_desc_v2), opt) != sizeof(image_desc_v2))
+	if (write_all(ret, (char*)&buf, desc_size, opt) != desc_size)
 		log_mesg(0, 1, 1, opt->debug, "error writing image header to image: %s\n", strerror(errno));
 }
 
@@ -1025,6 +1593,27 @@ void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_op
 		break;
 	}
 
+	case BM_EXTENT:
+	{
+		unsigned char *runs = malloc(img_opt.bitmap_size ? img_opt.bitmap_size : 1);
+		uint32_t crc;
+
+		if (runs == NULL)
+			log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+		if (encode_bitmap_extents(bitmap, fs_info.totalblock, runs) != img_opt.bitmap_size)
+			log_mesg(0, 1, 1, debug, "ERROR: the bitmap changed since its size was computed\n");
+
+		/// the crc covers the runs, a reader never has to expand the bitmap to check it
+		init_crc32(&crc);
+		crc = crc32(crc, runs, img_opt.bitmap_size);
+		if (write_all(ret, (char*)runs, img_opt.bitmap_size, opt) != img_opt.bitmap_size
+		    || write_all(ret, (char*)&crc, sizeof(crc), opt) != sizeof(crc))
+			log_mesg(0, 1, 1, debug, "write bitmap to image error: %s\n", strerror(errno));
+
+		free(runs);
+		break;
+	}
+
 	case BM_NONE:
 	{
 		// All blocks MUST be present
@@ -1038,7 +1627,7 @@ void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_op
 		break;
 	}
 
-	if (img_opt.bitmap_mode != BM_NONE) {
+	if (img_opt.bitmap_mode != BM_NONE && img_opt.bitmap_mode != BM_EXTENT) {
 
 		switch (img_opt.image_version) {
 
@@ -1047,7 +1636,8 @@ void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_op
 				log_mesg(0, 1, 1, debug, "write bitmap to image error: %s\n", strerror(errno));
 			break;
 
-		case 0x0002: {
+		case 0x0002:
+		case 0x0003: {
 
 			uint32_t crc;
 
@@ -1069,6 +1659,417 @@ void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_op
 	}
 }
 
+/// offset of the first data block in the image
+unsigned long long get_image_data_offset(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	unsigned long long offset = get_image_desc_size(img_opt) + get_bitmap_size_on_disk(fs_info, img_opt, opt);
+
+	if (img_opt->bitmap_mode != BM_NONE)
+		offset += img_opt->image_version == 0x0001 ? BIT_MAGIC_SIZE : CRC32_SIZE;
+
+	return offset;
+}
+
+/// used blocks covered by one offset entry, whole checksum chunks or one frame
+static uint32_t get_index_offset_interval(const image_options* img_opt) {
+
+	uint32_t blocks_per_cs = img_opt->blocks_per_checksum;
+
+	if (img_opt->features & IMG_FEATURES_FRAMED)
+		return img_opt->blocks_per_frame;
+
+	if (blocks_per_cs == 0)
+		return IMAGE_INDEX_OFFSET_INTERVAL;
+
+	return (IMAGE_INDEX_OFFSET_INTERVAL + blocks_per_cs - 1) / blocks_per_cs * blocks_per_cs;
+}
+
+/// bytes taken by used blocks and their checksums, the last chunk can be partial
+static unsigned long long get_image_data_size(unsigned long long used, const file_system_info* fs_info, const image_options* img_opt) {
+
+	unsigned long long size = used * fs_info->block_size;
+
+	if (img_opt->blocks_per_checksum)
+		size += (used + img_opt->blocks_per_checksum - 1) / img_opt->blocks_per_checksum * img_opt->checksum_size;
+
+	return size;
+}
+
+unsigned int get_frame_head_size(const image_options* img_opt) {
+
+	if (img_opt->features & IMG_FEATURE_ZEROMAP)
+		return FRAME_HEAD_SIZE + (img_opt->blocks_per_frame + 7) / 8;
+
+	return FRAME_HEAD_SIZE;
+}
+
+unsigned long long get_frame_raw_size(unsigned long long first, unsigned long long used_blocks, const file_system_info* fs_info, const image_options* img_opt) {
+
+	unsigned long long blocks = used_blocks - first;
+
+	if (blocks > img_opt->blocks_per_frame)
+		blocks = img_opt->blocks_per_frame;
+
+	return get_image_data_size(blocks, fs_info, img_opt);
+}
+
+unsigned long long get_image_index_size(const file_system_info* fs_info, const image_options* img_opt) {
+
+	unsigned long long rank_count, offset_count;
+
+	if (!(img_opt->features & IMG_FEATURE_INDEX))
+		return 0;
+
+	rank_count = (fs_info->totalblock + IMAGE_INDEX_RANK_INTERVAL - 1) / IMAGE_INDEX_RANK_INTERVAL;
+	offset_count = (fs_info->usedblocks + get_index_offset_interval(img_opt) - 1) / get_index_offset_interval(img_opt);
+
+	return sizeof(image_index_head) + (rank_count + offset_count) * sizeof(uint64_t) + CRC32_SIZE
+		+ sizeof(image_footer_stats) + sizeof(image_footer_v3);
+}
+
+/**
+ * The index only depends on the bitmap and the image options, so it can be
+ * built before the data is written, even when the image goes to a pipe.
+ * Frames are the exception: their offsets and data_size are left to the
+ * writer.
+ */
+void build_image_index(image_index* index, const unsigned long* bitmap, const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	const unsigned long long total = fs_info->totalblock;
+	const unsigned long long words_per_rank = IMAGE_INDEX_RANK_INTERVAL / PART_BITS_PER_LONG;
+	unsigned long long i, used = 0, block;
+	uint32_t interval = get_index_offset_interval(img_opt);
+
+	memset(index, 0, sizeof(image_index));
+	memcpy(index->head.magic, IMAGE_INDEX_MAGIC, IMAGE_INDEX_MAGIC_SIZE);
+	index->head.rank_interval = IMAGE_INDEX_RANK_INTERVAL;
+	index->head.offset_interval = interval;
+	index->head.rank_count = (total + IMAGE_INDEX_RANK_INTERVAL - 1) / IMAGE_INDEX_RANK_INTERVAL;
+	index->used_blocks = pc_count_bits(bitmap, total);
+	index->head.offset_count = (index->used_blocks + interval - 1) / interval;
+	index->data_offset = get_image_data_offset(fs_info, img_opt, opt);
+
+	index->rank = (uint64_t*)malloc((index->head.rank_count + 1) * sizeof(uint64_t));
+	index->offset = (uint64_t*)malloc((index->head.offset_count + 1) * sizeof(uint64_t));
+	if (index->rank == NULL || index->offset == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	for (i = 0; i < index->head.rank_count; i++) {
+		unsigned long long start = i * IMAGE_INDEX_RANK_INTERVAL;
+		unsigned long long count = total - start > IMAGE_INDEX_RANK_INTERVAL ? IMAGE_INDEX_RANK_INTERVAL : total - start;
+
+		index->rank[i] = used;
+		used += pc_count_bits(bitmap + i * words_per_rank, count);
+	}
+
+	/// intervals hold whole checksum chunks, each entry starts right after a checksum
+	for (i = 0; i < index->head.offset_count; i++)
+		index->offset[i] = index->data_offset + get_image_data_size(i * interval, fs_info, img_opt);
+	index->data_size = get_image_data_size(index->used_blocks, fs_info, img_opt);
+
+	if (img_opt->features & IMG_FEATURES_FRAMED) {
+		memset(index->offset, 0, index->head.offset_count * sizeof(uint64_t));
+		index->data_size = 0;
+	}
+
+	for (block = pc_find_next_set(bitmap, 0, total); block < total; block = pc_find_next_set(bitmap, block, total)) {
+		unsigned long long end = pc_find_next_zero(bitmap, block, total);
+
+		index->stats.extent_count++;
+		if (end - block > index->stats.largest_extent)
+			index->stats.largest_extent = end - block;
+		block = end;
+	}
+
+	log_mesg(1, 0, 0, opt->debug, "image index: %llu ranks, %llu offsets every %u used blocks\n",
+		(unsigned long long)index->head.rank_count, (unsigned long long)index->head.offset_count, interval);
+}
+
+void write_image_index(int* ret, const image_index* index, const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	const unsigned long long rank_size = index->head.rank_count * sizeof(uint64_t);
+	const unsigned long long offset_size = index->head.offset_count * sizeof(uint64_t);
+	image_footer_stats stats = index->stats;
+	image_footer_v3 footer;
+	uint32_t crc;
+
+	init_crc32(&crc);
+	crc = crc32(crc, (void*)&index->head, sizeof(image_index_head));
+	crc = crc32(crc, index->rank, rank_size);
+	crc = crc32(crc, index->offset, offset_size);
+
+	if (write_all(ret, (char*)&index->head, sizeof(image_index_head), opt) != sizeof(image_index_head) ||
+	    write_all(ret, (char*)index->rank, rank_size, opt) != rank_size ||
+	    write_all(ret, (char*)index->offset, offset_size, opt) != offset_size ||
+	    write_all(ret, (char*)&crc, CRC32_SIZE, opt) != CRC32_SIZE)
+		log_mesg(0, 1, 1, opt->debug, "write index to image error: %s\n", strerror(errno));
+
+	memset(&footer, 0, sizeof(footer));
+	footer.index_offset = index->data_offset + index->data_size;
+	footer.index_size = sizeof(image_index_head) + rank_size + offset_size + CRC32_SIZE;
+	footer.footer_size = sizeof(image_footer_stats) + sizeof(image_footer_v3);
+	memcpy(footer.magic, IMAGE_FOOTER_MAGIC, IMAGE_INDEX_MAGIC_SIZE);
+	stats.data_size = index->data_size;
+	init_crc32(&footer.crc);
+	footer.crc = crc32(footer.crc, &stats, sizeof(stats));
+	footer.crc = crc32(footer.crc, &footer, offsetof(image_footer_v3, crc));
+
+	if (write_all(ret, (char*)&stats, sizeof(stats), opt) != sizeof(stats) ||
+	    write_all(ret, (char*)&footer, sizeof(footer), opt) != sizeof(footer))
+		log_mesg(0, 1, 1, opt->debug, "write footer to image error: %s\n", strerror(errno));
+}
+
+static int pread_all(int fd, void* buf, unsigned long long size, unsigned long long offset) {
+
+	unsigned long long done = 0;
+
+	while (done < size) {
+		ssize_t r = pread(fd, (char*)buf + done, size - done, offset + done);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+
+	return 0;
+}
+
+/**
+ * Read the footer at the end of a seekable image without moving the file
+ * offset, and the statistics in front of it when footer_size covers them.
+ * Return footer_size, or 0 when the image has no valid footer.
+ */
+static uint32_t read_image_footer(int fd, off_t* end, image_footer_v3* footer, image_footer_stats* stats, int debug) {
+
+	off_t pos;
+	uint32_t footer_size, crc;
+	char tail[2 * sizeof(uint32_t) + IMAGE_INDEX_MAGIC_SIZE];
+	char *buf;
+
+	memset(stats, 0, sizeof(image_footer_stats));
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	*end = lseek(fd, 0, SEEK_END);
+	if (pos == (off_t)-1 || *end == (off_t)-1 || lseek(fd, pos, SEEK_SET) == (off_t)-1)
+		return 0;
+
+	/// footer_size, crc and magic are always the last bytes of the image
+	if (*end < (off_t)sizeof(image_footer_v3) || pread_all(fd, tail, sizeof(tail), *end - sizeof(tail))) {
+		log_mesg(0, 0, 1, debug, "image index: unable to read the footer\n");
+		return 0;
+	}
+	memcpy(&footer_size, tail, sizeof(footer_size));
+	if (memcmp(tail + 2 * sizeof(uint32_t), IMAGE_FOOTER_MAGIC, IMAGE_INDEX_MAGIC_SIZE) ||
+	    footer_size < sizeof(image_footer_v3) || footer_size > (unsigned long long)*end || footer_size > IMAGE_EXTRA_MAX_SIZE) {
+		log_mesg(0, 0, 1, debug, "image index: footer not found\n");
+		return 0;
+	}
+
+	buf = (char*)malloc(footer_size);
+	if (buf == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	if (pread_all(fd, buf, footer_size, *end - footer_size)) {
+		free(buf);
+		log_mesg(0, 0, 1, debug, "image index: unable to read the footer\n");
+		return 0;
+	}
+
+	/// fields added by newer versions are in front of the ones known here
+	init_crc32(&crc);
+	crc = crc32(crc, buf, footer_size - sizeof(image_footer_v3) + offsetof(image_footer_v3, crc));
+	memcpy(footer, buf + footer_size - sizeof(image_footer_v3), sizeof(image_footer_v3));
+	if (footer_size >= sizeof(image_footer_stats) + sizeof(image_footer_v3))
+		memcpy(stats, buf + footer_size - sizeof(image_footer_v3) - sizeof(image_footer_stats), sizeof(image_footer_stats));
+	free(buf);
+	if (crc != footer->crc) {
+		log_mesg(0, 0, 1, debug, "image index: invalid footer checksum [0x%08X != 0x%08X]\n", crc, footer->crc);
+		return 0;
+	}
+
+	return footer_size;
+}
+
+int load_image_stats(int fd, image_footer_stats* stats, const image_options* img_opt, cmd_opt* opt) {
+
+	image_footer_v3 footer;
+	off_t end;
+	uint32_t footer_size;
+
+	if (!(img_opt->features & IMG_FEATURE_INDEX))
+		return -1;
+
+	footer_size = read_image_footer(fd, &end, &footer, stats, opt->debug);
+	if (footer_size < sizeof(image_footer_stats) + sizeof(image_footer_v3) ||
+	    stats->digest_size > IMAGE_DIGEST_SIZE)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Read the index from the footer of a seekable image without moving the
+ * file offset. Return 0 when the index is loaded, -1 when the image has no
+ * usable index and the caller must count the bitmap instead. In both cases
+ * image_index_rank() and image_index_offset() can be used afterwards.
+ */
+int load_image_index(int fd, image_index* index, const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt) {
+
+	const int debug = opt->debug;
+	image_footer_v3 footer;
+	off_t end;
+	uint32_t footer_size, crc, r_crc;
+	unsigned long long rank_size, offset_size;
+
+	memset(index, 0, sizeof(image_index));
+	index->data_offset = get_image_data_offset(fs_info, img_opt, opt);
+	index->used_blocks = fs_info->used_bitmap;
+
+	if (!(img_opt->features & IMG_FEATURE_INDEX))
+		return -1;
+
+	footer_size = read_image_footer(fd, &end, &footer, &index->stats, debug);
+	if (footer_size == 0)
+		return -1;
+
+	if (footer.index_offset < index->data_offset ||
+	    footer.index_offset + footer.index_size > (unsigned long long)end - footer_size ||
+	    footer.index_size < sizeof(image_index_head) + CRC32_SIZE ||
+	    pread_all(fd, &index->head, sizeof(image_index_head), footer.index_offset) ||
+	    memcmp(index->head.magic, IMAGE_INDEX_MAGIC, IMAGE_INDEX_MAGIC_SIZE)) {
+		log_mesg(0, 0, 1, debug, "image index: index not found\n");
+		return -1;
+	}
+
+	rank_size = index->head.rank_count * sizeof(uint64_t);
+	offset_size = index->head.offset_count * sizeof(uint64_t);
+	if (index->head.rank_interval == 0 || index->head.rank_interval % PART_BITS_PER_LONG ||
+	    index->head.offset_interval == 0 ||
+	    index->head.rank_count != (fs_info->totalblock + index->head.rank_interval - 1) / index->head.rank_interval ||
+	    index->head.offset_count > footer.index_size / sizeof(uint64_t) ||
+	    footer.index_size != sizeof(image_index_head) + rank_size + offset_size + CRC32_SIZE) {
+		log_mesg(0, 0, 1, debug, "image index: invalid index size\n");
+		return -1;
+	}
+
+	index->rank = (uint64_t*)malloc(rank_size + sizeof(uint64_t));
+	index->offset = (uint64_t*)malloc(offset_size + sizeof(uint64_t));
+	if (index->rank == NULL || index->offset == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	if (pread_all(fd, index->rank, rank_size, footer.index_offset + sizeof(image_index_head)) ||
+	    pread_all(fd, index->offset, offset_size, footer.index_offset + sizeof(image_index_head) + rank_size) ||
+	    pread_all(fd, &r_crc, CRC32_SIZE, footer.index_offset + footer.index_size - CRC32_SIZE)) {
+		free_image_index(index);
+		log_mesg(0, 0, 1, debug, "image index: unable to read the index\n");
+		return -1;
+	}
+
+	init_crc32(&crc);
+	crc = crc32(crc, &index->head, sizeof(image_index_head));
+	crc = crc32(crc, index->rank, rank_size);
+	crc = crc32(crc, index->offset, offset_size);
+	if (crc != r_crc) {
+		free_image_index(index);
+		log_mesg(0, 0, 1, debug, "image index: invalid index checksum [0x%08X != 0x%08X]\n", crc, r_crc);
+		return -1;
+	}
+
+	index->data_size = footer.index_offset - index->data_offset;
+
+	return 0;
+}
+
+void free_image_index(image_index* index) {
+
+	free(index->rank);
+	free(index->offset);
+	index->rank = NULL;
+	index->offset = NULL;
+}
+
+/// the blocks are not hashed with the same key as the digest pieces
+static const unsigned char block_key[BLAKE3_KEY_LEN] = "partclone image digest 0001    ";
+
+void image_digest_init(image_digest* digest) {
+
+	blake3_init();
+	memset(digest->value, 0, IMAGE_DIGEST_SIZE);
+	digest->size = 0;
+}
+
+void image_digest_update(image_digest* digest, const void* buf, unsigned long long size) {
+
+	const char *p = (const char*)buf;
+
+	while (size) {
+		unsigned int n = IMAGE_DIGEST_CHUNK - digest->size;
+
+		if (n > size)
+			n = size;
+		memcpy(digest->buf + digest->size, p, n);
+		digest->size += n;
+		p += n;
+		size -= n;
+
+		if (digest->size == IMAGE_DIGEST_CHUNK) {
+			unsigned char key[IMAGE_DIGEST_SIZE];
+
+			memcpy(key, digest->value, IMAGE_DIGEST_SIZE);
+			blake3_keyed(key, digest->buf, IMAGE_DIGEST_CHUNK, digest->value);
+			digest->size = 0;
+		}
+	}
+}
+
+/// the last piece is hashed even when empty, so that a multiple of the chunk has its own value
+void image_digest_final(image_digest* digest, unsigned char out[IMAGE_DIGEST_SIZE]) {
+
+	blake3_keyed(digest->value, digest->buf, digest->size, out);
+}
+
+void image_digest_blocks(const char* buf, unsigned long long blocks, unsigned int block_size, unsigned char* out) {
+
+	unsigned long long i;
+
+	for (i = 0; i < blocks; i++)
+		blake3_keyed(block_key, buf + i * block_size, block_size, out + i * IMAGE_DIGEST_SIZE);
+}
+
+/// number of used blocks before block, the rank gives the count up to the last boundary
+unsigned long long image_index_rank(const image_index* index, const unsigned long* bitmap, unsigned long long block) {
+
+	unsigned long long i, start;
+
+	if (index->rank == NULL)
+		return pc_count_bits(bitmap, block);
+
+	i = block / index->head.rank_interval;
+	if (i >= index->head.rank_count)
+		i = index->head.rank_count - 1;
+	start = i * index->head.rank_interval;
+
+	return index->rank[i] + pc_count_bits(bitmap + start / PART_BITS_PER_LONG, block - start);
+}
+
+/// image offset of the used block number used
+unsigned long long image_index_offset(const image_index* index, const file_system_info* fs_info, const image_options* img_opt, unsigned long long used) {
+
+	unsigned long long i, base = index->data_offset;
+
+	if (index->offset != NULL && index->head.offset_count) {
+		i = used / index->head.offset_interval;
+		if (i >= index->head.offset_count)
+			i = index->head.offset_count - 1;
+		base = index->offset[i];
+		used -= i * index->head.offset_interval;
+	}
+
+	return base + used * fs_info->block_size
+		+ (img_opt->blocks_per_checksum ? used / img_opt->blocks_per_checksum * img_opt->checksum_size : 0);
+}
+
 const char *get_bitmap_mode_str(bitmap_mode_t bitmap_mode)
 {
 	switch (bitmap_mode)
@@ -1082,6 +2083,9 @@ const char *get_bitmap_mode_str(bitmap_mode_t bitmap_mode)
 	case BM_BYTE:
 		return "BYTE";
 
+	case BM_EXTENT:
+		return "EXTENT";
+
 	default:
 		return "UNKNOWN";
 	}
@@ -1213,15 +2217,7 @@ unsigned long get_checksum_count(unsigned long long block_count, const image_opt
 
 void update_used_blocks_count(file_system_info* fs_info, unsigned long* bitmap) {
 
-	unsigned long long used = 0;
-	unsigned int i;
-
-	for(i = 0; i < fs_info->totalblock; ++i) {
-		if (pc_test_bit(i, bitmap, fs_info->totalblock))
-			++used;
-	}
-
-	fs_info->used_bitmap = used;
+	fs_info->used_bitmap = pc_count_bits(bitmap, fs_info->totalblock);
 }
 
 
@@ -1239,6 +2235,10 @@ unsigned long long get_bitmap_size_on_disk(const file_system_info* fs_info, cons
 		size = fs_info->totalblock;
 		break;
 
+	case BM_EXTENT:
+		size = img_opt->bitmap_size;
+		break;
+
 	case BM_NONE:
 		size = 0;
 		break;
@@ -1369,6 +2369,57 @@ void load_image_bitmap_bits(int* ret, cmd_opt opt, file_system_info fs_info, uns
 		log_mesg(0, 1, 1, opt.debug, "read bitmap's crc error\n");
 }
 
+/// expand the runs of a BM_EXTENT bitmap as they are read
+static void load_image_bitmap_extents(int* ret, cmd_opt opt, file_system_info fs_info, image_options img_opt, unsigned long* bitmap) {
+
+	const unsigned long long total = fs_info.totalblock;
+	unsigned long long left = img_opt.bitmap_size, nr = 0, run = 0;
+	unsigned char buffer[16384];
+	unsigned int shift = 0;
+	int used = 0;
+	uint32_t r_crc, crc;
+
+	pc_init_bitmap(bitmap, 0, total);
+	init_crc32(&crc);
+
+	while (left) {
+		unsigned long long i, r_need = left > sizeof(buffer) ? sizeof(buffer) : left;
+
+		if (read_all(ret, (char*)buffer, r_need, &opt) != r_need)
+			log_mesg(0, 1, 1, opt.debug, "unable to read bitmap.\n");
+		crc = crc32(crc, buffer, r_need);
+
+		for (i = 0; i < r_need; i++) {
+			if (shift > 63)
+				log_mesg(0, 1, 1, opt.debug, "bitmap run too long\n");
+			run |= (unsigned long long)(buffer[i] & 0x7F) << shift;
+			shift += 7;
+			if (buffer[i] & 0x80)
+				continue;
+
+			if (run > total - nr) {
+				log_mesg(0, 1, 1, opt.debug, "bitmap runs beyond the last block\n");
+				run = total - nr;
+			}
+			if (used)
+				pc_set_bits(bitmap, nr, run);
+			nr += run;
+			used = !used;
+			run = 0;
+			shift = 0;
+		}
+		left -= r_need;
+	}
+
+	if (nr != total || shift)
+		log_mesg(0, 1, 1, opt.debug, "bitmap runs end at block %llu of %llu\n", nr, total);
+
+	if (read_all(ret, (char*)&r_crc, sizeof(r_crc), &opt) != sizeof(r_crc))
+		log_mesg(0, 1, 1, opt.debug, "read bitmap's crc error\n");
+	if (crc != r_crc)
+		log_mesg(0, 1, 1, opt.debug, "read bitmap's crc error\n");
+}
+
 void load_image_bitmap_bytes(int* ret, cmd_opt opt, file_system_info fs_info, unsigned long* bitmap) {
 
 	unsigned long long size, r_size, r_need;
@@ -1430,6 +2481,10 @@ void load_image_bitmap(int* ret, cmd_opt opt, file_system_info fs_info, image_op
 		load_image_bitmap_bytes(ret, opt, fs_info, bitmap);
 		break;
 
+	case BM_EXTENT:
+		load_image_bitmap_extents(ret, opt, fs_info, img_opt, bitmap);
+		break;
+
 	case BM_NONE:
 		// All blocks are present
 		pc_init_bitmap(bitmap, 0xFF, fs_info.totalblock);
@@ -1498,6 +2553,23 @@ int check_mount(const char* device, char* mount_p){
 	return isMounted;
 }
 
+/**
+ * open with O_DIRECT for --direct-io, or without it when the file system
+ * does not support direct I/O.
+ */
+static int open_direct(const char *path, int flags, mode_t mode, cmd_opt *opt) {
+	int ret;
+
+	ret = open(path, flags | O_DIRECT, mode);
+	if (ret == -1 && errno == EINVAL) {
+		log_mesg(0, 0, 1, opt->debug, "%s does not support direct I/O, use the page cache\n", path);
+		ret = open(path, flags, mode);
+	} else if (ret != -1)
+		log_mesg(1, 0, 0, opt->debug, "open %s with O_DIRECT\n", path);
+
+	return ret;
+}
+
 int open_source(char* source, cmd_opt* opt) {
 	int ret = 0;
 	int debug = opt->debug;
@@ -1532,7 +2604,11 @@ int open_source(char* source, cmd_opt* opt) {
 		}
 		if (mp){ free(mp); mp = NULL;}
 
-		if ((ret = open(source, flags, S_IRUSR)) == -1)
+		if (opt->direct_io && (opt->clone || opt->dd))
+			ret = open_direct(source, flags, S_IRUSR, opt);
+		else
+			ret = open(source, flags, S_IRUSR);
+		if (ret == -1)
 			log_mesg(0, 1, 1, debug, "clone: open %s error\n", source);
 
 	} else if ((opt->restore) || (ddd_block_device == 0)) {
@@ -1540,6 +2616,8 @@ int open_source(char* source, cmd_opt* opt) {
 		if (strcmp(source, "-") == 0) {
 			if ((ret = fileno(stdin)) == -1)
 				log_mesg(0, 1, 1, debug, "restore: open %s(stdin) error\n", source);
+		} else if (opt->restore && split_is_segment(source)) {
+			ret = split_open_source(source, opt);
 		} else {
 			if ((ret = open (source, flags, S_IRWXU)) == -1)
 				log_mesg(0, 1, 1, debug, "restore: open %s error\n", source);
@@ -1577,8 +2655,10 @@ int open_target(char* target, cmd_opt* opt) {
 	    ddd_block_device = 0;
 	}
 
-	if ((opt->clone || opt->domain || (ddd_block_device == 0)) && (opt->blockfile == 0)) {
-		if (opt->compresscmd) {
+	if ((opt->clone || opt->convert || opt->domain || (ddd_block_device == 0)) && (opt->blockfile == 0)) {
+		if (opt->split_size && (opt->clone || opt->convert)) {
+			ret = split_open_target(target, opt);
+		} else if (opt->compresscmd) {
 			int strsz = strlen(opt->compresscmd) + strlen(target) + 4;
 			char *compresscmd = malloc(strsz);
 
@@ -1591,8 +2671,9 @@ int open_target(char* target, cmd_opt* opt) {
 			if ((ret = fileno(stdout)) == -1)
 				log_mesg(0, 1, 1, debug, "clone: open %s(stdout) error\n", target);
 		} else {
-			flags |= O_CREAT | O_TRUNC;
-			if (!opt->overwrite)
+			/// a resumed restore goes on in the file it left
+			flags |= O_CREAT | (opt->resume ? 0 : O_TRUNC);
+			if (!opt->overwrite && !opt->resume)
 				flags |= O_EXCL;
 			if ((ret = open(target, flags, S_IRUSR|S_IWUSR)) == -1) {
 				if (errno == EEXIST) {
@@ -1627,7 +2708,11 @@ int open_target(char* target, cmd_opt* opt) {
 				flags |= O_EXCL;
 		}
 
-		if ((ret = open (target, flags, S_IRUSR)) == -1) {
+		if (opt->direct_io && (opt->restore || opt->dd))
+			ret = open_direct(target, flags, S_IRUSR, opt);
+		else
+			ret = open(target, flags, S_IRUSR);
+		if (ret == -1) {
 			if (errno == EEXIST) {
 				log_mesg(0, 0, 1, debug, "Output file '%s' already exists.\n"
 					"Use option --overwrite if you want to replace its content.\n", target);
@@ -1657,7 +2742,7 @@ int close_target(int dfw) {
 	if (compress_pipe)
 		ret = pclose(compress_pipe);
 	else
-		ret = close(dfw);
+		ret = split_close(dfw);
 	compress_pipe = NULL;
 	return ret;
 }
@@ -1706,6 +2791,7 @@ int io_all(int *fd, char *buf, unsigned long long count, int do_write, cmd_opt*
 	long long int i;
 	int debug = opt->debug;
 	unsigned long long size = count;
+	int buffered = 0;
 	extern unsigned long long rescue_write_size;
 
 	// for sync I/O buffer, when use stdin or pipe.
@@ -1716,14 +2802,24 @@ int io_all(int *fd, char *buf, unsigned long long count, int do_write, cmd_opt*
 			i = read(*fd, buf, count);
                 }
 		if (i < 0) {
+			/// unaligned transfer on an O_DIRECT descriptor, like the tail block
+			if (errno == EINVAL && opt->direct_io && !buffered && set_direct_io(*fd, 0)) {
+				log_mesg(2, 0, 0, debug, "%s: unaligned direct I/O, use the page cache\n", __func__);
+				buffered = 1;
+				continue;
+			}
 			log_mesg(1, 0, 1, debug, "%s: errno = %i(%s)\n",__func__, errno, strerror(errno));
 			if (errno != EAGAIN && errno != EINTR) {
+				if (buffered)
+					set_direct_io(*fd, 1);
 				return -1;
 			}
 		} else if (i == 0) {
 			log_mesg(1, 0, 1, debug, "%s: nothing to read. errno = %i(%s)\n",__func__, errno, strerror(errno));
 			rescue_write_size = size - count;
 			log_mesg(1, 0, 0, debug, "%s: rescue write size = %llu\n",__func__, rescue_write_size);
+			if (buffered)
+				set_direct_io(*fd, 1);
 			return 0;
 		} else {
 			count -= i;
@@ -1732,9 +2828,157 @@ int io_all(int *fd, char *buf, unsigned long long count, int do_write, cmd_opt*
 				__func__, do_write ? "write" : "read", i, count);
 		}
 	}
+	if (buffered)
+		set_direct_io(*fd, 1);
 	return size;
 }
 
+/**
+ * io_all() for a list of buffers. The iovec array is used as scratch space
+ * and is left modified. Return the number of bytes transferred, less than
+ * requested at the end of the input, or -1 on error.
+ */
+long long iov_all(int *fd, struct iovec *iov, int iovcnt, int do_write, cmd_opt *opt) {
+	long long done = 0;
+	ssize_t i;
+	int debug = opt->debug;
+
+	while (iovcnt > 0) {
+		int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+		if (do_write)
+			i = writev(*fd, iov, cnt);
+		else
+			i = readv(*fd, iov, cnt);
+		if (i < 0) {
+			log_mesg(1, 0, 1, debug, "%s: errno = %i(%s)\n",__func__, errno, strerror(errno));
+			if (errno != EAGAIN && errno != EINTR)
+				return -1;
+			continue;
+		} else if (i == 0) {
+			log_mesg(1, 0, 1, debug, "%s: nothing to read. errno = %i(%s)\n",__func__, errno, strerror(errno));
+			return done;
+		}
+
+		done += i;
+		log_mesg(2, 0, 0, debug, "%s: %s %zi\n", __func__, do_write ? "write" : "read", i);
+
+		/// skip the buffers done, and what is done of the next one
+		while (iovcnt > 0 && (size_t)i >= iov->iov_len) {
+			i -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + i;
+			iov->iov_len -= i;
+		}
+	}
+	return done;
+}
+
+/**
+ * Write the iovcnt buffers of iov at offset with pwritev(), leaving the file
+ * offset alone. The iovec array is left modified. Unaligned transfers on an
+ * O_DIRECT descriptor go through buffered_fd, the same file opened without
+ * O_DIRECT. When it is -1 O_DIRECT is turned off on fd for the time of the
+ * call, as in io_all(), which is only safe when no other thread uses fd.
+ * Return 0, or -1 with errno.
+ */
+int pwritev_all(int fd, int buffered_fd, struct iovec *iov, int iovcnt, off_t offset, cmd_opt *opt) {
+	int buffered = 0;
+
+	while (iovcnt > 0) {
+		ssize_t i = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+
+		if (i == -1 && errno == EINTR)
+			continue;
+		if (i == -1 && errno == EINVAL && opt->direct_io && fd != buffered_fd && buffered_fd != -1) {
+			log_mesg(2, 0, 0, opt->debug, "%s: unaligned direct I/O, use the page cache\n", __func__);
+			fd = buffered_fd;
+			continue;
+		}
+		if (i == -1 && errno == EINVAL && opt->direct_io && !buffered && buffered_fd == -1 && set_direct_io(fd, 0)) {
+			log_mesg(2, 0, 0, opt->debug, "%s: unaligned direct I/O, use the page cache\n", __func__);
+			buffered = 1;
+			continue;
+		}
+		if (i <= 0) {
+			if (i == 0)
+				errno = ENOSPC;
+			if (buffered)
+				set_direct_io(fd, 1);
+			return -1;
+		}
+
+		offset += i;
+		while (iovcnt > 0 && (size_t)i >= iov->iov_len) {
+			i -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + i;
+			iov->iov_len -= i;
+		}
+	}
+	if (buffered)
+		set_direct_io(fd, 1);
+
+	return 0;
+}
+
+/**
+ * turn O_DIRECT on or off on fd, return 1 when the flag changed
+ */
+int set_direct_io(int fd, int on) {
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || !!(flags & O_DIRECT) == !!on)
+		return 0;
+
+	flags = on ? flags | O_DIRECT : flags & ~O_DIRECT;
+	return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+/**
+ * O_DIRECT needs the buffers, the sizes and the file offsets aligned on the
+ * logical sector size. The buffers come from alloc_io_buffer(), check the
+ * block size and the offset of the device side here and fall back to the
+ * page cache when they do not fit.
+ */
+void check_direct_io(int fd, unsigned int block_size, off_t offset, cmd_opt *opt) {
+	int flags = fcntl(fd, F_GETFL);
+	int sector_size = PART_SECTOR_SIZE;
+	struct stat st;
+
+	if (flags == -1 || !(flags & O_DIRECT))
+		return;
+
+	if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+#ifdef BLKSSZGET
+		if (ioctl(fd, BLKSSZGET, &sector_size) < 0)
+			sector_size = PART_SECTOR_SIZE;
+#endif
+	}
+
+	if (sector_size > DIRECT_IO_ALIGN || block_size % sector_size || offset % sector_size) {
+		log_mesg(0, 0, 1, opt->debug, "direct I/O needs %i bytes alignment (block size %u, offset %lli), use the page cache\n",
+			sector_size, block_size, (long long)offset);
+		set_direct_io(fd, 0);
+	} else
+		log_mesg(1, 0, 0, opt->debug, "direct I/O with %i bytes sectors\n", sector_size);
+}
+
+/// buffer usable for direct I/O
+char *alloc_io_buffer(unsigned long long size) {
+	void *buf;
+
+	if (posix_memalign(&buf, DIRECT_IO_ALIGN, size ? size : DIRECT_IO_ALIGN))
+		return NULL;
+	return (char *)buf;
+}
+
 void sync_data(int fd, cmd_opt* opt) {
 	log_mesg(0, 0, 1, opt->debug, "Syncing... ");
 	if (fsync(fd) && errno != EINVAL)
@@ -1791,6 +3035,10 @@ void print_opt(cmd_opt opt) {
 	log_mesg(1, 0, 0, debug, "CHECKSUM: %s\n", get_checksum_str(opt.checksum_mode));
 	log_mesg(1, 0, 0, debug, "CS SIZE: %u\n", get_checksum_size(opt.checksum_mode, debug));
 	log_mesg(1, 0, 0, debug, "BLOCKS/CS: %lu\n", opt.blocks_per_checksum);
+	log_mesg(1, 0, 0, debug, "THREADS: %u\n", opt.threads);
+	log_mesg(1, 0, 0, debug, "MEM LIMIT: %llu\n", opt.mem_limit);
+	log_mesg(1, 0, 0, debug, "IO DEPTH: %u\n", opt.io_depth);
+	log_mesg(1, 0, 0, debug, "DIRECT IO: %i\n", opt.direct_io);
 	opt.note[NOTE_SIZE-1] = '\0';
 	log_mesg(1, 0, 0, debug, "NOTE: %s\n", opt.note);
 }
@@ -1910,6 +3158,55 @@ void print_image_info(image_head_v2 img_head, image_options img_opt, cmd_opt opt
 
 		log_mesg(0, 0, 1, debug, _("reseed checksum: %s\n"), img_opt.reseed_checksum?_("yes"):_("no"));
 	}
+
+	if (img_opt.image_version >= 0x0003) {
+		log_mesg(0, 0, 1, debug, _("image index:     %s\n"), (img_opt.features & IMG_FEATURE_INDEX)?_("yes"):_("no"));
+
+		if (img_opt.features & IMG_FEATURE_COMPRESS) {
+			sprintf(bufstr, _("%s level %d, %u blocks/frame"), get_compress_str(img_opt.compress_mode),
+				img_opt.compress_level, img_opt.blocks_per_frame);
+			log_mesg(0, 0, 1, debug, _("compression:     %s\n"), bufstr);
+		} else
+			log_mesg(0, 0, 1, debug, _("compression:     %s\n"), get_compress_str(CMP_NONE));
+
+		log_mesg(0, 0, 1, debug, _("zero map:        %s\n"), (img_opt.features & IMG_FEATURE_ZEROMAP)?_("yes"):_("no"));
+
+		if (img_opt.features & IMG_FEATURE_CHUNKSTORE) {
+			sprintf(bufstr, _("yes, %u blocks/chunk"), img_opt.chunk_blocks);
+			log_mesg(0, 0, 1, debug, _("chunk store:     %s\n"), bufstr);
+		} else
+			log_mesg(0, 0, 1, debug, _("chunk store:     %s\n"), _("no"));
+
+		log_mesg(0, 0, 1, debug, _("delta image:     %s\n"), (img_opt.features & IMG_FEATURE_DELTA)?_("yes, restore it over its base"):_("no"));
+	}
+}
+
+/// print the statistics of the image footer
+void print_image_stats(const image_footer_stats* stats, cmd_opt opt) {
+
+	int debug = opt.debug;
+	char bufstr[2 * IMAGE_DIGEST_SIZE + 1];
+	unsigned int i;
+
+	setlocale(LC_ALL, "");
+	bindtextdomain(PACKAGE, LOCALEDIR);
+	textdomain(PACKAGE);
+
+	log_mesg(0, 0, 1, debug, _("extents:         %llu, the largest %llu blocks\n"),
+		(unsigned long long)stats->extent_count, (unsigned long long)stats->largest_extent);
+
+	print_readable_size_str(stats->data_size, bufstr);
+	log_mesg(0, 0, 1, debug, _("image data:      %s = %llu Byte\n"), bufstr, (unsigned long long)stats->data_size);
+
+	log_mesg(0, 0, 1, debug, _("clone time:      %llu.%03llu s\n"),
+		(unsigned long long)stats->clone_time / 1000, (unsigned long long)stats->clone_time % 1000);
+
+	if (stats->digest_size) {
+		for (i = 0; i < stats->digest_size && i < IMAGE_DIGEST_SIZE; i++)
+			sprintf(bufstr + 2 * i, "%02x", stats->digest[i]);
+		log_mesg(0, 0, 1, debug, _("image digest:    %s\n"), bufstr);
+	} else
+		log_mesg(0, 0, 1, debug, _("image digest:    %s\n"), "n/a");
 }
 
 /// print finish message
@@ -1922,6 +3219,8 @@ void print_finish_info(cmd_opt opt) {
 	textdomain(PACKAGE);
 	if (opt.chkimg)
 		log_mesg(0, 0, 1, debug, _("Partclone successfully checked the image (%s)\n"), opt.source);
+	else if (opt.convert)
+		log_mesg(0, 0, 1, debug, _("Partclone successfully converted the image (%s) to the image (%s)\n"), opt.source, opt.target);
 	else if (opt.clone)
 		log_mesg(0, 0, 1, debug, _("Partclone successfully cloned the device (%s) to the image (%s)\n"), opt.source, opt.target);
 	else if (opt.restore)
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <malloc.h>
@@ -52,10 +53,14 @@
 #define IMAGE_VERSION_SIZE 4
 #define IMAGE_VERSION_0001 "0001"
 #define IMAGE_VERSION_0002 "0002"
+#define IMAGE_VERSION_0003 "0003"
 #define IMAGE_VERSION_CURRENT IMAGE_VERSION_0002
 #define PARTCLONE_VERSION_SIZE (FS_MAGIC_SIZE-1)
 #define DEFAULT_BUFFER_SIZE 1048576
+#define DEFAULT_MEM_LIMIT (64ULL * 1024 * 1024)
+#define DEFAULT_DISCARD_MIN (1024ULL * 1024)
 #define PART_SECTOR_SIZE 512
+#define DIRECT_IO_ALIGN 4096
 #define CRC32_SIZE 4
 #define NOTE_SIZE 128
 
@@ -68,12 +73,18 @@
 // define read and write
 #define read_all(f, b, s, o) io_all((f), (b), (s), 0, (o))
 #define write_all(f, b, s, o) io_all((f), (b), (s), 1, (o))
+#define readv_all(f, v, c, o) iov_all((f), (v), (c), 0, (o))
+#define writev_all(f, v, c, o) iov_all((f), (v), (c), 1, (o))
 
 // progress flag
 #define BITMAP 1
 #define IO 2
 #define NO_BLOCK_DETAIL 3
 
+/// --discard modes
+#define DISCARD_TRIM 1
+#define DISCARD_ZERO 2
+
 const char* get_exec_name();
 
 #ifdef crc32
@@ -97,6 +108,7 @@ struct cmd_opt
     int ddd;
     int domain;
     int chkimg;
+    int convert;	/// restore of an image into a clone to another one
     int info;
     int debug;
     char* source;
@@ -125,6 +137,30 @@ struct cmd_opt
     int checksum_mode;
     int reseed_checksum;
     unsigned long blocks_per_checksum;
+
+    unsigned int threads;
+    unsigned long long mem_limit;
+    unsigned int io_depth;
+    int direct_io;
+    int image_version;
+    int compress_mode;
+    int compress_level;
+    int skip_zero;
+    char* chunk_store;
+    char** base;
+    int base_count;
+    unsigned long long split_size;
+    char** split_dir;
+    int split_dir_count;
+    char** targets;
+    int target_count;
+    int discard;		/// DISCARD_TRIM or DISCARD_ZERO the unused blocks of the targets
+    unsigned long long discard_min;
+    int sparse;		/// do not preallocate the used blocks of a file target
+    char* checkpoint;	/// restore state journal
+    unsigned int checkpoint_interval;
+    int resume;
+    int parallel;	/// restore ranges of a seekable image on --threads workers
 };
 typedef struct cmd_opt cmd_opt;
 
@@ -194,11 +230,18 @@ typedef struct
 
 } image_options_v1;
 
+/**
+ * BM_EXTENT, image 0003 only, stores the bitmap as the lengths of its runs
+ * of free and used blocks, alternately and starting with a free one, each
+ * one an unsigned LEB128 varint. The runs cover all the blocks and take
+ * image_options_v3.bitmap_size bytes, followed by the crc32 of these bytes.
+ */
 typedef enum
 {
-	BM_NONE = 0x00,
-	BM_BIT  = 0x01,
-	BM_BYTE = 0x08,
+	BM_NONE   = 0x00,
+	BM_BIT    = 0x01,
+	BM_EXTENT = 0x02,
+	BM_BYTE   = 0x08,
 
 } bitmap_mode_t;
 
@@ -230,6 +273,109 @@ typedef struct
 
 } image_options_v2;
 
+/// optional parts of an image 0003, recorded in image_options_v3.features
+typedef enum
+{
+	/// an index and a footer follow the data, see image_index_head
+	IMG_FEATURE_INDEX = 0x00000001,
+
+	/// the data is stored in compressed frames, see FRAME_STORED
+	IMG_FEATURE_COMPRESS = 0x00000002,
+
+	/// all-zero blocks are left out of the frames, see FRAME_HEAD_SIZE
+	IMG_FEATURE_ZEROMAP = 0x00000004,
+
+	/// the data is a list of chunk ids, the chunks are in a chunk store
+	IMG_FEATURE_CHUNKSTORE = 0x00000008,
+
+	/// the bitmap only holds the blocks changed since the base images, see delta.h
+	IMG_FEATURE_DELTA = 0x00000010,
+
+} image_feature_t;
+
+/// features this partclone knows how to read
+#define IMG_FEATURES_SUPPORTED (IMG_FEATURE_INDEX | IMG_FEATURE_COMPRESS | IMG_FEATURE_ZEROMAP | IMG_FEATURE_CHUNKSTORE \
+	| IMG_FEATURE_DELTA)
+
+/// features which store the data as a list of frames
+#define IMG_FEATURES_FRAMED (IMG_FEATURE_COMPRESS | IMG_FEATURE_ZEROMAP)
+
+/**
+ * With IMG_FEATURES_FRAMED, the data is a list of frames. A frame holds
+ * blocks_per_frame used blocks, less for the last one, with their checksums
+ * laid out as in an uncompressed image. On disk it is a uint32_t header
+ * followed by the payload: the header is the payload size, with FRAME_STORED
+ * set when the payload is not compressed because it would not shrink.
+ *
+ * With IMG_FEATURE_ZEROMAP the header is followed by the zero map of the
+ * frame, one bit per used block and (blocks_per_frame + 7) / 8 bytes, and
+ * the blocks whose bit is set are all zeros and left out of the payload.
+ * Their checksums still cover them.
+ *
+ * With IMG_FEATURE_CHUNKSTORE the image is a manifest: the device is cut in
+ * ranges of chunk_blocks blocks, and the used blocks of each range holding
+ * any are one chunk. The data is the CHUNK_ID_SIZE bytes id of each chunk,
+ * in device order, and the chunks are in the chunk store (see chunkstore.h).
+ * The image has no checksum, the chunk ids are checked instead.
+ *
+ * An image with IMG_FEATURE_DELTA is laid out as any other, but its bitmap
+ * only holds the used blocks whose data changed since its base images, and
+ * used_bitmap and usedblocks count these blocks. It is restored over a
+ * device holding its restored base.
+ */
+#define FRAME_STORED 0x80000000U
+#define FRAME_SIZE_MASK 0x7FFFFFFFU
+#define FRAME_HEAD_SIZE 4
+
+typedef struct
+{
+	/// Number of bytes used by this struct, newer images may store more
+	uint32_t feature_size;
+
+	/// version of the image
+	uint16_t image_version;
+
+	/// partclone's compilation architecture: 32 bits or 64 bits
+	uint16_t cpu_bits;
+
+	/// checksum algorithm used (see checksum_mode_enum)
+	uint16_t checksum_mode;
+
+	/// Size of one checksum, in bytes. 0 when NONE, 4 with CRC32, etc.
+	uint16_t checksum_size;
+
+	/// How many consecutive blocks are checksumed together.
+	uint32_t blocks_per_checksum;
+
+	/// Reseed the checksum after each write (1 = yes; 0 = no)
+	uint8_t reseed_checksum;
+
+	/// Kind of bitmap stored in the image (see bitmap_mode_enum)
+	uint8_t bitmap_mode;
+
+	/// Optional parts of the image (see image_feature_t)
+	uint32_t features;
+
+	/// Compression of the data frames (see compress_mode_enum)
+	uint16_t compress_mode;
+
+	/// Compression level used to create the image, for information
+	uint16_t compress_level;
+
+	/// How many used blocks are compressed together, a multiple of blocks_per_checksum
+	uint32_t blocks_per_frame;
+
+	/// How many blocks of the device one chunk covers, with IMG_FEATURE_CHUNKSTORE
+	uint32_t chunk_blocks;
+
+	/// Size of the bitmap on disk in bytes, with BM_EXTENT
+	uint64_t bitmap_size;
+
+} image_options_v3;
+
+/// image_options_v3 of the first images 0003, the following fields are zero
+#define IMAGE_OPTIONS_V3_MIN_SIZE (sizeof(image_options_v2) + sizeof(uint32_t))
+
 /// image format 0001 description
 typedef struct
 {
@@ -248,19 +394,147 @@ typedef struct
 
 } image_desc_v2;
 
+/// image format 0003 description, options can be longer in newer images (see feature_size)
+typedef struct
+{
+	image_head_v2       head;
+	file_system_info_v2 fs_info;
+	image_options_v3    options;
+	uint32_t            crc;
+
+} image_desc_v3;
+
+#define IMAGE_INDEX_MAGIC "PTCINDEX"
+#define IMAGE_FOOTER_MAGIC "PTCFOOTR"
+#define IMAGE_INDEX_MAGIC_SIZE 8
+
+/// upper limit for the options and the footer of images written by newer versions
+#define IMAGE_EXTRA_MAX_SIZE 4096
+
+/// blocks of the bitmap covered by one rank entry
+#define IMAGE_INDEX_RANK_INTERVAL 4096
+/// minimum number of used blocks covered by one offset entry
+#define IMAGE_INDEX_OFFSET_INTERVAL 1024
+
+/**
+ * Index written after the data of an image with IMG_FEATURE_INDEX:
+ *   image_index_head
+ *   uint64_t rank[rank_count]      used blocks before block i * rank_interval
+ *   uint64_t offset[offset_count]  image offset of the used block i * offset_interval
+ *   uint32_t crc                   of the head and both tables
+ */
+typedef struct
+{
+	char magic[IMAGE_INDEX_MAGIC_SIZE];
+
+	/// Number of blocks of the bitmap covered by one rank entry
+	uint32_t rank_interval;
+
+	/// Number of used blocks covered by one offset entry, a multiple of blocks_per_checksum
+	uint32_t offset_interval;
+
+	uint64_t rank_count;
+	uint64_t offset_count;
+
+} image_index_head;
+
+#define IMAGE_DIGEST_SIZE 32
+
+/**
+ * Statistics of the data written by clone right in front of image_footer_v3,
+ * so that partclone.info does not have to read the bitmap. The footer_size
+ * of the footer covers both and its crc covers the statistics too.
+ */
+typedef struct
+{
+	/// Runs of used blocks and the longest one, in blocks
+	uint64_t extent_count;
+	uint64_t largest_extent;
+
+	/// Bytes between the bitmap and the index, checksums and frame headers included
+	uint64_t data_size;
+
+	/// Time taken by clone, in milliseconds
+	uint64_t clone_time;
+
+	/// Bytes of digest in use, IMAGE_DIGEST_SIZE
+	uint32_t digest_size;
+	uint32_t reserved;
+
+	/// Digest of the data of the used blocks, see image_digest
+	unsigned char digest[IMAGE_DIGEST_SIZE];
+
+} image_footer_stats;
+
+/**
+ * Last bytes of an image with IMG_FEATURE_INDEX. New fields go in front so
+ * that a reader can always find footer_size and the magic at the end of the file.
+ */
+typedef struct
+{
+	/// Offset and size of the index, crc included
+	uint64_t index_offset;
+	uint64_t index_size;
+
+	/// Number of bytes used by this struct
+	uint32_t footer_size;
+
+	/// crc32 of the previous fields
+	uint32_t crc;
+
+	char magic[IMAGE_INDEX_MAGIC_SIZE];
+
+} image_footer_v3;
+
 #pragma pack(pop)
 
 // Use these typedefs when a function handles the current version and use the
 // "versioned" typedefs when a function handles a specific version.
 typedef image_head_v2       image_head;
 typedef file_system_info_v2 file_system_info;
-typedef image_options_v2    image_options;
+typedef image_options_v3    image_options;
 
 extern image_options img_opt;
 
+/// image index loaded in memory, see image_index_head
+typedef struct
+{
+	image_index_head head;
+	uint64_t *rank;
+	uint64_t *offset;
+
+	/// image offset of the first block, number of used blocks and size of the data, not stored
+	unsigned long long data_offset;
+	unsigned long long used_blocks;
+	unsigned long long data_size;
+
+	/// written in front of the footer, data_size is taken from above
+	image_footer_stats stats;
+
+} image_index;
+
+/// bytes of block hashes hashed at once, the digest does not depend on the writes
+#define IMAGE_DIGEST_CHUNK 65536
+
+/**
+ * Digest of the data of a whole image: every used block is hashed on its own,
+ * see image_digest_blocks, and the block hashes are hashed in device order.
+ * BLAKE3 of IMAGE_DIGEST_CHUNK bytes keyed with the previous value, the
+ * last piece may be shorter. The same data give the same digest whatever
+ * the checksum, compression or chunk store of the image.
+ */
+typedef struct
+{
+	unsigned char value[IMAGE_DIGEST_SIZE];
+	unsigned int size;
+	char buf[IMAGE_DIGEST_CHUNK];
+
+} image_digest;
+
 extern void usage(void);
 extern void print_version(void);
 extern void parse_options(int argc, char **argv, cmd_opt* opt);
+extern unsigned long long parse_size(const char *str);
 
 /** 
  * Ncurses Text User Interface
@@ -283,6 +557,11 @@ extern void close_log();
 extern int io_all(int *fd, char *buffer, unsigned long long count, int do_write, cmd_opt *opt);
 extern void sync_data(int fd, cmd_opt* opt);
 extern void rescue_sector(int *fd, unsigned long long pos, char *buff, cmd_opt *opt);
+extern long long iov_all(int *fd, struct iovec *iov, int iovcnt, int do_write, cmd_opt *opt);
+extern int pwritev_all(int fd, int buffered_fd, struct iovec *iov, int iovcnt, off_t offset, cmd_opt *opt);
+extern int set_direct_io(int fd, int on);
+extern void check_direct_io(int fd, unsigned int block_size, off_t offset, cmd_opt *opt);
+extern char *alloc_io_buffer(unsigned long long size);
 
 extern unsigned long long cnv_blocks_to_bytes(unsigned long long block_offset, unsigned int block_count, unsigned int block_size, const image_options* img_opt);
 extern unsigned long long get_bitmap_size_on_disk(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
@@ -291,11 +570,41 @@ extern void update_used_blocks_count(file_system_info* fs_info, unsigned long* b
 
 extern void init_fs_info(file_system_info* fs_info);
 extern void init_image_options(image_options* img_opt);
+extern void set_image_options_v3(image_options* img_opt);
+extern void set_image_bitmap_mode(image_options* img_opt, const file_system_info* fs_info, const unsigned long* bitmap);
 extern void load_image_desc(int* ret, cmd_opt* opt, image_head_v2* img_head, file_system_info* fs_info, image_options* img_opt);
 extern void load_image_bitmap(int* ret, cmd_opt opt, file_system_info fs_info, image_options img_opt, unsigned long* bitmap);
 extern void write_image_desc(int* ret, file_system_info fs_info, image_options img_opt, cmd_opt* opt);
 extern void write_image_bitmap(int* ret, file_system_info fs_info, image_options img_opt, unsigned long* bitmap, cmd_opt* opt);
 
+/**
+ * image index
+ * build_image_index	- compute the index of an image from its bitmap
+ * write_image_index	- write the index and the footer after the data
+ * load_image_index	- read the index of a seekable image, 0 when done
+ * image_index_rank	- number of used blocks before a block
+ * image_index_offset	- image offset of a used block
+ */
+extern void build_image_index(image_index* index, const unsigned long* bitmap, const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
+extern void write_image_index(int* ret, const image_index* index, const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
+extern int load_image_index(int fd, image_index* index, const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
+extern void free_image_index(image_index* index);
+/// read the statistics in front of the footer of a seekable image, 0 when found
+extern int load_image_stats(int fd, image_footer_stats* stats, const image_options* img_opt, cmd_opt* opt);
+extern void image_digest_init(image_digest* digest);
+extern void image_digest_update(image_digest* digest, const void* buf, unsigned long long size);
+extern void image_digest_final(image_digest* digest, unsigned char out[IMAGE_DIGEST_SIZE]);
+/// IMAGE_DIGEST_SIZE bytes of out per block of buf, the hashes fed to image_digest_update
+extern void image_digest_blocks(const char* buf, unsigned long long blocks, unsigned int block_size, unsigned char* out);
+extern unsigned long long get_image_index_size(const file_system_info* fs_info, const image_options* img_opt);
+extern unsigned long long get_image_data_offset(const file_system_info* fs_info, const image_options* img_opt, cmd_opt* opt);
+extern unsigned long long image_index_rank(const image_index* index, const unsigned long* bitmap, unsigned long long block);
+extern unsigned long long image_index_offset(const image_index* index, const file_system_info* fs_info, const image_options* img_opt, unsigned long long used);
+/// size of a frame header, with the zero map if any
+extern unsigned int get_frame_head_size(const image_options* img_opt);
+/// size of the frame starting with the used block first, checksums included, before compression
+extern unsigned long long get_frame_raw_size(unsigned long long first, unsigned long long used_blocks, const file_system_info* fs_info, const image_options* img_opt);
+
 extern const char *get_bitmap_mode_str(bitmap_mode_t bitmap_mode);
 
 /**
@@ -337,6 +646,8 @@ extern void print_partclone_info(cmd_opt opt);
 extern void print_file_system_info(file_system_info fs_info, cmd_opt opt);
 /// print image info
 extern void print_image_info(image_head_v2 img_head, image_options img_opt, cmd_opt opt);
+/// print the statistics of the image footer
+extern void print_image_stats(const image_footer_stats* stats, cmd_opt opt);
 /// print option
 extern void print_opt(cmd_opt opt);
 /// print finish mesg
@@ -0,0 +1,206 @@
+/**
+ * pipeline.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * ordered reader / worker / writer pipeline used by main.
+ *
+ * A fixed ring of items is shared by one reader thread, some worker threads
+ * and the writer. The reader fills the items in sequence order, the workers
+ * process them in any order and the writer consumes them in sequence order
+ * again, so the I/O on both sides stays sequential while the work between
+ * them runs on several CPUs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "partclone.h"
+#include "pipeline.h"
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_FILLED,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+unsigned int pipeline_cpu_count(void) {
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 0 ? (unsigned int)cpus : 1;
+}
+
+unsigned int pipeline_slot_count(unsigned long long mem_limit, unsigned long long slot_size, unsigned int workers) {
+
+	unsigned long long slots = slot_size ? mem_limit / slot_size : 0;
+	unsigned int min_slots = workers + PIPELINE_MIN_SLOTS;
+
+	if (slots < min_slots)
+		slots = min_slots;
+	if (slots > PIPELINE_MAX_SLOTS)
+		slots = PIPELINE_MAX_SLOTS;
+
+	return (unsigned int)slots;
+}
+
+static void *pipeline_reader(void *arg) {
+
+	pipeline_t *pl = (pipeline_t *)arg;
+	unsigned long long seq;
+
+	for (seq = 0; ; seq++) {
+		unsigned int i = seq % pl->slots;
+		int more, stop;
+
+		pthread_mutex_lock(&pl->lock);
+		while (pl->state[i] != SLOT_FREE && !pl->stop)
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		stop = pl->stop;
+		pthread_mutex_unlock(&pl->lock);
+
+		if (stop)
+			break;
+
+		more = pl->produce(pl->ctx, pl->items[i], seq);
+
+		pthread_mutex_lock(&pl->lock);
+		if (more) {
+			pl->seq[i] = seq;
+			pl->state[i] = SLOT_FILLED;
+			pl->produced = seq + 1;
+		} else
+			pl->eof = 1;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+
+		if (!more)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *pipeline_worker(void *arg) {
+
+	pipeline_t *pl = (pipeline_t *)arg;
+
+	pthread_mutex_lock(&pl->lock);
+	while (!pl->stop) {
+		unsigned long long best_seq = 0;
+		int best = -1;
+		unsigned int i;
+
+		/// take the oldest item waiting for work, the writer needs it first
+		for (i = 0; i < pl->slots; i++) {
+			if (pl->state[i] == SLOT_FILLED && (best < 0 || pl->seq[i] < best_seq)) {
+				best = i;
+				best_seq = pl->seq[i];
+			}
+		}
+
+		if (best < 0) {
+			if (pl->eof)
+				break;
+			pthread_cond_wait(&pl->cond, &pl->lock);
+			continue;
+		}
+
+		pl->state[best] = SLOT_BUSY;
+		pthread_mutex_unlock(&pl->lock);
+
+		pl->work(pl->ctx, pl->items[best]);
+
+		pthread_mutex_lock(&pl->lock);
+		pl->state[best] = SLOT_DONE;
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+void pipeline_run(pipeline_t *pl) {
+
+	pthread_t reader, workers[PIPELINE_MAX_WORKERS];
+	unsigned long long next;
+	unsigned int w;
+	extern cmd_opt opt;
+	int debug = opt.debug;
+
+	if (pl->workers > PIPELINE_MAX_WORKERS)
+		pl->workers = PIPELINE_MAX_WORKERS;
+	if (pl->slots < PIPELINE_MIN_SLOTS)
+		log_mesg(0, 1, 1, debug, "%s: too few pipeline slots (%u)\n", __func__, pl->slots);
+
+	pl->state = calloc(pl->slots, sizeof(int));
+	pl->seq = calloc(pl->slots, sizeof(unsigned long long));
+	if (pl->state == NULL || pl->seq == NULL)
+		log_mesg(0, 1, 1, debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	pl->produced = 0;
+	pl->eof = 0;
+	pl->stop = 0;
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+
+	log_mesg(1, 0, 0, debug, "pipeline: %u slots, %u workers\n", pl->slots, pl->workers);
+
+	if (pthread_create(&reader, NULL, pipeline_reader, pl))
+		log_mesg(0, 1, 1, debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	for (w = 0; w < pl->workers; w++) {
+		if (pthread_create(&workers[w], NULL, pipeline_worker, pl))
+			log_mesg(0, 1, 1, debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	}
+
+	/// the calling thread is the ordered writer
+	for (next = 0; ; next++) {
+		unsigned int i = next % pl->slots;
+		int ready;
+
+		pthread_mutex_lock(&pl->lock);
+		for (;;) {
+			ready = pl->workers ? pl->state[i] == SLOT_DONE : pl->state[i] == SLOT_FILLED;
+			if (ready || (pl->eof && next >= pl->produced))
+				break;
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		}
+		pthread_mutex_unlock(&pl->lock);
+
+		if (!ready)
+			break;
+
+		if (!pl->workers)
+			pl->work(pl->ctx, pl->items[i]);
+		pl->consume(pl->ctx, pl->items[i]);
+
+		pthread_mutex_lock(&pl->lock);
+		pl->state[i] = SLOT_FREE;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+	}
+
+	pthread_mutex_lock(&pl->lock);
+	pl->stop = 1;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+
+	pthread_join(reader, NULL);
+	for (w = 0; w < pl->workers; w++)
+		pthread_join(workers[w], NULL);
+
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+	free(pl->state);
+	free(pl->seq);
+	pl->state = NULL;
+	pl->seq = NULL;
+}
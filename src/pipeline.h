@@ -0,0 +1,67 @@
+/**
+ * pipeline.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * ordered reader / worker / writer pipeline used by main.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <pthread.h>
+
+#define PIPELINE_MIN_SLOTS 2
+#define PIPELINE_MAX_SLOTS 256
+#define PIPELINE_MAX_WORKERS 64
+
+/**
+ * The stages of a pipeline. Every item goes through the three stages in order:
+ *
+ * produce	- called by the reader thread, in sequence order. Fill the item and
+ *		  return 1, or return 0 when there is nothing left to read.
+ * work		- called by one of the worker threads, in any order. When the
+ *		  pipeline has no worker, it is called by the writer just before consume.
+ * consume	- called by the writer (the calling thread), in sequence order.
+ */
+typedef int  (*pipeline_produce_fn)(void *ctx, void *item, unsigned long long seq);
+typedef void (*pipeline_work_fn)(void *ctx, void *item);
+typedef void (*pipeline_consume_fn)(void *ctx, void *item);
+
+typedef struct
+{
+	void *ctx;
+	void **items;		/// one item per slot, allocated by the caller
+	unsigned int slots;	/// number of items
+	unsigned int workers;	/// number of worker threads, may be 0
+
+	pipeline_produce_fn produce;
+	pipeline_work_fn work;
+	pipeline_consume_fn consume;
+
+	/// private
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int *state;
+	unsigned long long *seq;
+	unsigned long long produced;
+	int eof;
+	int stop;
+
+} pipeline_t;
+
+/// return how many slots of slot_size bytes fit in mem_limit, clamped for workers
+extern unsigned int pipeline_slot_count(unsigned long long mem_limit, unsigned long long slot_size, unsigned int workers);
+
+/// return the number of online CPUs, at least 1
+extern unsigned int pipeline_cpu_count(void);
+
+/// run the pipeline until produce returns 0 and every item has been consumed
+extern void pipeline_run(pipeline_t *pl);
+
+#endif /* PIPELINE_H_ */
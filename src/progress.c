@@ -42,8 +42,9 @@ extern void progress_init(struct progress_bar *prog, int start, unsigned long lo
     prog->start = start;
     prog->stop = stop;
     prog->total = total;
-    prog->unit = 100.0 / (stop - start);
-    prog->total_unit = 100.0 / (total - start);
+    /// nothing to copy, e.g. an empty delta image: no division by zero
+    prog->unit = stop > start ? 100.0 / (stop - start) : 0.0;
+    prog->total_unit = total > start ? 100.0 / (total - start) : 0.0;
     prog->initial_time = time(0);
     prog->resolution_time = time(0);
     prog->interval_time = 1;
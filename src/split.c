@@ -0,0 +1,311 @@
+/**
+ * split->c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * images cut in numbered segments. partclone reads and writes the image
+ * through a pipe, a thread moves the data between the pipe and the segments
+ * with splice(), so that the rest of partclone sees one stream.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "partclone.h"
+#include "split.h"
+
+/// bytes moved by one splice()
+#define SPLIT_CHUNK (1024 * 1024)
+
+typedef struct split_ctx
+{
+	cmd_opt *opt;
+	char **dirs;		/// directory of the image, then the --split-dir ones
+	int dir_count;
+	char *name;		/// file name of the image, without the segment suffix
+	const char *first;	/// path of the first segment when reading
+	int pipe_fd;		/// end of the pipe used by the thread
+	int fd;			/// end of the pipe given to partclone
+	int sync_fd;		/// segment synced by split_sync()
+	char *buffer;		/// copy buffer, when the file system cannot splice()
+	pthread_t thread;
+	struct split_ctx *next;	/// next open context
+
+} split_ctx;
+
+/// one context per fd, convert may read segments and write others at once
+static split_ctx *splits;
+
+/// a new context, dirs and name from the image path without suffix_len bytes at its end
+static split_ctx *split_init(const char *path, size_t suffix_len, cmd_opt *opt) {
+
+	const char *slash = strrchr(path, '/');
+	split_ctx *split;
+	int i;
+
+	split = calloc(1, sizeof(split_ctx));
+	if (split == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	split->opt = opt;
+	split->dir_count = opt->split_dir_count + 1;
+	split->dirs = calloc(split->dir_count, sizeof(char *));
+	if (split->dirs == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	split->dirs[0] = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+	split->name = strndup(slash ? slash + 1 : path, strlen(slash ? slash + 1 : path) - suffix_len);
+	for (i = 1; i < split->dir_count; i++)
+		split->dirs[i] = opt->split_dir[i - 1];
+	if (split->dirs[0] == NULL || split->name == NULL)
+		log_mesg(0, 1, 1, opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+
+	return split;
+}
+
+static void split_free(split_ctx *split) {
+
+	free(split->dirs[0]);
+	free(split->dirs);
+	free(split->name);
+	free(split->buffer);
+	free(split);
+}
+
+static void segment_path(split_ctx *split, unsigned int i, int dir, char *path) {
+
+	snprintf(path, PATH_MAX, "%s/%s.%03u", split->dirs[dir], split->name, i);
+}
+
+/// move up to size bytes, with read() and write() when splice() is not supported
+static ssize_t split_move(split_ctx *split, int in, int out, size_t size) {
+
+	ssize_t n;
+
+	if (split->buffer == NULL) {
+		n = splice(in, NULL, out, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n != -1 || errno != EINVAL)
+			return n;
+
+		log_mesg(1, 0, 0, split->opt->debug, "splice: %s, copy the segments\n", strerror(errno));
+		split->buffer = malloc(SPLIT_CHUNK);
+		if (split->buffer == NULL)
+			log_mesg(0, 1, 1, split->opt->debug, "%s, %i, not enough memory\n", __func__, __LINE__);
+	}
+
+	n = read(in, split->buffer, size < SPLIT_CHUNK ? size : SPLIT_CHUNK);
+	if (n > 0 && write_all(&out, split->buffer, n, split->opt) != n)
+		return -1;
+	return n;
+}
+
+static void *split_sync(void *arg) {
+
+	split_ctx *split = arg;
+
+	if (fsync(split->sync_fd) == -1 || close(split->sync_fd) == -1)
+		log_mesg(0, 1, 1, split->opt->debug, "segment sync ERROR: %s\n", strerror(errno));
+	return NULL;
+}
+
+static void *split_writer(void *arg) {
+
+	split_ctx *split = arg;
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE | (split->opt->overwrite ? 0 : O_EXCL);
+	char path[PATH_MAX];
+	pthread_t sync_thread;
+	int syncing = 0, fd;
+	unsigned int i;
+
+	for (i = 0; ; i++) {
+		unsigned long long left = split->opt->split_size;
+		struct pollfd pfd = { split->pipe_fd, POLLIN, 0 };
+
+		/// no empty segment after the last one
+		while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+			;
+		if (!(pfd.revents & POLLIN))
+			break;
+
+		segment_path(split, i, i % split->dir_count, path);
+		log_mesg(1, 0, 0, split->opt->debug, "write segment %s\n", path);
+		fd = open(path, flags, S_IRUSR | S_IWUSR);
+		if (fd == -1)
+			log_mesg(0, 1, 1, split->opt->debug, "open segment %s ERROR: %s\n", path, strerror(errno));
+
+		while (left) {
+			ssize_t n = split_move(split, split->pipe_fd, fd, left < SPLIT_CHUNK ? left : SPLIT_CHUNK);
+
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1)
+				log_mesg(0, 1, 1, split->opt->debug, "write segment %s ERROR: %s\n", path, strerror(errno));
+			if (n == 0)
+				break;
+			left -= n;
+		}
+
+		/// the next segment goes on while this one reaches the disk
+		if (syncing)
+			pthread_join(sync_thread, NULL);
+		split->sync_fd = fd;
+		syncing = !pthread_create(&sync_thread, NULL, split_sync, split);
+		if (!syncing)
+			split_sync(split);
+
+		if (left)
+			break;
+	}
+
+	if (syncing)
+		pthread_join(sync_thread, NULL);
+	close(split->pipe_fd);
+	return NULL;
+}
+
+/// open the segment i, looking in its own directory first
+static int segment_open(split_ctx *split, unsigned int i, char *path) {
+
+	int d, fd;
+
+	if (i == 0) {
+		snprintf(path, PATH_MAX, "%s", split->first);
+		return open(path, O_RDONLY | O_LARGEFILE);
+	}
+
+	for (d = 0; d < split->dir_count; d++) {
+		segment_path(split, i, (i + d) % split->dir_count, path);
+		fd = open(path, O_RDONLY | O_LARGEFILE);
+		if (fd != -1 || errno != ENOENT)
+			return fd;
+	}
+
+	return -1;
+}
+
+static void *split_reader(void *arg) {
+
+	split_ctx *split = arg;
+	char path[PATH_MAX];
+	sigset_t set;
+	unsigned int i;
+	int fd;
+
+	/// partclone may close the pipe before the end, get EPIPE instead of the signal
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (i = 0; ; i++) {
+		fd = segment_open(split, i, path);
+		if (fd == -1 && i > 0 && errno == ENOENT)
+			break;
+		if (fd == -1)
+			log_mesg(0, 1, 1, split->opt->debug, "open segment %s ERROR: %s\n", path, strerror(errno));
+		log_mesg(1, 0, 0, split->opt->debug, "read segment %s\n", path);
+
+		for (;;) {
+			ssize_t n = split_move(split, fd, split->pipe_fd, SPLIT_CHUNK);
+
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && errno == EPIPE) {
+				close(fd);
+				goto out;
+			}
+			if (n == -1)
+				log_mesg(0, 1, 1, split->opt->debug, "read segment %s ERROR: %s\n", path, strerror(errno));
+			if (n == 0)
+				break;
+		}
+		close(fd);
+	}
+
+out:
+	close(split->pipe_fd);
+	return NULL;
+}
+
+/// start the thread on the end keep of a pipe (0: read, 1: write), return the other end
+static int split_start(split_ctx *split, void *(*thread)(void *), int keep) {
+
+	int pipefd[2];
+
+	if (pipe(pipefd) == -1)
+		log_mesg(0, 1, 1, split->opt->debug, "%s, %i, pipe error: %s\n", __func__, __LINE__, strerror(errno));
+#ifdef F_SETPIPE_SZ
+	fcntl(pipefd[1], F_SETPIPE_SZ, SPLIT_CHUNK);
+#endif
+	split->pipe_fd = pipefd[keep];
+	split->fd = pipefd[!keep];
+
+	if (pthread_create(&split->thread, NULL, thread, split))
+		log_mesg(0, 1, 1, split->opt->debug, "%s, %i, thread create error\n", __func__, __LINE__);
+	split->next = splits;
+	splits = split;
+
+	return split->fd;
+}
+
+int split_open_target(const char *target, cmd_opt *opt) {
+
+	split_ctx *split = split_init(target, 0, opt);
+
+	log_mesg(0, 0, 1, opt->debug, "Split the image in segments of %llu bytes, %s/%s%s and next\n",
+		opt->split_size, split->dirs[0], split->name, SPLIT_FIRST_SUFFIX);
+
+	return split_start(split, split_writer, 0);
+}
+
+int split_open_source(const char *source, cmd_opt *opt) {
+
+	split_ctx *split = split_init(source, strlen(SPLIT_FIRST_SUFFIX), opt);
+
+	split->first = source;
+	log_mesg(1, 0, 0, opt->debug, "read the segments of %s/%s\n", split->dirs[0], split->name);
+
+	return split_start(split, split_reader, 1);
+}
+
+int split_is_segment(const char *source) {
+
+	size_t len = strlen(source), suffix = strlen(SPLIT_FIRST_SUFFIX);
+
+	return len > suffix && strcmp(source + len - suffix, SPLIT_FIRST_SUFFIX) == 0;
+}
+
+int split_close(int fd) {
+
+	int ret = close(fd);
+	split_ctx **p;
+
+	for (p = &splits; *p; p = &(*p)->next) {
+		if ((*p)->fd == fd) {
+			split_ctx *split = *p;
+
+			*p = split->next;
+			pthread_join(split->thread, NULL);
+			split_free(split);
+			break;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,40 @@
+/**
+ * split.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * images cut in numbered segments, written and read natively.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef SPLIT_H_
+#define SPLIT_H_
+
+struct cmd_opt;
+
+/// suffix of the first segment, the segment i is <image>.<i on 3 digits or more>
+#define SPLIT_FIRST_SUFFIX ".000"
+
+/**
+ * The image goes through a pipe to a thread which cuts it in segments of
+ * opt->split_size bytes. The segments rotate over the directory of target
+ * and the --split-dir ones. A full segment is fsync'd on another thread
+ * while the next one is written. Each fd has its own thread, a reader and
+ * a writer can be open at once.
+ *
+ * split_open_target	- start the writer, return the fd to write the image to
+ * split_open_source	- start the reader of the segments following source, which
+ *			  ends with SPLIT_FIRST_SUFFIX, return the fd to read the image from
+ * split_is_segment	- 1 when source names the first segment of an image
+ * split_close		- close fd and wait for its segments, 0 or -1 like close()
+ */
+extern int split_open_target(const char *target, struct cmd_opt *opt);
+extern int split_open_source(const char *source, struct cmd_opt *opt);
+extern int split_is_segment(const char *source);
+extern int split_close(int fd);
+
+#endif /* SPLIT_H_ */
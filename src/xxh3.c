@@ -0,0 +1,453 @@
+/**
+ * xxh3.c - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * XXH3 64 bits hash, compatible with XXH3_64bits_withSeed() from xxHash.
+ *
+ * The algorithm is Yann Collet's XXH3 (xxHash 0.8, BSD 2-Clause). Only the
+ * one-shot seeded 64 bits variant is implemented, which is all the image
+ * checksum needs. Inputs up to 240 bytes use the scalar short paths, longer
+ * ones use the stripe accumulator, with SSE2 and AVX2 versions on x86-64
+ * picked at run time after a self test against the scalar one.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <pthread.h>
+#include "partclone.h"
+#include "xxh3.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_XXH3_X86 1
+#endif
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define SECRET_SIZE		192
+#define SECRET_SIZE_MIN		136
+#define STRIPE_LEN		64
+#define SECRET_CONSUME_RATE	8
+#define ACC_NB			8
+#define MIDSIZE_MAX		240
+#define MIDSIZE_STARTOFFSET	3
+#define MIDSIZE_LASTOFFSET	17
+#define SECRET_LASTACC_START	7
+#define SECRET_MERGEACCS_START	11
+
+static const unsigned char kSecret[SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/// accumulate nb_stripes stripes of input, then scramble, for one secret sized block
+typedef void (*xxh3_accumulate_fn)(uint64_t *acc, const unsigned char *input, const unsigned char *secret, size_t nb_stripes);
+typedef void (*xxh3_scramble_fn)(uint64_t *acc, const unsigned char *secret);
+
+static xxh3_accumulate_fn xxh3_accumulate;
+static xxh3_scramble_fn xxh3_scramble;
+static pthread_once_t xxh3_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t read_le32(const unsigned char *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t read_le64(const unsigned char *p) {
+	return (uint64_t)read_le32(p) | (uint64_t)read_le32(p + 4) << 32;
+}
+
+static inline void write_le64(unsigned char *p, uint64_t v) {
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t swap32(uint32_t x) {
+	return __builtin_bswap32(x);
+}
+
+static inline uint64_t swap64(uint64_t x) {
+	return __builtin_bswap64(x);
+}
+
+static inline uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs) {
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 product = (unsigned __int128)lhs * rhs;
+
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+	/// 32 bits hosts, schoolbook multiplication
+	uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+	uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+	uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+	uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+	uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+
+	return lower ^ upper;
+#endif
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len) {
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	return h ^ (h >> 28);
+}
+
+static uint64_t xxh3_len_0to16(const unsigned char *input, size_t len, uint64_t seed) {
+
+	if (len > 8) {
+		uint64_t bitflip1 = (read_le64(kSecret + 24) ^ read_le64(kSecret + 32)) + seed;
+		uint64_t bitflip2 = (read_le64(kSecret + 40) ^ read_le64(kSecret + 48)) - seed;
+		uint64_t input_lo = read_le64(input) ^ bitflip1;
+		uint64_t input_hi = read_le64(input + len - 8) ^ bitflip2;
+
+		return xxh3_avalanche(len + swap64(input_lo) + input_hi + mul128_fold64(input_lo, input_hi));
+	}
+	if (len >= 4) {
+		uint64_t bitflip, input64;
+
+		seed ^= (uint64_t)swap32((uint32_t)seed) << 32;
+		bitflip = (read_le64(kSecret + 8) ^ read_le64(kSecret + 16)) - seed;
+		input64 = read_le32(input + len - 4) + ((uint64_t)read_le32(input) << 32);
+		return xxh3_rrmxmx(input64 ^ bitflip, len);
+	}
+	if (len) {
+		uint32_t combined = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24) |
+				    (uint32_t)input[len - 1] | ((uint32_t)len << 8);
+		uint64_t bitflip = (read_le32(kSecret) ^ read_le32(kSecret + 4)) + seed;
+
+		return xxh64_avalanche((uint64_t)combined ^ bitflip);
+	}
+	return xxh64_avalanche(seed ^ (read_le64(kSecret + 56) ^ read_le64(kSecret + 64)));
+}
+
+static inline uint64_t xxh3_mix16(const unsigned char *input, const unsigned char *secret, uint64_t seed) {
+	return mul128_fold64(read_le64(input) ^ (read_le64(secret) + seed),
+			     read_le64(input + 8) ^ (read_le64(secret + 8) - seed));
+}
+
+static uint64_t xxh3_len_17to128(const unsigned char *input, size_t len, uint64_t seed) {
+
+	uint64_t acc = len * PRIME64_1;
+
+	if (len > 32) {
+		if (len > 64) {
+			if (len > 96) {
+				acc += xxh3_mix16(input + 48, kSecret + 96, seed);
+				acc += xxh3_mix16(input + len - 64, kSecret + 112, seed);
+			}
+			acc += xxh3_mix16(input + 32, kSecret + 64, seed);
+			acc += xxh3_mix16(input + len - 48, kSecret + 80, seed);
+		}
+		acc += xxh3_mix16(input + 16, kSecret + 32, seed);
+		acc += xxh3_mix16(input + len - 32, kSecret + 48, seed);
+	}
+	acc += xxh3_mix16(input, kSecret, seed);
+	acc += xxh3_mix16(input + len - 16, kSecret + 16, seed);
+
+	return xxh3_avalanche(acc);
+}
+
+static uint64_t xxh3_len_129to240(const unsigned char *input, size_t len, uint64_t seed) {
+
+	uint64_t acc = len * PRIME64_1, acc_end;
+	unsigned int rounds = (unsigned int)len / 16;
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		acc += xxh3_mix16(input + 16 * i, kSecret + 16 * i, seed);
+	acc_end = xxh3_mix16(input + len - 16, kSecret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET, seed);
+	acc = xxh3_avalanche(acc);
+	for (i = 8; i < rounds; i++)
+		acc_end += xxh3_mix16(input + 16 * i, kSecret + 16 * (i - 8) + MIDSIZE_STARTOFFSET, seed);
+
+	return xxh3_avalanche(acc + acc_end);
+}
+
+static void xxh3_accumulate_scalar(uint64_t *acc, const unsigned char *input, const unsigned char *secret, size_t nb_stripes) {
+
+	size_t n, lane;
+
+	for (n = 0; n < nb_stripes; n++) {
+		const unsigned char *in = input + n * STRIPE_LEN;
+		const unsigned char *sec = secret + n * SECRET_CONSUME_RATE;
+
+		for (lane = 0; lane < ACC_NB; lane++) {
+			uint64_t data_val = read_le64(in + lane * 8);
+			uint64_t data_key = data_val ^ read_le64(sec + lane * 8);
+
+			acc[lane ^ 1] += data_val;
+			acc[lane] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+		}
+	}
+}
+
+static void xxh3_scramble_scalar(uint64_t *acc, const unsigned char *secret) {
+
+	size_t lane;
+
+	for (lane = 0; lane < ACC_NB; lane++) {
+		uint64_t a = acc[lane];
+
+		a ^= a >> 47;
+		a ^= read_le64(secret + lane * 8);
+		a *= PRIME32_1;
+		acc[lane] = a;
+	}
+}
+
+#ifdef HAVE_XXH3_X86
+/// SSE2 is part of x86-64, no run time check needed
+static void xxh3_accumulate_sse2(uint64_t *acc, const unsigned char *input, const unsigned char *secret, size_t nb_stripes) {
+
+	__m128i *xacc = (__m128i *)acc;
+	size_t n;
+	int i;
+
+	for (n = 0; n < nb_stripes; n++) {
+		const __m128i *in = (const __m128i *)(input + n * STRIPE_LEN);
+		const __m128i *sec = (const __m128i *)(secret + n * SECRET_CONSUME_RATE);
+
+		for (i = 0; i < STRIPE_LEN / 16; i++) {
+			__m128i data_vec = _mm_loadu_si128(in + i);
+			__m128i data_key = _mm_xor_si128(data_vec, _mm_loadu_si128(sec + i));
+			__m128i data_key_lo = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+			__m128i product = _mm_mul_epu32(data_key, data_key_lo);
+			__m128i data_swap = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+
+			xacc[i] = _mm_add_epi64(product, _mm_add_epi64(xacc[i], data_swap));
+		}
+	}
+}
+
+static void xxh3_scramble_sse2(uint64_t *acc, const unsigned char *secret) {
+
+	__m128i *xacc = (__m128i *)acc;
+	const __m128i prime32 = _mm_set1_epi32((int)PRIME32_1);
+	int i;
+
+	for (i = 0; i < STRIPE_LEN / 16; i++) {
+		__m128i a = xacc[i];
+		__m128i data_key = _mm_xor_si128(_mm_xor_si128(a, _mm_srli_epi64(a, 47)),
+						 _mm_loadu_si128((const __m128i *)secret + i));
+		__m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+		__m128i prod_lo = _mm_mul_epu32(data_key, prime32);
+		__m128i prod_hi = _mm_mul_epu32(data_key_hi, prime32);
+
+		xacc[i] = _mm_add_epi64(prod_lo, _mm_slli_epi64(prod_hi, 32));
+	}
+}
+
+__attribute__((target("avx2")))
+static void xxh3_accumulate_avx2(uint64_t *acc, const unsigned char *input, const unsigned char *secret, size_t nb_stripes) {
+
+	__m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+	__m256i a1 = _mm256_loadu_si256((const __m256i *)acc + 1);
+	size_t n;
+
+	for (n = 0; n < nb_stripes; n++) {
+		const __m256i *in = (const __m256i *)(input + n * STRIPE_LEN);
+		const __m256i *sec = (const __m256i *)(secret + n * SECRET_CONSUME_RATE);
+		__m256i d0 = _mm256_loadu_si256(in);
+		__m256i d1 = _mm256_loadu_si256(in + 1);
+		__m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256(sec));
+		__m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256(sec + 1));
+
+		a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+		a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+		a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(k0, _mm256_shuffle_epi32(k0, _MM_SHUFFLE(0, 3, 0, 1))));
+		a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(k1, _mm256_shuffle_epi32(k1, _MM_SHUFFLE(0, 3, 0, 1))));
+	}
+
+	_mm256_storeu_si256((__m256i *)acc, a0);
+	_mm256_storeu_si256((__m256i *)acc + 1, a1);
+}
+
+__attribute__((target("avx2")))
+static void xxh3_scramble_avx2(uint64_t *acc, const unsigned char *secret) {
+
+	const __m256i prime32 = _mm256_set1_epi32((int)PRIME32_1);
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)acc + i);
+		__m256i data_key = _mm256_xor_si256(_mm256_xor_si256(a, _mm256_srli_epi64(a, 47)),
+						    _mm256_loadu_si256((const __m256i *)secret + i));
+		__m256i data_key_hi = _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+		__m256i prod_lo = _mm256_mul_epu32(data_key, prime32);
+		__m256i prod_hi = _mm256_mul_epu32(data_key_hi, prime32);
+
+		_mm256_storeu_si256((__m256i *)acc + i, _mm256_add_epi64(prod_lo, _mm256_slli_epi64(prod_hi, 32)));
+	}
+}
+#endif
+
+static uint64_t xxh3_hash_long(const unsigned char *input, size_t len, uint64_t seed,
+			       xxh3_accumulate_fn accumulate, xxh3_scramble_fn scramble) {
+
+	const size_t stripes_per_block = (SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE;
+	const size_t block_len = STRIPE_LEN * stripes_per_block;
+	const size_t nb_blocks = (len - 1) / block_len;
+	uint64_t acc[ACC_NB] __attribute__((aligned(32))) = {
+		PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+	};
+	unsigned char custom[SECRET_SIZE];
+	const unsigned char *secret = kSecret;
+	uint64_t result;
+	size_t n;
+	int i;
+
+	/// a seeded long hash uses a secret derived from the seed
+	if (seed) {
+		for (i = 0; i < SECRET_SIZE / 16; i++) {
+			write_le64(custom + 16 * i, read_le64(kSecret + 16 * i) + seed);
+			write_le64(custom + 16 * i + 8, read_le64(kSecret + 16 * i + 8) - seed);
+		}
+		secret = custom;
+	}
+
+	for (n = 0; n < nb_blocks; n++) {
+		accumulate(acc, input + n * block_len, secret, stripes_per_block);
+		scramble(acc, secret + SECRET_SIZE - STRIPE_LEN);
+	}
+
+	/// last partial block and last stripe
+	accumulate(acc, input + nb_blocks * block_len, secret, ((len - 1) - block_len * nb_blocks) / STRIPE_LEN);
+	accumulate(acc, input + len - STRIPE_LEN, secret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START, 1);
+
+	/// merge the accumulators
+	result = len * PRIME64_1;
+	for (i = 0; i < 4; i++)
+		result += mul128_fold64(acc[2 * i] ^ read_le64(secret + SECRET_MERGEACCS_START + 16 * i),
+					acc[2 * i + 1] ^ read_le64(secret + SECRET_MERGEACCS_START + 16 * i + 8));
+
+	return xxh3_avalanche(result);
+}
+
+uint64_t xxh3_64(const void *buf, size_t size, uint64_t seed) {
+
+	const unsigned char *input = (const unsigned char *)buf;
+
+	if (size <= 16)
+		return xxh3_len_0to16(input, size, seed);
+	if (size <= 128)
+		return xxh3_len_17to128(input, size, seed);
+	if (size <= MIDSIZE_MAX)
+		return xxh3_len_129to240(input, size, seed);
+	return xxh3_hash_long(input, size, seed, xxh3_accumulate, xxh3_scramble);
+}
+
+/// compare a long path implementation with the scalar one
+static int xxh3_self_test(xxh3_accumulate_fn accumulate, xxh3_scramble_fn scramble) {
+
+	static unsigned char data[4 * 1024 + 7];
+	static const size_t lens[] = { 241, 255, 256, 1024, 1025, 4096, 4100 };
+	static const uint64_t seeds[] = { 0, 1, 0x9E3779B97F4A7C15ULL };
+	uint32_t x = 0x2545f491;
+	size_t i, j, k;
+
+	for (i = 0; i < sizeof(data); i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = (unsigned char)x;
+	}
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		for (j = 0; j < sizeof(seeds) / sizeof(seeds[0]); j++) {
+			for (k = 0; k + lens[i] <= sizeof(data) && k < 4; k++) {
+				if (xxh3_hash_long(data + k, lens[i], seeds[j], accumulate, scramble) !=
+				    xxh3_hash_long(data + k, lens[i], seeds[j], xxh3_accumulate_scalar, xxh3_scramble_scalar))
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static void xxh3_setup(void) {
+
+	extern cmd_opt opt;
+	const char *name = "scalar";
+
+	xxh3_accumulate = xxh3_accumulate_scalar;
+	xxh3_scramble = xxh3_scramble_scalar;
+
+#ifdef HAVE_XXH3_X86
+	if (xxh3_self_test(xxh3_accumulate_sse2, xxh3_scramble_sse2)) {
+		xxh3_accumulate = xxh3_accumulate_sse2;
+		xxh3_scramble = xxh3_scramble_sse2;
+		name = "sse2";
+	} else
+		log_mesg(1, 0, 0, opt.debug, "xxh3: sse2 fails the self test, not used\n");
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		if (xxh3_self_test(xxh3_accumulate_avx2, xxh3_scramble_avx2)) {
+			xxh3_accumulate = xxh3_accumulate_avx2;
+			xxh3_scramble = xxh3_scramble_avx2;
+			name = "avx2";
+		} else
+			log_mesg(1, 0, 0, opt.debug, "xxh3: avx2 fails the self test, not used\n");
+	}
+#else
+	(void)xxh3_self_test;
+#endif
+
+	log_mesg(1, 0, 0, opt.debug, "xxh3: using the %s implementation\n", name);
+}
+
+void xxh3_init(void) {
+	pthread_once(&xxh3_once, xxh3_setup);
+}
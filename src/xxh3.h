@@ -0,0 +1,24 @@
+/**
+ * xxh3.h - Part of Partclone project.
+ *
+ * Copyright (c) 2007~ Thomas Tsai <thomas at nchc org tw>
+ *
+ * XXH3 64 bits hash, compatible with XXH3_64bits_withSeed() from xxHash.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef XXH3_H_
+#define XXH3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// pick the fastest accumulator, run the self test. Called by init_checksum().
+extern void xxh3_init(void);
+extern uint64_t xxh3_64(const void *buf, size_t size, uint64_t seed);
+
+#endif /* XXH3_H_ */